@@ -4,6 +4,7 @@
 #include "packet.h"
 #include "ether.h"
 #include "arpcache.h"
+#include "pktbuf.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -13,9 +14,9 @@
 void arp_send_request(iface_info_t *iface, u32 dst_ip)
 {
 	int len = ETHER_HDR_SIZE + sizeof(struct ether_arp);
-	char *packet = malloc(len);
+	char *packet = pktbuf_alloc(len);
 	if (!packet) {
-		log(ERROR, "malloc arp request failed.");
+		log(ERROR, "allocate arp request failed.");
 		return ;
 	}
 
@@ -44,9 +45,9 @@ void arp_send_request(iface_info_t *iface, u32 dst_ip)
 void arp_send_reply(iface_info_t *iface, struct ether_arp *req_hdr)
 {
 	int len = ETHER_HDR_SIZE + sizeof(struct ether_arp);
-	char *packet = malloc(len);
+	char *packet = pktbuf_alloc(len);
 	if (!packet) {
-		log(ERROR, "malloc arp request failed.");
+		log(ERROR, "allocate arp reply failed.");
 		return ;
 	}
 
@@ -92,7 +93,7 @@ void handle_arp_packet(iface_info_t *iface, char *packet, int len)
 		}
 	}
 
-	free(packet);
+	packet_free(packet);
 }
 
 // This function should free the memory of the packet if needed.
@@ -32,6 +32,12 @@ int arpcache_lookup(u32 ip4, u8 mac[ETH_ALEN])
 
 void arpcache_append_packet(iface_info_t *iface, u32 ip4, char *packet, int len)
 {
+	// the packet is pended until the arp reply arrives, which outlives the
+	// frame borrowed from a receive ring
+	packet = packet_own(packet, len);
+	if (!packet)
+		return ;
+
 	struct cached_pkt *pkt_entry = malloc(sizeof(struct cached_pkt));
 	pkt_entry->packet = packet;
 	pkt_entry->len = len;
@@ -121,56 +127,80 @@ void arpcache_insert(u32 ip4, u8 mac[ETH_ALEN])
 	pthread_mutex_unlock(&(arpcache.lock));
 }
 
-void *arpcache_sweep(void *arg) 
+// invalidate the entries which have stayed for ARP_ENTRY_TIMEOUT, resend the
+// pending arp requests, and give up those which have been retried for
+// ARP_REQUEST_MAX_RETRIES
+void arpcache_expire()
 {
-	while (1) {
-		sleep(1);
-		time_t now = time(NULL);
-
-		pthread_mutex_lock(&arpcache.lock);
-	
-		struct arp_cache_entry *entries = arpcache.entries;
-		for (int i = 0; i < MAX_ARP_SIZE; i++) {
-			if (entries[i].valid && now - entries[i].added >= ARP_ENTRY_TIMEOUT) 
-				entries[i].valid = 0;
-		}
+	time_t now = time(NULL);
 
-		struct list_head pkt_list;
-		init_list_head(&pkt_list);
+	pthread_mutex_lock(&arpcache.lock);
 
-		struct arp_req *req_entry = NULL, *req_q;
-		list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
-			if (now - req_entry->sent < 1)
-				continue;
+	struct arp_cache_entry *entries = arpcache.entries;
+	for (int i = 0; i < MAX_ARP_SIZE; i++) {
+		if (entries[i].valid && now - entries[i].added >= ARP_ENTRY_TIMEOUT) 
+			entries[i].valid = 0;
+	}
 
-			if (req_entry->retries < ARP_REQUEST_MAX_RETRIES) {
-				// resend the arp request
-				req_entry->retries += 1;
-				arp_send_request(req_entry->iface, req_entry->ip4);
+	struct list_head pkt_list;
+	init_list_head(&pkt_list);
 
-				continue;
-			}
-	
-			struct cached_pkt *pkt_entry = NULL, *pkt_q;
-			list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
-				list_delete_entry(&(pkt_entry->list));
-				list_add_tail(&(pkt_entry->list), &pkt_list);
-			}
-	
-			list_delete_entry(&(req_entry->list));
-			free(req_entry);
+	struct arp_req *req_entry = NULL, *req_q;
+	list_for_each_entry_safe(req_entry, req_q, &(arpcache.req_list), list) {
+		if (now - req_entry->sent < 1)
+			continue;
+
+		if (req_entry->retries < ARP_REQUEST_MAX_RETRIES) {
+			// resend the arp request
+			req_entry->retries += 1;
+			arp_send_request(req_entry->iface, req_entry->ip4);
+
+			continue;
 		}
-	
-		pthread_mutex_unlock(&arpcache.lock);
 
 		struct cached_pkt *pkt_entry = NULL, *pkt_q;
-		list_for_each_entry_safe(pkt_entry, pkt_q, &pkt_list, list) {
+		list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
 			list_delete_entry(&(pkt_entry->list));
-			icmp_send_packet(pkt_entry->packet, pkt_entry->len, \
-					ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
-			free(pkt_entry->packet);
-			free(pkt_entry);
+			list_add_tail(&(pkt_entry->list), &pkt_list);
 		}
+
+		list_delete_entry(&(req_entry->list));
+		free(req_entry);
+	}
+
+	pthread_mutex_unlock(&arpcache.lock);
+
+	struct cached_pkt *pkt_entry = NULL, *pkt_q;
+	list_for_each_entry_safe(pkt_entry, pkt_q, &pkt_list, list) {
+		list_delete_entry(&(pkt_entry->list));
+		icmp_send_packet(pkt_entry->packet, pkt_entry->len, \
+				ICMP_DEST_UNREACH, ICMP_HOST_UNREACH);
+		packet_free(pkt_entry->packet);
+		free(pkt_entry);
+	}
+}
+
+// whether there is any valid entry or pending request, i.e. the arp cache
+// should be swept
+int arpcache_pending()
+{
+	int pending = 0;
+
+	pthread_mutex_lock(&arpcache.lock);
+	for (int i = 0; i < MAX_ARP_SIZE && !pending; i++)
+		pending = arpcache.entries[i].valid;
+	if (!list_empty(&arpcache.req_list))
+		pending = 1;
+	pthread_mutex_unlock(&arpcache.lock);
+
+	return pending;
+}
+
+void *arpcache_sweep(void *arg) 
+{
+	while (1) {
+		sleep(1);
+		arpcache_expire();
 	}
 
 	return NULL;
@@ -184,7 +214,9 @@ void arpcache_init()
 
 	pthread_mutex_init(&arpcache.lock, NULL);
 
-	pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
+	// the cache is swept by the event loop if it is enabled
+	if (!ustack_conf.evloop)
+		pthread_create(&arpcache.thread, NULL, arpcache_sweep, NULL);
 }
 
 void arpcache_destroy()
@@ -196,7 +228,7 @@ void arpcache_destroy()
 		struct cached_pkt *pkt_entry = NULL, *pkt_q;
 		list_for_each_entry_safe(pkt_entry, pkt_q, &(req_entry->cached_packets), list) {
 			list_delete_entry(&(pkt_entry->list));
-			free(pkt_entry->packet);
+			packet_free(pkt_entry->packet);
 			free(pkt_entry);
 		}
 
@@ -204,7 +236,8 @@ void arpcache_destroy()
 		free(req_entry);
 	}
 
-	pthread_kill(arpcache.thread, SIGTERM);
+	if (!ustack_conf.evloop)
+		pthread_kill(arpcache.thread, SIGTERM);
 
 	pthread_mutex_unlock(&arpcache.lock);
 }
@@ -0,0 +1,89 @@
+#include "busypoll.h"
+
+#include <string.h>
+#include <sched.h>
+
+static const struct timespec zero_timeout = { 0, 0 };
+
+static inline u64 busy_poll_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void busy_poll_init(struct busy_poll *bp, int budget_us)
+{
+	memset(bp, 0, sizeof(struct busy_poll));
+	bp->budget = (u64)budget_us * 1000;
+	// start optimistic, the gap converges once frames arrive
+	bp->gap = bp->budget / 2;
+}
+
+const struct timespec *busy_poll_timeout(struct busy_poll *bp)
+{
+	u64 now = busy_poll_now();
+	bp->poll_start = now;
+
+	if (bp->deadline && now < bp->deadline) {
+		// give way to the runnable threads, e.g. the applications, which
+		// would otherwise wait for the spin to end on the same cpu
+		if (!bp->spin_start)
+			bp->spin_start = now;
+		else
+			sched_yield();
+		bp->spinning = 1;
+		return &zero_timeout;
+	}
+
+	// the spin is over without any frame
+	if (bp->spin_start) {
+		bp->idle_ns += now - bp->spin_start;
+		bp->misses += 1;
+		bp->spin_start = 0;
+	}
+	bp->deadline = 0;
+	bp->spinning = 0;
+
+	return NULL;
+}
+
+void busy_poll_update(struct busy_poll *bp, int frames)
+{
+	u64 now = busy_poll_now();
+	if (!bp->spinning) {
+		bp->blocked_ns += now - bp->poll_start;
+		bp->blocks += 1;
+	}
+
+	if (!frames)
+		return ;
+
+	if (bp->spin_start) {
+		bp->busy_ns += now - bp->spin_start;
+		bp->hits += 1;
+		bp->spin_start = 0;
+	}
+
+	if (bp->last_arrival) {
+		u64 gap = now - bp->last_arrival;
+		bp->gap = bp->gap - (bp->gap >> BUSY_POLL_GAP_SHIFT) + \
+				  (gap >> BUSY_POLL_GAP_SHIFT);
+	}
+	bp->last_arrival = now;
+
+	// spin only if the next frame is expected within the budget
+	bp->deadline = bp->budget && bp->gap <= bp->budget ? now + bp->budget : 0;
+}
+
+void busy_poll_dump_stats(struct busy_poll *bp, const char *name, FILE *fp)
+{
+	if (!bp->budget)
+		return ;
+
+	fprintf(fp, "%s: busy poll %lu us budget, %.1lf us average gap, "
+			"spin %.3lf s busy (%lu hits), %.3lf s idle (%lu misses), "
+			"blocked %.3lf s (%lu polls)\n", name, bp->budget / 1000,
+			bp->gap / 1e3, bp->busy_ns / 1e9, bp->hits, bp->idle_ns / 1e9,
+			bp->misses, bp->blocked_ns / 1e9, bp->blocks);
+}
@@ -0,0 +1,222 @@
+#include "evloop.h"
+#include "base.h"
+#include "list.h"
+#include "arpcache.h"
+#include "tcp_timer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+// an operation asked by an application, which waits until it is done
+struct evloop_call {
+	struct list_head list;
+	void (*fn)(void *arg);
+	void *arg;
+	int done;
+};
+
+static int timer_fd = -1;
+static int event_fd = -1;
+static pthread_t loop_thread;
+
+static pthread_mutex_t call_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t call_done = PTHREAD_COND_INITIALIZER;
+static struct list_head call_list;
+
+// when the work is due (in nano second), 0 means there is nothing to do
+static u64 next_tcp_scan = 0;
+static u64 next_arp_sweep = 0;
+// the due time the timer is armed at, 0 means disarmed
+static u64 armed = 0;
+
+static u64 timer_wakeups;		// times the timer fd is readable
+static u64 tcp_scans;			// scans of the tcp timers
+static u64 arp_sweeps;			// sweeps of the arp cache
+static u64 pacing_runs;			// runs of the pacing timers
+static u64 call_wakeups;		// times the event fd is readable
+static u64 calls;				// operations run for the applications
+
+static inline u64 evloop_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// the loop is run by the thread initializing it
+void evloop_init()
+{
+	init_list_head(&call_list);
+	loop_thread = pthread_self();
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timer_fd < 0) {
+		perror("timerfd_create() failed");
+		exit(1);
+	}
+
+	event_fd = eventfd(0, EFD_NONBLOCK);
+	if (event_fd < 0) {
+		perror("eventfd() failed");
+		exit(1);
+	}
+}
+
+int evloop_timer_fd()
+{
+	return timer_fd;
+}
+
+int evloop_event_fd()
+{
+	return event_fd;
+}
+
+// the work is scheduled one interval after it becomes pending, and is
+// cancelled once nothing is pending
+static inline void evloop_schedule(u64 *next, int pending, u64 interval, u64 now)
+{
+	if (!pending)
+		*next = 0;
+	else if (!*next)
+		*next = now + interval;
+}
+
+void evloop_arm()
+{
+	u64 now = evloop_now();
+	evloop_schedule(&next_tcp_scan, tcp_timer_pending(),
+			(u64)TCP_TIMER_SCAN_INTERVAL * 1000, now);
+	evloop_schedule(&next_arp_sweep, arpcache_pending(),
+			(u64)EVLOOP_ARP_SWEEP_INTERVAL * 1000, now);
+
+	u64 due = next_tcp_scan;
+	if (!due || (next_arp_sweep && next_arp_sweep < due))
+		due = next_arp_sweep;
+	// the segments held by pacing are due at their own time
+	u64 pacing = tcp_pacing_timer_next() * 1000;
+	if (!due || (pacing && pacing < due))
+		due = pacing;
+
+	if (due == armed)
+		return ;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000000;
+	its.it_value.tv_nsec = due % 1000000000;
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime() failed");
+
+	armed = due;
+}
+
+void evloop_run_timers()
+{
+	u64 expirations;
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno != EAGAIN)
+			perror("read timerfd failed");
+		return ;
+	}
+
+	// the timer is one-shot, it is disarmed once fired
+	armed = 0;
+	timer_wakeups += 1;
+
+	u64 now = evloop_now();
+	if (next_tcp_scan && now >= next_tcp_scan) {
+		next_tcp_scan = 0;
+		tcp_scans += 1;
+		tcp_scan_timer_list();
+	}
+
+	u64 pacing = tcp_pacing_timer_next() * 1000;
+	if (pacing && now >= pacing) {
+		pacing_runs += 1;
+		tcp_run_pacing_timers();
+	}
+
+	if (next_arp_sweep && now >= next_arp_sweep) {
+		next_arp_sweep = 0;
+		arp_sweeps += 1;
+		arpcache_expire();
+	}
+}
+
+void evloop_run_calls()
+{
+	u64 count;
+	if (read(event_fd, &count, sizeof(count)) < 0) {
+		if (errno != EAGAIN)
+			perror("read eventfd failed");
+		return ;
+	}
+
+	call_wakeups += 1;
+
+	struct list_head pending;
+	init_list_head(&pending);
+
+	pthread_mutex_lock(&call_lock);
+	while (!list_empty(&call_list)) {
+		struct list_head *node = call_list.next;
+		list_delete_entry(node);
+		list_add_tail(node, &pending);
+	}
+	pthread_mutex_unlock(&call_lock);
+
+	struct evloop_call *call, *q;
+	list_for_each_entry_safe(call, q, &pending, list) {
+		call->fn(call->arg);
+		calls += 1;
+
+		// the call lives on the stack of the application, which may return
+		// as soon as it is done
+		pthread_mutex_lock(&call_lock);
+		list_delete_entry(&call->list);
+		call->done = 1;
+		pthread_cond_broadcast(&call_done);
+		pthread_mutex_unlock(&call_lock);
+	}
+}
+
+void evloop_call(void (*fn)(void *arg), void *arg)
+{
+	if (!ustack_conf.evloop || pthread_equal(pthread_self(), loop_thread)) {
+		fn(arg);
+		return ;
+	}
+
+	struct evloop_call call;
+	call.fn = fn;
+	call.arg = arg;
+	call.done = 0;
+
+	pthread_mutex_lock(&call_lock);
+	list_add_tail(&call.list, &call_list);
+	pthread_mutex_unlock(&call_lock);
+
+	u64 one = 1;
+	if (write(event_fd, &one, sizeof(one)) < 0)
+		perror("write eventfd failed");
+
+	pthread_mutex_lock(&call_lock);
+	while (!call.done)
+		pthread_cond_wait(&call_done, &call_lock);
+	pthread_mutex_unlock(&call_lock);
+}
+
+void evloop_dump_stats(FILE *fp)
+{
+	fprintf(fp, "evloop: %lu timer wakeups, %lu tcp timer scans, %lu pacing "
+			"runs, %lu arp cache sweeps, %lu calls in %lu wakeups\n",
+			timer_wakeups, tcp_scans, pacing_runs, arp_sweeps, calls,
+			call_wakeups);
+}
@@ -3,6 +3,7 @@
 #include "rtable.h"
 #include "arp.h"
 #include "base.h"
+#include "pktbuf.h"
 
 #include "log.h"
 
@@ -24,9 +25,9 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 		out_len = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + icmp_len;
 	}
 
-	char *out_pkt = malloc(out_len);
+	char *out_pkt = pktbuf_alloc(out_len);
 	if (!out_pkt) {
-		log(ERROR, "malloc packet failed when sending icmp packet.");
+		log(ERROR, "allocate packet failed when sending icmp packet.");
 		return ;
 	}
 	memset(out_pkt, 0, out_len);
@@ -59,7 +60,7 @@ void icmp_send_packet(const char *in_pkt, int len, u8 type, u8 code)
 		rt_entry_t *entry = longest_prefix_match(daddr);
 		if (!entry) {
 			log(ERROR, "could not find route entry when sending icmp packet, impossible.");
-			free(out_pkt);
+			pktbuf_put(out_pkt);
 			return ;
 		}
 		saddr = entry->iface->ip;
@@ -44,6 +44,8 @@ typedef struct {
 
 void arpcache_init();
 void arpcache_destroy();
+void arpcache_expire();
+int arpcache_pending();
 
 int arpcache_lookup(u32 ip4, u8 mac[]);
 void arpcache_insert(u32 ip4, u8 mac[]);
@@ -4,8 +4,10 @@
 #include "types.h"
 #include "ether.h"
 #include "list.h"
+#include "busypoll.h"
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
 typedef struct {
 	struct list_head iface_list;	// the list of interfaces
@@ -16,17 +18,114 @@ typedef struct {
 
 extern ustack_t *instance;
 
+struct netdev_ops;
+struct tcp_cong_ops;
+
+typedef struct {
+	const struct netdev_ops *netdev;	// the driver of the interfaces
+	int ring_block_size;		// size of each block of the receive ring
+	int ring_block_nr;			// number of blocks of the receive ring
+	int ring_block_timeout;		// block retire timeout (in milli second)
+	int tx_ring;				// send frames through PACKET_TX_RING
+	int xdp_queue;				// the queue bound by the AF_XDP socket
+	int xdp_drv_mode;			// attach XDP program in driver mode instead
+								// of generic (SKB) mode
+	int xdp_zerocopy;			// bind AF_XDP socket in zero-copy mode
+	double pipe_loss;			// loss rate of the pipe pair (in percent)
+	int pipe_delay;				// one-way delay of the pipe pair (in milli second)
+	int pipe_rate;				// bandwidth of the pipe pair (in Mbit/s), 0 means
+								// unlimited
+	int pipe_queue;				// bytes queued before the pipe pair drops
+								// frames, 0 means unlimited
+	double pipe_reorder;		// frames held longer than the ones after them
+								// (in percent)
+	int pipe_reorder_delay;		// the time they are held for (in milli second)
+	double pipe_spike;			// frames starting a delay spike (in percent)
+	int pipe_spike_delay;		// the time a delay spike lasts (in milli second)
+	const char *pcap_in;		// capture replayed by the pcap driver
+	const char *pcap_out;		// capture of the frames sent by the pcap driver,
+								// NULL means they are discarded
+	u32 pcap_ip;				// address of the pcap interface
+	u32 pcap_mask;				// network mask of the pcap interface
+	u32 pcap_gw;				// default gateway of the pcap interface, 0 means
+								// no default route
+	int pcap_pace;				// replay at the recorded timestamps instead of
+								// as fast as possible
+	int pcap_loops;				// times the capture is replayed, 0 means forever
+	int evloop;					// run the timers and the socket operations in
+								// the receiving loop (see evloop.h)
+	int rx_workers;				// receiving threads of each interface, 0 means
+								// all the interfaces are served by one poll loop
+	int busy_poll;				// the most time spinning on the interfaces after
+								// frames arrive (in micro second), 0 means
+								// always block in poll (see busypoll.h)
+	int tcp_sndbuf;				// send buffer of each tcp sock (in bytes)
+	int tcp_rcvbuf;				// receive buffer of each tcp sock (in bytes)
+	int tcp_rcvbuf_max;			// the most bytes the receive buffer grows to by
+								// auto-tuning, not beyond tcp_rcvbuf means no
+								// auto-tuning
+	int tcp_delack;				// the most time an ack is delayed (in micro
+								// second), 0 means every segment is acked at once
+	int tcp_sack;				// negotiate selective acknowledgements (SACK)
+	int tcp_timestamps;			// negotiate timestamps
+	int tcp_rack;				// detect losses by RACK-TLP (RFC 8985), along
+								// with SACK
+	int tcp_undo;				// undo the window reduced by the spurious
+								// retransmissions (D-SACK, Eifel, F-RTO)
+	int tcp_rto_min;			// bounds of the retransmission timeout (in micro
+	int tcp_rto_max;			// second)
+	const struct tcp_cong_ops *tcp_cong;	// the congestion control of each tcp
+										// sock, unless set by the application
+	int tcp_cwnd_trace;			// trace the window of each algorithm into
+								// cwnd-<algorithm>.txt
+} ustack_conf_t;
+
+extern ustack_conf_t ustack_conf;
+
+struct rx_ring;
+struct tx_ring;
+struct mmsg_rx;
+struct mmsg_tx;
+struct xsk;
+struct rx_queue;
+
 typedef struct {
 	struct list_head list;		// list node used to link all interfaces
 
-	int fd;						// file descriptor for receiving & sending 
-	                            // packets 
+	int fd;						// file descriptor of the interface, also polled
+								// by the first receive queue
 	int index;					// the index (unique ID) of this interface
 	u8	mac[ETH_ALEN];			// mac address of this interface
 	u32 ip;						// ip address of this interface
 	u32 mask;					// ip mask of this interface
 	char name[16];				// name of this interface
 	char ip_str[16];			// string of the ip address
+
+	const struct netdev_ops *ops;	// the driver moving frames of this interface
+	void *priv;					// private data of the driver
+
+	struct rx_queue *rxqs;		// the receive queues
+	int nrxqs;					// number of receive queues
+
+	struct tx_ring *tx_ring;	// transmit ring, only used if tx_ring is configured
+	struct mmsg_tx *mmsg_tx;	// sending queue, only used by the mmsg driver
+	struct xsk *xsk;			// AF_XDP socket, only used by the xdp driver
 } iface_info_t;
 
+// A receive queue of an interface. An interface has a single queue served by
+// the poll loop, or a queue for each of its receiving threads, in which case
+// the kernel spreads the flows over the queues by PACKET_FANOUT.
+struct rx_queue {
+	iface_info_t *iface;		// the interface owning the queue
+	int id;						// index of the queue in the interface
+	int fd;						// file descriptor polled for incoming packets
+	struct rx_ring *rx_ring;	// receive ring, only used by the mmap driver
+	struct mmsg_rx *mmsg_rx;	// receiving vector, only used by the mmsg driver
+
+	pthread_t thread;			// the receiving thread serving the queue
+	u64 polls;					// times the queue is found readable
+	u64 frames;					// number of frames received
+	struct busy_poll busy;		// busy polling of the receiving thread
+};
+
 #endif
@@ -0,0 +1,47 @@
+#ifndef __BUSYPOLL_H__
+#define __BUSYPOLL_H__
+
+#include "types.h"
+
+#include <stdio.h>
+#include <time.h>
+
+// Busy polling keeps polling the descriptors without blocking for a while
+// after frames arrive (enabled by -b), so that the next frame is taken without
+// waiting for the scheduler to wake up the receiving thread.
+//
+// The policy adapts to the arrival rate: the gap between the polls finding
+// frames is averaged, and the loop spins only if the average gap is within
+// the budget, otherwise spinning mostly burns CPU and the loop blocks at once.
+
+#define BUSY_POLL_GAP_SHIFT		3		// weight of a new gap is 1/8
+
+struct busy_poll {
+	u64 budget;				// the most time spinning before blocking (in nano
+							// second), 0 means never spin
+	u64 gap;				// average gap between arrivals (in nano second)
+	u64 last_arrival;		// when frames arrived last time
+	u64 deadline;			// spin until then, 0 means block
+	u64 spin_start;			// when the current spin started, 0 if not spinning
+	u64 poll_start;			// when the current poll started
+	int spinning;			// whether the current poll is non-blocking
+
+	u64 busy_ns;			// time spinning until frames arrived
+	u64 idle_ns;			// time spinning in vain
+	u64 blocked_ns;			// time blocked in poll
+	u64 hits;				// spins ended by frames
+	u64 misses;				// spins ended by the deadline
+	u64 blocks;				// blocking polls
+};
+
+void busy_poll_init(struct busy_poll *bp, int budget_us);
+
+// the timeout of the next poll, zero while spinning, NULL to block
+const struct timespec *busy_poll_timeout(struct busy_poll *bp);
+
+// account the poll which just returned, frames is the number of frames found
+void busy_poll_update(struct busy_poll *bp, int frames);
+
+void busy_poll_dump_stats(struct busy_poll *bp, const char *name, FILE *fp);
+
+#endif
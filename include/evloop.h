@@ -0,0 +1,38 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include "types.h"
+
+#include <stdio.h>
+
+// The event loop lets the receiving loop run all the work of the stack to
+// completion (enabled by -E): besides the interfaces, it polls a timerfd
+// armed for the next due timer, i.e. the scan of the tcp timers and the sweep
+// of the arp cache, and an eventfd signalled by the applications when they
+// ask the loop to run a socket operation (see evloop_call). Thus no other
+// thread touches the state of the protocols, and nothing wakes up when there
+// is no work to do.
+
+#define EVLOOP_ARP_SWEEP_INTERVAL	1000000		// in micro second
+
+void evloop_init();
+
+// descriptors polled by the receiving loop
+int evloop_timer_fd();
+int evloop_event_fd();
+
+// arm the timer for the next due work, called before waiting for events
+void evloop_arm();
+// run the due timers, called when the timer fd is readable
+void evloop_run_timers();
+// run the operations asked by the applications, called when the event fd is
+// readable
+void evloop_run_calls();
+
+// run fn(arg) in the loop, and return once it is done; fn is run at once if
+// the event loop is not enabled or the caller is the loop itself
+void evloop_call(void (*fn)(void *arg), void *arg);
+
+void evloop_dump_stats(FILE *fp);
+
+#endif
@@ -41,16 +41,3 @@ static const char *log_level_str[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
 	} while (0)
 
 #endif
-
-static inline void log_cwnd_update(u32 cwnd, u32 ssthresh)
-{
-	FILE *fp = fopen("cwnd.txt", "a");
-
-	struct timeval tm;
-	gettimeofday(&tm, NULL);
-	double stamp = tm.tv_sec * 1000 + tm.tv_usec*1.0 / 1000;
-	fprintf(fp, "%lf %u %u\n", stamp, cwnd, ssthresh);
-	// log(DEBUG, "CWND=%u SSTHRESH=%u", cwnd, ssthresh);
-
-	fclose(fp);
-}
@@ -0,0 +1,63 @@
+#ifndef __NETDEV_H__
+#define __NETDEV_H__
+
+#include "base.h"
+#include "types.h"
+
+#include <stdio.h>
+
+#define NETDEV_RX_BUDGET	64		// frames received from one interface before
+									// turning to the others
+#define NETDEV_MAX_WORKERS	64		// receiving threads of each interface
+
+// the operations of a netdev driver, which moves frames between an interface
+// and the stack
+struct netdev_ops {
+	const char *name;
+
+	// create the interfaces served by the driver, together with their routes;
+	// NULL for drivers working on kernel interfaces, which are found by
+	// getifaddrs and routed by the kernel routing table
+	int (*probe)();
+
+	// whether the frames of an interface could be spread over several receive
+	// queues, i.e. the driver supports receiving threads (see ustack_conf_t)
+	int fanout;
+
+	// get the interface ready, together with its iface->nrxqs receive queues,
+	// the fd of each queue should be set to a descriptor that is readable
+	// when frames arrive on the queue
+	int (*open)(iface_info_t *iface);
+
+	// receive at most budget frames from rxq and hand them to handle_packet,
+	// return the number of frames received
+	int (*rx_burst)(struct rx_queue *rxq, int budget);
+
+	// queue n frames for sending, the frames are copied, and are sent at the
+	// latest when flush is called
+	void (*tx_burst)(iface_info_t *iface, char **packets, int *lens, int n);
+	void (*flush)(iface_info_t *iface);
+
+	void (*close)(iface_info_t *iface);
+
+	// optional, whether packet is a frame lent by the driver (see packet.h)
+	int (*contains)(iface_info_t *iface, const char *packet);
+
+	// optional, dump the statistics of the driver
+	void (*dump_stats)(iface_info_t *iface, FILE *fp);
+};
+
+extern const struct netdev_ops packet_ops;
+extern const struct netdev_ops mmap_ops;
+extern const struct netdev_ops mmsg_ops;
+extern const struct netdev_ops xdp_ops;
+extern const struct netdev_ops pipe_ops;
+extern const struct netdev_ops pcap_ops;
+
+const struct netdev_ops *netdev_find(const char *name);
+void netdev_list(FILE *fp);
+
+// the entry of the stack for incoming frames, called by the drivers
+void handle_packet(iface_info_t *iface, char *packet, int len);
+
+#endif
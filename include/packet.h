@@ -5,6 +5,20 @@
 #include "types.h"
 
 void iface_send_packet(iface_info_t *iface, char *packet, int len);
+void iface_tx_batch_begin();
+void iface_tx_batch_end();
 void broadcast_packet(iface_info_t *iface, char *packet, int len);
 
+// packets are packet buffers (see pktbuf.h), except the frames handed to
+// handle_packet which may be borrowed from a receive ring, they must not be
+// kept after the handler returns
+int packet_is_borrowed(const char *packet);
+// release a packet, borrowed frames are given back with their ring block
+void packet_free(char *packet);
+// get a packet that could be kept after the handler returns, a borrowed frame
+// is copied, while an owned packet is returned as it is
+char *packet_own(char *packet, int len);
+// like packet_own, but the caller keeps its own reference of an owned packet
+char *packet_hold(char *packet, int len);
+
 #endif
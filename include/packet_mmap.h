@@ -0,0 +1,68 @@
+#ifndef __PACKET_MMAP_H__
+#define __PACKET_MMAP_H__
+
+#include "base.h"
+#include "types.h"
+
+#include <stdio.h>
+#include <pthread.h>
+
+// default geometry of the TPACKET_V3 receive ring, could be overridden by
+// command line options (see ustack_conf_t)
+#define RX_RING_BLOCK_SIZE		(1 << 17)	// 128 KB per block
+#define RX_RING_BLOCK_NR		64			// number of blocks in the ring
+#define RX_RING_FRAME_SIZE		2048		// room reserved for one frame
+#define RX_RING_BLOCK_TIMEOUT	10			// in milli second, retire a
+											// partially filled block
+
+// per-block frame counts are accumulated into power-of-two buckets:
+// [1], [2, 3], [4, 7], ..., [2^(N-1), inf)
+#define RX_RING_HIST_BUCKETS	12
+
+// mmap'ed TPACKET_V3 receive ring attached to the socket of a receive queue
+struct rx_ring {
+	char *map;				// start of the mapped ring
+	size_t map_len;			// length of the mapped ring
+	int block_size;			// size of each block
+	int block_nr;			// number of blocks
+	int cur;				// the next block to be examined
+
+	u64 blocks;				// number of blocks consumed
+	u64 frames;				// number of frames consumed
+	u32 max_frames;			// most frames found in one block
+	u64 hist[RX_RING_HIST_BUCKETS];		// histogram of frames per block
+};
+
+// geometry of the TPACKET_V2 transmit ring
+#define TX_RING_FRAME_SIZE		2048		// room reserved for one frame
+#define TX_RING_FRAME_NR		1024		// number of frames in the ring
+#define TX_RING_BLOCK_SIZE		(1 << 16)	// frames are grouped in blocks
+
+// mmap'ed TPACKET_V2 transmit ring, attached to a socket used for sending only
+struct tx_ring {
+	int fd;					// the socket owning the ring
+	char *map;				// start of the mapped ring
+	size_t map_len;			// length of the mapped ring
+	int frame_nr;			// number of frames
+	int cur;				// the next frame to be filled
+	int queued;				// frames filled since the last kick
+	pthread_mutex_t lock;	// senders come from different threads
+
+	u64 frames;				// number of frames sent
+	u64 kicks;				// number of send syscalls
+	u64 full;				// times the ring is found full
+};
+
+int rx_ring_setup(struct rx_queue *rxq);
+void rx_ring_destroy(struct rx_queue *rxq);
+int rx_ring_receive(struct rx_queue *rxq, int budget);
+int rx_ring_contains(iface_info_t *iface, const char *packet);
+void rx_ring_dump_stats(iface_info_t *iface, FILE *fp);
+
+int tx_ring_setup(iface_info_t *iface);
+void tx_ring_destroy(iface_info_t *iface);
+void tx_ring_send(iface_info_t *iface, const char *packet, int len, int defer);
+void tx_ring_flush(iface_info_t *iface);
+void tx_ring_dump_stats(iface_info_t *iface, FILE *fp);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef __PACKET_MMSG_H__
+#define __PACKET_MMSG_H__
+
+#include "base.h"
+#include "types.h"
+#include "ether.h"
+
+#include <stdio.h>
+
+#define MMSG_BATCH		32		// maximum number of frames per syscall
+
+int mmsg_setup(iface_info_t *iface);
+void mmsg_destroy(iface_info_t *iface);
+int mmsg_receive(struct rx_queue *rxq, int budget);
+void mmsg_send(iface_info_t *iface, const char *packet, int len, int defer);
+void mmsg_flush(iface_info_t *iface);
+void mmsg_dump_stats(iface_info_t *iface, FILE *fp);
+
+#endif
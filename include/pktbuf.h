@@ -0,0 +1,58 @@
+#ifndef __PKTBUF_H__
+#define __PKTBUF_H__
+
+#include "types.h"
+
+#include <stdio.h>
+
+// Packet buffers are taken from fixed-size pools instead of malloc. Each
+// buffer starts with a struct pktbuf, followed by the headroom and the frame,
+// and the buffer is aligned to PKTBUF_ALIGN, so that the header could be found
+// from the frame pointer which is passed around in the stack.
+//
+// A buffer is reference counted, so that the same frame could be queued for
+// retransmission and handed to the interface at the same time. Freed buffers
+// are kept in a cache of the thread, which is refilled from and drained into
+// the global pool in batches.
+
+#define PKTBUF_ALIGN		256		// buffers are aligned to this
+#define PKTBUF_HEADROOM		64		// room in front of the frame for prepending
+									// headers
+#define PKTBUF_CTRL_SIZE	256		// size of buffers for control frames
+#define PKTBUF_MTU_SIZE		2048	// size of buffers for MTU-sized frames
+#define PKTBUF_SLAB_NR		256		// buffers allocated when the pool is empty
+#define PKTBUF_CACHE_NR		64		// buffers cached by each thread
+#define PKTBUF_BATCH_NR		32		// buffers moved between cache and pool
+
+// size classes, frames larger than the MTU class are allocated one by one
+enum pktbuf_class {
+	PKTBUF_CTRL,
+	PKTBUF_MTU,
+	PKTBUF_LARGE,
+	PKTBUF_CLASS_NR,
+};
+
+struct pktbuf {
+	u32 magic;				// PKTBUF_MAGIC, to catch foreign pointers
+	int refcnt;				// the buffer is freed when it drops to 0
+	int cls;				// enum pktbuf_class
+	int size;				// size of the whole buffer
+	struct pktbuf *next;	// link in the free lists
+};
+
+void pktbuf_init();
+
+// get a buffer with room for len bytes, the frame starts after the headroom
+char *pktbuf_alloc(int len);
+// take one more reference of packet
+char *pktbuf_get(char *packet);
+// drop one reference of packet, the buffer is freed with the last one
+void pktbuf_put(char *packet);
+// bytes that could be prepended in front of packet
+int pktbuf_headroom(char *packet);
+// prepend len bytes to packet, return the new start of the frame
+char *pktbuf_push(char *packet, int len);
+
+void pktbuf_dump_stats(FILE *fp);
+
+#endif
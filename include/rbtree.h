@@ -0,0 +1,53 @@
+#ifndef __RBTREE_H__
+#define __RBTREE_H__
+
+#include <stddef.h>
+
+// red-black tree node to link the *real* node into the tree, the nodes are
+// ordered by the user, who walks down the tree to find where a node is linked
+// (see rb_link_node), then rebalances the tree by rb_insert_color
+struct rb_node {
+	struct rb_node *parent, *left, *right;
+	int color;
+};
+
+struct rb_root {
+	struct rb_node *rb_node;
+};
+
+#define RB_RED		0
+#define RB_BLACK	1
+
+#define RB_ROOT (struct rb_root) { NULL }
+
+// check whether the tree is empty
+#define rb_empty_root(root) ((root)->rb_node == NULL)
+
+// get the *real* node from the tree node
+#define rb_entry(ptr, type, member) \
+		(type *)((char *)ptr - offsetof(type, member))
+
+// link a new node at link, which is the left or right pointer of parent (or
+// the root if parent is NULL) found empty while walking down the tree
+static inline void rb_link_node(struct rb_node *node, struct rb_node *parent,
+				struct rb_node **link)
+{
+	node->parent = parent;
+	node->left = node->right = NULL;
+	node->color = RB_RED;
+	*link = node;
+}
+
+// rebalance the tree after the node is linked
+void rb_insert_color(struct rb_node *node, struct rb_root *root);
+// remove the node from the tree (note that it does not free the *real* node)
+void rb_erase(struct rb_node *node, struct rb_root *root);
+
+// the smallest and the largest nodes, NULL if the tree is empty
+struct rb_node *rb_first(const struct rb_root *root);
+struct rb_node *rb_last(const struct rb_root *root);
+// the neighbours of the node in order, NULL at both ends
+struct rb_node *rb_next(const struct rb_node *node);
+struct rb_node *rb_prev(const struct rb_node *node);
+
+#endif
@@ -73,22 +73,77 @@ static inline int read_ring_buffer(struct ring_buffer *rbuf, char *buf, int size
 	return len;
 }
 
-// rbuf should have enough space for buf
-static inline void write_ring_buffer(struct ring_buffer *rbuf, char *buf, int size)
+// copy size bytes at off from the head without consuming them, rbuf should
+// hold at least off + size bytes
+static inline void peek_ring_buffer(struct ring_buffer *rbuf, int off, char *buf, int size)
 {
-	assert(size > 0 && ring_buffer_free(rbuf) >= size);
-	int len = size;
-	if (rbuf->tail + len > rbuf->size) {
-		int right = rbuf->size - rbuf->tail,
-			left = len - right;
-		memcpy(rbuf->buf + rbuf->tail, buf, right);
+	assert(size >= 0 && off >= 0 && ring_buffer_used(rbuf) >= off + size);
+	int start = (rbuf->head + off) % (rbuf->size);
+	if (start + size > rbuf->size) {
+		int right = rbuf->size - start,
+			left = size - right;
+		memcpy(buf, rbuf->buf + start, right);
+		memcpy(buf + right, rbuf->buf, left);
+	}
+	else {
+		memcpy(buf, rbuf->buf + start, size);
+	}
+}
+
+// consume size bytes from the head
+static inline void drop_ring_buffer(struct ring_buffer *rbuf, int size)
+{
+	assert(size >= 0 && ring_buffer_used(rbuf) >= size);
+	rbuf->head = (rbuf->head + size) % (rbuf->size);
+}
+
+// copy buf to off bytes beyond the tail without producing it, rbuf should
+// have enough space for off + size bytes
+static inline void write_ring_buffer_at(struct ring_buffer *rbuf, int off, char *buf, int size)
+{
+	assert(size >= 0 && off >= 0 && ring_buffer_free(rbuf) >= off + size);
+	int start = (rbuf->tail + off) % (rbuf->size);
+	if (start + size > rbuf->size) {
+		int right = rbuf->size - start,
+			left = size - right;
+		memcpy(rbuf->buf + start, buf, right);
 		memcpy(rbuf->buf, buf + right, left);
 	}
 	else {
-		memcpy(rbuf->buf + rbuf->tail, buf, len);
+		memcpy(rbuf->buf + start, buf, size);
 	}
+}
+
+// produce size bytes from the tail, which are written by write_ring_buffer_at
+static inline void commit_ring_buffer(struct ring_buffer *rbuf, int size)
+{
+	assert(size >= 0 && ring_buffer_free(rbuf) >= size);
+	rbuf->tail = (rbuf->tail + size) % (rbuf->size);
+}
 
-	rbuf->tail = (rbuf->tail + len) % (rbuf->size);
+// move the data of rbuf into a new ring buffer of size bytes, together with the
+// data beyond the tail (see write_ring_buffer_at) as long as it fits, and free
+// rbuf, the new one should hold all the data of rbuf
+static inline struct ring_buffer *resize_ring_buffer(struct ring_buffer *rbuf, int size)
+{
+	assert(size >= ring_buffer_used(rbuf));
+	struct ring_buffer *nbuf = alloc_ring_buffer(size);
+	int len = min(rbuf->size - 1, size);
+	int right = min(len, rbuf->size - rbuf->head);
+	memcpy(nbuf->buf, rbuf->buf + rbuf->head, right);
+	memcpy(nbuf->buf + right, rbuf->buf, len - right);
+	nbuf->tail = ring_buffer_used(rbuf);
+	free_ring_buffer(rbuf);
+
+	return nbuf;
+}
+
+// rbuf should have enough space for buf
+static inline void write_ring_buffer(struct ring_buffer *rbuf, char *buf, int size)
+{
+	assert(size > 0 && ring_buffer_free(rbuf) >= size);
+	write_ring_buffer_at(rbuf, 0, buf, size);
+	commit_ring_buffer(rbuf, size);
 }
 
 #endif
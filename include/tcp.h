@@ -4,8 +4,10 @@
 #include "types.h"
 #include "ip.h"
 #include "checksum.h"
+#include "ether.h"
 
 #include <endian.h>
+#include <pthread.h>
 
 #define less_or_equal_32b(a, b) (((int32_t)(a)-(int32_t)(b)) <= 0)
 #define less_than_32b(a, b) (((int32_t)(a)-(int32_t)(b)) < 0)
@@ -41,8 +43,48 @@ struct tcphdr {
 #define TCP_BASE_HDR_SIZE 20
 #define TCP_HDR_SIZE(tcp) (tcp->off * 4)
 
-#define TCP_DEFAULT_WINDOW 65535
-#define TCP_DEFAULT_MSS 1024
+// the receive buffer starts small, and grows by auto-tuning up to
+// TCP_DEFAULT_RCVBUF_MAX (see tcp_rcv_space_adjust)
+#define TCP_DEFAULT_RCVBUF (128 << 10)
+#define TCP_DEFAULT_RCVBUF_MAX (4 << 20)
+#define TCP_DEFAULT_SNDBUF (256 << 10)
+// the largest window in tcp header, which is scaled by the window scale option
+// up to (TCP_MAX_WINDOW << TCP_MAX_WSCALE) bytes (RFC 7323)
+#define TCP_MAX_WINDOW 65535
+#define TCP_MAX_WSCALE 14
+// mss assumed if the peer does not announce one (RFC 1122)
+#define TCP_DEFAULT_MSS 536
+// mss announced by the stack, i.e. the payload of a full ethernet frame
+#define TCP_MSS (ETH_FRAME_LEN - ETHER_HDR_SIZE - IP_BASE_HDR_SIZE - TCP_BASE_HDR_SIZE)
+// the least mss taken from the peer, which leaves room for the timestamps (as
+// Linux does)
+#define TCP_MIN_MSS 88
+
+// tcp options
+#define TCP_MAX_OPT_LEN 40
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
+#define TCP_OPT_MSS_LEN 4
+#define TCP_OPT_WSCALE 3
+#define TCP_OPT_WSCALE_LEN 3
+#define TCP_OPT_SACK_PERM 4
+#define TCP_OPT_SACK_PERM_LEN 2
+#define TCP_OPT_SACK 5
+#define TCP_OPT_TS 8
+#define TCP_OPT_TS_LEN 10
+// the room of the timestamps option in every segment, aligned by 2 NOPs, which
+// is taken out of mss
+#define TCP_OPT_TS_SPACE 12
+// the most sack blocks in a segment, with the 2 bytes of the option they fill
+// the 40 bytes of tcp options
+#define TCP_MAX_SACKS 4
+
+// a block of data received out of order, [start, end)
+struct tcp_sack_block {
+	u32 start;
+	u32 end;
+};
 
 // control block, representing all the necesary information of a packet
 struct tcp_cb {
@@ -53,12 +95,20 @@ struct tcp_cb {
 	u32 seq;		// sequence number in tcp header
 	u32 seq_end;		// seq + (SYN|FIN) + len(payload)
 	u32 ack;		// ack number in tcp header
-	u32 rwnd;		// receiving window in tcp header
+	u32 rwnd;		// receiving window in tcp header, not scaled yet
 	u8 flags;		// flags in tcp header
 	struct iphdr *ip;		// pointer to ip header
 	struct tcphdr *tcp;		// pointer to tcp header
 	char *payload;		// pointer to tcp data
 	int pl_len;		// the length of tcp data
+	u16 mss;		// mss option, 0 if absent
+	int wscale;		// window scale option, -1 if absent
+	int sack_perm;		// whether the sack permitted option is present
+	int nr_sacks;		// number of sack blocks
+	struct tcp_sack_block sacks[TCP_MAX_SACKS];	// sack blocks
+	int ts;			// whether the timestamps option is present
+	u32 tsval;		// timestamp of the sender
+	u32 tsecr;		// timestamp echoed by the sender
 };
 
 // tcp states
@@ -94,6 +144,10 @@ static inline const char *tcp_state_to_str(int state)
 	return tcp_state_str[state];
 }
 
+// serializes the handling of incoming segments and the socket operations of
+// the applications, unless they are all run by the event loop
+extern pthread_mutex_t tcp_lock;
+
 void tcp_copy_flags_to_str(u8 flags, char buf[]);
 void tcp_cb_init(struct iphdr *ip, struct tcphdr *tcp, struct tcp_cb *cb);
 void handle_tcp_packet(char *packet, struct iphdr *ip, struct tcphdr *tcp);
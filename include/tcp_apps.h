@@ -1,6 +1,25 @@
 #ifndef __TCP_APPS_H__
 #define __TCP_APPS_H__
 
+#include "tcp_sock.h"
+
+#define TCP_BENCH_PORT			10001
+#define TCP_BENCH_BYTES			(16 << 20)	// default bytes of bench
+#define TCP_BENCH_BUF_SIZE		65536
+#define TCP_PINGPONG_COUNT		1000		// default round trips of pingpong
+#define TCP_PINGPONG_MSG_SIZE	64
+
+// arguments of the benchmarks, both ends run in the same process
+struct tcp_bench_arg
+{
+	struct sock_addr skaddr;	// address of the server
+	u64 bytes;					// bytes sent by bench
+	int count;					// round trips of pingpong
+	const char *congs;			// congestion controls compared by bench,
+								// separated by ',', NULL for the default
+	const char *cong;			// congestion control of the run of bench
+	struct tcp_sock *tsk;		// client sock of the run of bench
+};
 
 void *tcp_server(void *arg);
 void *tcp_client(void *arg);
@@ -8,5 +27,8 @@ void *tcp_client(void *arg);
 void *tcp_server_file_ver(void *arg);
 void *tcp_client_file_ver(void *arg);
 
+void *tcp_bench(void *arg);
+void *tcp_pingpong(void *arg);
+
 
 #endif
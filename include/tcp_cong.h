@@ -0,0 +1,116 @@
+#ifndef __TCP_CONG_H__
+#define __TCP_CONG_H__
+
+#include "types.h"
+
+#include <stdio.h>
+
+struct tcp_sock;
+
+// the initial window (RFC 6928), also the window restarting after idle, in
+// segments
+#define TCP_INIT_CWND 10
+// ssthresh before any loss, i.e. slow start goes on until the first loss
+#define TCP_INFINITE_SSTHRESH 0xffffffff
+// the room for the private state of the algorithm in each tcp sock
+#define TCP_CONG_PRIV_SIZE 256
+
+// the events of the congestion window, besides acks and losses
+enum tcp_cong_event {
+	// data is sent with nothing in flight, see tcp_cong_tx_start
+	TCP_CONG_EVENT_TX_START,
+};
+
+// a delivery rate sample of an ack, i.e. the bytes delivered (acked or sacked)
+// since the segment sent last of those delivered by the ack is sent, over the
+// time it takes (see tcp_rate.c)
+struct tcp_rate_sample {
+	u64 prior_delivered;	// delivered when the segment is sent
+	u64 prior_time;			// delivered_time when the segment is sent, 0 if
+							// the ack delivers no segment
+	u64 send_interval;		// from the send of the segment delivered before
+							// it, to its send (in micro second)
+	u64 interval;			// the longer of the send interval and the ack
+							// interval (in micro second), 0 if no sample
+	u32 delivered;			// bytes delivered in the interval
+	int is_app_limited;		// the segment is sent while limited by the
+							// application, the rate tells less of the path
+
+	u32 acked;				// bytes newly delivered by the ack
+	u32 losses;				// bytes newly deemed lost by the ack
+	u32 prior_in_flight;	// bytes in flight before the ack
+	u32 rtt;				// rtt sampled by the ack, 0 if none
+
+	// delivered and lost of tcp sock before the ack
+	u64 start_delivered;
+	u64 start_lost;
+};
+
+// the operations of a congestion control algorithm, which sets cwnd and
+// ssthresh of tcp sock (in bytes)
+//
+// They are called with tcp_lock held, the state of the algorithm is kept in
+// tcp_cong_priv of tcp sock, which is zeroed before init.
+struct tcp_cong_ops {
+	const char *name;
+
+	// optional, the window is set to the initial one before it is called
+	void (*init)(struct tcp_sock *tsk);
+
+	// acked bytes are newly acked outside recovery, and rtt is the rtt
+	// sampled by the ack (in micro second), 0 if none; not used along with
+	// cong_control
+	void (*on_ack)(struct tcp_sock *tsk, u32 acked, u32 rtt);
+
+	// instead of on_ack, the algorithm sets the window (and pacing_rate) on
+	// every ack from the rate sample, also in recovery, and is not limited by
+	// the window validation and the restart after idle
+	void (*cong_control)(struct tcp_sock *tsk, const struct tcp_rate_sample *rs);
+
+	// fast recovery starts, ssthresh is reduced, and the window follows it
+	// by PRR (see tcp_cong_prr) unless set by cong_control
+	void (*on_loss)(struct tcp_sock *tsk);
+
+	// the retransmission timer fires, the window restarts from one segment
+	void (*on_rto)(struct tcp_sock *tsk);
+
+	// optional, the retransmissions turn out to be spurious, the window and
+	// ssthresh before on_loss or on_rto are restored after it is called
+	void (*undo)(struct tcp_sock *tsk);
+
+	// optional, see enum tcp_cong_event
+	void (*cwnd_event)(struct tcp_sock *tsk, enum tcp_cong_event event);
+};
+
+extern const struct tcp_cong_ops tcp_reno_ops;
+extern const struct tcp_cong_ops tcp_cubic_ops;
+extern const struct tcp_cong_ops tcp_bbr_ops;
+
+#define tcp_cong_priv(tsk) ((void *)(tsk)->cong_priv)
+
+const struct tcp_cong_ops *tcp_cong_find(const char *name);
+void tcp_cong_list(FILE *fp);
+
+void tcp_cong_init(struct tcp_sock *tsk);
+void tcp_cong_on_ack(struct tcp_sock *tsk, u32 acked);
+void tcp_cong_control(struct tcp_sock *tsk);
+void tcp_cong_on_loss(struct tcp_sock *tsk);
+void tcp_cong_prr(struct tcp_sock *tsk, u32 delivered);
+void tcp_cong_end_recovery(struct tcp_sock *tsk);
+void tcp_cong_on_rto(struct tcp_sock *tsk);
+void tcp_cong_undo(struct tcp_sock *tsk);
+void tcp_cong_tx_start(struct tcp_sock *tsk);
+
+// the growth of reno, also used by other algorithms
+void tcp_slow_start(struct tcp_sock *tsk, u32 acked);
+void tcp_cong_avoid_ai(struct tcp_sock *tsk, u32 wnd, u32 acked);
+
+// delivery rate estimation, see tcp_rate.c
+struct tcp_tx_seg;
+void tcp_rate_seg_sent(struct tcp_sock *tsk, struct tcp_tx_seg *seg);
+void tcp_rate_ack_start(struct tcp_sock *tsk);
+void tcp_rate_seg_delivered(struct tcp_sock *tsk, struct tcp_tx_seg *seg, u32 bytes);
+void tcp_rate_gen(struct tcp_sock *tsk);
+void tcp_rate_check_app_limited(struct tcp_sock *tsk);
+
+#endif
@@ -5,11 +5,14 @@
 #include "list.h"
 #include "tcp.h"
 #include "tcp_timer.h"
+#include "tcp_cong.h"
+#include "rbtree.h"
 #include "ring_buffer.h"
 
 #include "synch_wait.h"
 
 #include <pthread.h>
+#include <stdio.h>
 
 #define PORT_MIN 12345
 #define PORT_MAX 23456
@@ -70,6 +73,14 @@ struct tcp_sock
 	// used for timeout retransmission
 	struct tcp_timer retrans_timer;
 
+	// used to send the ack delayed, see tcp_send_ack
+	struct tcp_timer delack_timer;
+
+	// used to probe the window of the peer, while it is too small to send
+	// anything and nothing in flight would bring a new one
+	struct tcp_timer persist_timer;
+	struct tcp_timer rcvbuf_timer;
+
 	// synch waiting structure of *connect*, *accept*, *recv*, and *send*
 	struct synch_wait *wait_connect;
 	struct synch_wait *wait_accept;
@@ -80,12 +91,17 @@ struct tcp_sock
 	struct ring_buffer *rcv_buf;
 	// receiving ring buffer mutex
 	pthread_mutex_t rcv_buf_lock;
-	// used to pend unacked packets
-	struct list_head send_buf;
-	// unacked packet mutex
-	pthread_mutex_t send_buf_lock;
-	// used to pend out-of-order packets
-	struct list_head rcv_ofo_buf;
+	// the segments sent and not acked yet (retransmission queue), in order of
+	// sequence number; they only keep their ranges, the data is in snd_buf
+	struct tcp_tx_seg *txq;
+	// index of the oldest segment in txq, which is a ring of txq_size entries
+	int txq_head;
+	// number of segments in txq
+	int txq_len;
+	int txq_size;
+	// the ranges of the data received out of order, whose payload is stored
+	// in rcv_buf beyond its tail, at the offset from rcv_nxt
+	struct rb_root rcv_ofo;
 
 	// tcp state, see enum tcp_state in tcp.h
 	int state;
@@ -97,44 +113,301 @@ struct tcp_sock
 	u32 snd_una;
 	// duplicated ack counter
 	u32 dup_ack;
-	// congestion avoidance ack counet
-	u32 cong_avoid_ack; 
+	// the bytes acked in congestion avoidance since cwnd grows last
+	u32 cong_avoid_ack;
 	// the highest byte sent
 	u32 snd_nxt;
 
 	// the highest byte ACKed by itself (i.e. the byte expected to receive next)
 	u32 rcv_nxt;
+	// the rcv_nxt carried by the last segment sent, the data from there to
+	// rcv_nxt is not acked yet
+	u32 rcv_acked;
+#define TCP_QUICK_ACKS 16
+	// the segments acked at once instead of delayed, at the start of the
+	// connection and after out-of-order segments, so that the congestion window
+	// of the peer grows without waiting for the delayed ack timer
+	int quick_acks;
+
+	// the rtt estimated from the acks (in micro second), i.e. the smoothed rtt
+	// and its variation, 0 until the first sample, and the retransmission
+	// timeout derived from them (RFC 6298)
+	u32 srtt;
+	u32 rttvar;
+	u32 rto;
+	// the least rtt sampled, 0 until the first sample
+	u32 min_rtt;
+
+	// the rtt sampled by the ack being processed (in micro second), 0 if none
+	u32 ack_rtt;
+	// the delivery rate sample of the ack being processed
+	struct tcp_rate_sample rs;
+	// delivery rate estimation (see tcp_rate.c), the bytes delivered (acked
+	// or sacked) so far, when it is increased last, the send time of the
+	// segment delivered last, which starts the send interval of the segments
+	// sent after it, and delivered below which the segments are sent while
+	// limited by the application (0 if not limited)
+	u64 delivered;
+	u64 delivered_time;
+	u64 first_tx_time;
+	u64 app_limited;
+	// the bytes ever deemed lost, and the segments ever retransmitted
+	u64 lost;
+	u32 total_retrans;
+
+	// the rate the segments are sent at (in bytes per second), 0 means they
+	// are sent as the window allows, and when the next one could be sent
+	u64 pacing_rate;
+	u64 pacing_time;
+	// linked in the list of the pacing timer while the segments are held,
+	// until pacing_due (0 if not held), see tcp_set_pacing_timer
+	struct list_head pacing_list;
+	u64 pacing_due;
+	// the time the last segment is sent, which tells how long it is idle
+	u64 snd_time;
 
 	// used to indicate the end of fast recovery
 	u32 recovery_point;
-
-	// min(adv_wnd, cwnd)
+	// proportional rate reduction in fast recovery (RFC 6937), the bytes
+	// delivered and sent since it starts, and the flight when it starts
+	u32 prr_delivered;
+	u32 prr_out;
+	u32 recover_fs;
+
+	// the bytes cwnd allows to send, less the bytes in flight, the new data is
+	// also kept within adv_wnd from snd_una
 	u32 snd_wnd;
 	// the receiving window advertised by peer
-	u16 adv_wnd;
+	u32 adv_wnd;
 
 	// the size of receiving window (advertised by tcp sock itself)
-	u16 rcv_wnd;
-
-	// congestion window
+	u32 rcv_wnd;
+	// the right edge of the window advertised so far, which is never retracted
+	// (RFC 9293), thus rcv_buf always holds the data up to it
+	u32 rcv_adv;
+
+	// both ends send the timestamps option in SYN (RFC 7323), the timestamp of
+	// the peer to echo, and when it is taken (0 until the connection is
+	// established), and the echo in the segment being processed (0 if none)
+	int ts_ok;
+	u32 ts_recent;
+	u64 ts_recent_stamp;
+	u32 rx_tsecr;
+
+	// dynamic right-sizing (DRS) of rcv_buf, which starts with rcv_buf_init
+	// bytes, grows up to rcv_buf_max bytes to hold the data consumed by the
+	// application in a round trip, and shrinks back once idle (see
+	// tcp_rcv_space_adjust)
+	u32 rcv_buf_init;
+	u32 rcv_buf_max;
+	// rcv_buf is shrinking back to rcv_buf_init, the space beyond it is not
+	// offered again, and is freed once the advertised edge comes down
+	int rcv_shrink;
+	// the most bytes consumed in a round trip so far, and where and when the
+	// current round trip starts
+	u32 rcvq_space;
+	u32 rcvq_seq;
+	u64 rcvq_time;
+	// the round trip time estimated by the receiver (in micro second), i.e. the
+	// least time a window of data takes to arrive, 0 until measured, which is
+	// measured from rcv_rtt_time till the data at rcv_rtt_seq arrives
+	u32 rcv_rtt;
+	u32 rcv_rtt_seq;
+	u64 rcv_rtt_time;
+	// the time the last data arrives
+	u64 rcv_time;
+
+	// both ends send the window scale option in SYN (RFC 7323)
+	int wscale_ok;
+	// the shift of the windows advertised by the peer and by tcp sock itself,
+	// which are 0 unless the option is agreed on
+	u8 snd_wscale;
+	u8 rcv_wscale;
+
+	// congestion window (in bytes)
 	u32 cwnd;
 
-	// slow start threshold
+	// slow start threshold (in bytes)
 	u32 ssthresh;
 
+	// the congestion control algorithm setting cwnd and ssthresh, and its state
+	const struct tcp_cong_ops *cong_ops;
+	u64 cong_priv[TCP_CONG_PRIV_SIZE / sizeof(u64)];
+
 	// congestion state
 	u32 cong_state;
+
+	// maximum segment size, the smaller of both ends
+	u16 mss;
+	// send buffer, the data written by the application and not acked yet,
+	// i.e. from snd_una (or the ack of SYN) to write_seq, the data from
+	// snd_nxt on is sent by tcp_push
+	struct ring_buffer *snd_buf;
+	// the sequence number following the last byte written into snd_buf
+	u32 write_seq;
+	// FIN is sent once all the data in snd_buf is sent (set by *close*)
+	int snd_fin;
+	// send partial segments at once, instead of waiting for all the data sent
+	// to be acked (Nagle's algorithm), see TCP_NODELAY
+	int nodelay;
+	// send full segments only, see TCP_CORK
+	int cork;
+
+	// both ends permit selective acknowledgements (RFC 2018)
+	int sack_ok;
+	// the scoreboard of txq (RFC 6675), i.e. the bytes sacked, deemed lost,
+	// and retransmitted since deemed lost, out of the bytes not acked yet
+	//
+	// Without SACK, each duplicate ack counts a segment in sacked_out, which
+	// is not tagged in txq (see tcp_reno_sack_update).
+	u32 sacked_out;
+	u32 lost_out;
+	u32 retrans_out;
+
+	// RACK (RFC 8985), the segment sent last of those delivered, i.e. its
+	// send time, end and rtt, and whether it is changed since losses are
+	// detected; the highest end delivered, and whether a segment is
+	// delivered below it without being retransmitted (see tcp_rack.c)
+	u64 rack_xmit_time;
+	u32 rack_end_seq;
+	u32 rack_rtt;
+	int rack_advanced;
+	u32 rack_fack;
+	int rack_reordering_seen;
+	// the reordering window is rack_reo_wnd_mult quarters of min rtt, which
+	// grows in each round trip D-SACK is received in, until rack_dsack_round
+	// is acked, and is set back after rack_reo_wnd_persist recoveries
+	u32 rack_reo_wnd_mult;
+	u32 rack_reo_wnd_persist;
+	u32 rack_dsack_round;
+	// the tail loss probe sent is not acked until tlp_high_seq, 0 if none,
+	// and whether it is a retransmission (TLP of RFC 8985)
+	u32 tlp_high_seq;
+	int tlp_retrans;
+	// the probes sent, the losses repaired by them, and the segments deemed
+	// lost by RACK
+	u32 tlp_probes;
+	u32 tlp_recoveries;
+	u32 rack_lost;
+
+	// the window before recovery or the timeout, which is restored once the
+	// retransmissions turn out to be spurious (prior_cwnd is 0 if there is
+	// nothing to undo), snd_una when it is reduced, the bytes retransmitted
+	// since then and not reported by D-SACK yet, and the timestamp of the first
+	// retransmission (0 until sent), which is newer than the echo of the ack
+	// of the original (Eifel of RFC 3522)
+	u32 prior_cwnd;
+	u32 prior_ssthresh;
+	u32 undo_marker;
+	u32 undo_retrans;
+	u32 retrans_stamp;
+	// the step of F-RTO (RFC 5682) after the timeout, 0 if not detecting,
+	// 1 until the first ack, 2 once new data is sent in place of the
+	// retransmissions
+	int frto;
+	// the ack being processed delivers a segment never retransmitted
+	int ack_orig;
+	// the D-SACKs received, and the undos by D-SACK, by the timestamps and
+	// by F-RTO
+	u32 dsacks;
+	u32 undo_dsack;
+	u32 undo_eifel;
+	u32 undo_frto;
+
+	// sequence number of the latest segment received out of order, whose
+	// range is reported by the first sack block
+	u32 rcv_ofo_seq;
+	// the data received again, which is reported by the first sack block of
+	// the next ack (D-SACK of RFC 2883), if rcv_dsack
+	int rcv_dsack;
+	u32 rcv_dsack_seq;
+	u32 rcv_dsack_seq_end;
 };
 
-struct pended_packet
+// a segment sent and not acked yet, which is rebuilt from snd_buf when it is
+// retransmitted
+struct tcp_tx_seg
+{
+	u32 seq;		// sequence number of the first byte
+	u32 seq_end;	// seq + (SYN|FIN) + len(data)
+	u8 flags;		// flags of the segment
+	u8 state;		// state on the scoreboard, see below
+	u64 time;		// when the segment is sent last (in micro second)
+	// delivered, delivered_time and first_tx_time of tcp sock when the
+	// segment is sent last, see tcp_rate_seg_sent
+	u64 delivered;
+	u64 delivered_time;
+	u64 first_tx_time;
+};
+
+#define TCP_SEG_SACKED	0x01	// received by the peer, according to sack
+#define TCP_SEG_LOST	0x02	// deemed lost, see tcp_txq_mark_lost
+#define TCP_SEG_RETRANS	0x04	// retransmitted since deemed lost
+#define TCP_SEG_EVER_RETRANS	0x08	// ever retransmitted, thus the acks do not
+										// tell its rtt (Karn's algorithm)
+#define TCP_SEG_APP_LIMITED	0x10	// sent while limited by the application
+
+// the segments sacked above a hole, or the duplicate acks, which make the
+// hole deemed lost (RFC 6675, RFC 5681)
+#define TCP_DUPTHRESH 3
+
+#define TCP_TXQ_INIT_SIZE 64
+
+// the i-th segment of txq, from the oldest
+static inline struct tcp_tx_seg *tcp_txq_seg(struct tcp_sock *tsk, int i)
 {
-	struct list_head list; // List node
-	char *packet; // Dumped packet
-	u32 seq; // Sequence number
-	u32 len; // Real packet length
-	u32 seq_end; 
+	return &tsk->txq[(tsk->txq_head + i) % tsk->txq_size];
+}
+
+// the oldest segment of txq, NULL if all the segments sent are acked
+static inline struct tcp_tx_seg *tcp_txq_first(struct tcp_sock *tsk)
+{
+	return tsk->txq_len ? tcp_txq_seg(tsk, 0) : NULL;
+}
+
+// the length of the segment in sequence space
+static inline u32 tcp_seg_len(struct tcp_tx_seg *seg)
+{
+	return seg->seq_end - seg->seq;
+}
+
+// the bytes in flight, i.e. not acked, sacked or deemed lost, unless
+// retransmitted (pipe of RFC 6675)
+static inline u32 tcp_in_flight(struct tcp_sock *tsk)
+{
+	return tsk->snd_nxt - tsk->snd_una - tsk->sacked_out - tsk->lost_out +
+		tsk->retrans_out;
+}
+
+// the window offered to the peer, without the space of rcv_buf to be freed
+// while it shrinks
+static inline u32 tcp_rcv_wnd_offer(struct tcp_sock *tsk)
+{
+	u32 extra = tsk->rcv_buf->size - 1 - tsk->rcv_buf_init;
+	if (!tsk->rcv_shrink || tsk->rcv_buf->size - 1 <= tsk->rcv_buf_init)
+		return tsk->rcv_wnd;
+	return tsk->rcv_wnd > extra ? tsk->rcv_wnd - extra : 0;
+}
+
+// a range of the data received out of order, linked in rcv_ofo in order of
+// sequence number, the ranges neither overlap nor adjoin each other
+struct tcp_ofo_range
+{
+	struct rb_node node;
+	u32 seq;		// sequence number of the first byte
+	u32 seq_end;	// seq + len(data) + FIN
+	int fin;		// whether the range ends with FIN
 };
 
+// whether the data written may be sent or in flight, i.e. from the
+// establishment until FIN is acked
+static inline int tcp_sock_sending(struct tcp_sock *tsk)
+{
+	return tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT ||
+		tsk->state == TCP_FIN_WAIT_1 || tsk->state == TCP_CLOSING ||
+		tsk->state == TCP_LAST_ACK;
+}
+
 void tcp_set_state(struct tcp_sock *tsk, int state);
 
 int tcp_sock_accept_queue_full(struct tcp_sock *tsk);
@@ -153,8 +426,25 @@ u32 tcp_new_iss();
 void tcp_send_reset(struct tcp_cb *cb);
 
 void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags);
-void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len);
-// int tcp_send_data(struct tcp_sock *tsk, char *buf, int len);
+void tcp_send_ack(struct tcp_sock *tsk, int quick);
+void tcp_send_probe(struct tcp_sock *tsk);
+void tcp_retransmit(struct tcp_sock *tsk, struct tcp_tx_seg *seg);
+int tcp_txq_ack(struct tcp_sock *tsk, u32 ack);
+void tcp_txq_sack(struct tcp_sock *tsk, u32 start, u32 end);
+void tcp_txq_mark_lost(struct tcp_sock *tsk);
+void tcp_txq_mark_all_lost(struct tcp_sock *tsk);
+void tcp_txq_tag_lost(struct tcp_sock *tsk, struct tcp_tx_seg *seg);
+void tcp_txq_untag_lost(struct tcp_sock *tsk);
+void tcp_rack_advance(struct tcp_sock *tsk, struct tcp_tx_seg *seg);
+u32 tcp_rack_detect_loss(struct tcp_sock *tsk);
+void tcp_rack_dsack(struct tcp_sock *tsk);
+void tcp_rack_recovered(struct tcp_sock *tsk);
+void tcp_send_loss_probe(struct tcp_sock *tsk);
+void tcp_enter_recovery(struct tcp_sock *tsk);
+void tcp_undo_mark(struct tcp_sock *tsk);
+int tcp_send_data(struct tcp_sock *tsk, char *buf, int len);
+int tcp_push(struct tcp_sock *tsk, int flush);
+void tcp_clean_snd_buf(struct tcp_sock *tsk, u32 ack);
 
 void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet);
 
@@ -169,4 +459,26 @@ void tcp_sock_close(struct tcp_sock *tsk);
 int tcp_sock_read(struct tcp_sock *tsk, char *buf, int len);
 int tcp_sock_write(struct tcp_sock *tsk, char *buf, int len);
 
+// options of tcp_sock_setopt, in accordance with BSD socket
+#define TCP_NODELAY 1	// send partial segments at once
+#define TCP_CORK 3		// hold partial segments until uncorked or closed
+#define TCP_SNDBUF 7	// bytes of the send buffer, only changed while it is
+						// empty (SO_SNDBUF in BSD socket)
+#define TCP_RCVBUF 8	// bytes of the receive buffer, only changed before SYN
+						// is sent, which is not tuned any more (SO_RCVBUF in
+						// BSD socket)
+
+int tcp_sock_setopt(struct tcp_sock *tsk, int opt, int val);
+int tcp_sock_resize_snd_buf(struct tcp_sock *tsk, int size);
+int tcp_sock_resize_rcv_buf(struct tcp_sock *tsk, int size, int max_size);
+int tcp_sock_tune_rcv_buf(struct tcp_sock *tsk, int size);
+// the congestion control algorithm of the tcp sock (TCP_CONGESTION in BSD
+// socket), the window starts over with it
+int tcp_sock_set_congestion(struct tcp_sock *tsk, const char *name);
+// the segments the tcp sock has retransmitted so far
+u32 tcp_sock_retrans(struct tcp_sock *tsk);
+
+// dump the state of the tcp socks, e.g. the size of their buffers
+void tcp_sock_dump_stats(FILE *fp);
+
 #endif
@@ -1,13 +1,17 @@
 #ifndef __TCP_TIMER_H__
 #define __TCP_TIMER_H__
 
+#include "types.h"
 #include "list.h"
 
 #include <stddef.h>
+#include <time.h>
 
 struct tcp_timer
 {
-	int type;	 // time-wait: 0		retrans: 1
+	int type;	 // time-wait: 0		retrans: 1		delayed ack: 2		persist: 3
+				 // receive buffer: 4	loss probe: 5	reordering: 6
+				 // (retrans_timer is also the last two, see tcp_rack.c)
 	int timeout; // in micro second
 	struct list_head list;
 	int enable;
@@ -19,11 +23,57 @@ struct tcp_sock;
 
 #define retranstimer_to_tcp_sock(t) \
 	(struct tcp_sock *)((char *)(t)-offsetof(struct tcp_sock, retrans_timer))
+
+#define delacktimer_to_tcp_sock(t) \
+	(struct tcp_sock *)((char *)(t)-offsetof(struct tcp_sock, delack_timer))
+
+#define persisttimer_to_tcp_sock(t) \
+	(struct tcp_sock *)((char *)(t)-offsetof(struct tcp_sock, persist_timer))
+
+#define rcvbuftimer_to_tcp_sock(t) \
+	(struct tcp_sock *)((char *)(t)-offsetof(struct tcp_sock, rcvbuf_timer))
 #define TCP_TIMER_SCAN_INTERVAL 10000
 #define TCP_MSL 1000000
 #define TCP_TIMEWAIT_TIMEOUT (2 * TCP_MSL)
-#define TCP_RETRANS_INTERVAL_INITIAL 200000
+// the retransmission timeout before any rtt is sampled (RFC 6298), and the
+// default bounds of the timeout, see -O
+#define TCP_RTO_INITIAL 1000000
+#define TCP_RTO_MIN 200000
+#define TCP_RTO_MAX 120000000
+// the timeouts in a row before the connection is reset, i.e. about 15 minutes
+// with the timeout doubled each time up to TCP_RTO_MAX
+#define TCP_RETRIES 15
+// the window is probed at most every 2^TCP_PERSIST_MAX_BACKOFF retransmission
+// timeouts
+#define TCP_PERSIST_MAX_BACKOFF 6
+// the default time an ack is delayed, see -d
+#define TCP_DELACK_TIMEOUT 40000
+// rcv_buf grown by auto-tuning shrinks back once no data arrives for this long
+#define TCP_RCVBUF_IDLE_TIMEOUT 1000000
+// the most data sent at once by pacing, after the time is left unused (in
+// micro second of the pacing rate)
+#define TCP_PACING_BURST 1000
+
+// monotonic time in micro second, e.g. of the round trips measured by tcp sock
+static inline u64 tcp_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the clock of the timestamps option, in milli second (RFC 7323)
+static inline u32 tcp_ts_now()
+{
+	return tcp_time_us() / 1000;
+}
+// the timestamps of the peer are not compared after the connection is idle for
+// so long, since its clock may have wrapped (in micro second)
+#define TCP_PAWS_IDLE (24ULL * 24 * 3600 * 1000000)
 
+void init_tcp_timer();
+int tcp_timer_pending();
+void tcp_scan_timer_list();
 // the thread that scans timer_list periodically
 void *tcp_timer_thread(void *arg);
 // add the timer of tcp sock to timer_list
@@ -35,4 +85,34 @@ void tcp_unset_retrans_timer(struct tcp_sock *tsk);
 
 void tcp_update_retrans_timer(struct tcp_sock *tsk, u32 ack);
 
+// fire the retransmission timer as the reordering timer of RACK after timeout
+// (in micro second), unless it fires earlier
+void tcp_set_reo_timer(struct tcp_sock *tsk, u32 timeout);
+
+// update the rtt estimate and the retransmission timeout by an rtt sample
+void tcp_rtt_update(struct tcp_sock *tsk, u32 rtt);
+
+// start the delayed ack timer, unless it is already started
+void tcp_set_delack_timer(struct tcp_sock *tsk);
+
+// start the persist timer, unless it is already started
+void tcp_set_persist_timer(struct tcp_sock *tsk);
+
+// start the receive buffer timer, unless it is already started
+void tcp_set_rcvbuf_timer(struct tcp_sock *tsk);
+
+// The pacing timer is not scanned with timer_list, which is too coarse for
+// the gaps between segments: the tcp socks held by pacing are kept in order of
+// their due time (in micro second), and run by a thread sleeping until the
+// first one is due, or by the event loop.
+
+// hold tcp sock until due, unless it is held until earlier
+void tcp_set_pacing_timer(struct tcp_sock *tsk, u64 due);
+void tcp_unset_pacing_timer(struct tcp_sock *tsk);
+// when the first tcp sock held is due, 0 if none
+u64 tcp_pacing_timer_next();
+// push the segments of the tcp socks due
+void tcp_run_pacing_timers();
+void *tcp_pacing_thread(void *arg);
+
 #endif
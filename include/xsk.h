@@ -0,0 +1,24 @@
+#ifndef __XSK_H__
+#define __XSK_H__
+
+#include "base.h"
+#include "types.h"
+
+#include <stdio.h>
+
+#define XSK_FRAME_SIZE		2048	// size of each frame in UMEM
+#define XSK_FRAME_NR		4096	// number of frames in UMEM, the first half
+									// is used for receiving, the other for sending
+#define XSK_RING_SIZE		(XSK_FRAME_NR / 2)	// entries of each ring
+#define XSK_RX_BATCH		64		// maximum number of frames per receive
+#define XSK_MAP_SIZE		64		// maximum number of queues
+
+int xsk_setup(iface_info_t *iface);
+void xsk_destroy(iface_info_t *iface);
+int xsk_receive(iface_info_t *iface, int budget);
+void xsk_send(iface_info_t *iface, const char *packet, int len, int defer);
+void xsk_flush(iface_info_t *iface);
+int xsk_contains(iface_info_t *iface, const char *packet);
+void xsk_dump_stats(iface_info_t *iface, FILE *fp);
+
+#endif
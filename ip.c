@@ -45,7 +45,7 @@ void ip_forward_packet(u32 ip_dst, char *packet, int len)
 	struct iphdr *hdr = packet_to_ip_hdr(packet);
 	if (hdr->ttl <= 1) {
 		icmp_send_packet(packet, len, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 
@@ -54,7 +54,7 @@ void ip_forward_packet(u32 ip_dst, char *packet, int len)
 	rt_entry_t *entry = longest_prefix_match(ip_dst);
 	if (!entry) {
 		icmp_send_packet(packet, len, ICMP_DEST_UNREACH, ICMP_NET_UNREACH);
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 
@@ -92,7 +92,7 @@ void handle_ip_packet(iface_info_t *iface, char *packet, int len)
 			log(ERROR, "unsupported IP protocol (0x%x) packet.", ip->protocol);
 		}
 
-		free(packet);
+		packet_free(packet);
 	}
 	else {
 		ip_forward_packet(daddr, packet, len);
@@ -107,7 +107,7 @@ void ip_send_packet(char *packet, int len)
 	if (!entry) {
 		log(ERROR, "Could not find forwarding rule for IP (dst:"IP_FMT") packet.", 
 				HOST_IP_FMT_STR(dst));
-		free(packet);
+		packet_free(packet);
 		return ;
 	}
 
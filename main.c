@@ -1,3 +1,5 @@
+#define _GNU_SOURCE		// ppoll
+
 #include "base.h"
 #include "ether.h"
 #include "arp.h"
@@ -6,33 +8,75 @@
 #include "rtable.h"
 #include "tcp_sock.h"
 #include "tcp_apps.h"
+#include "packet.h"
+#include "packet_mmap.h"
+#include "netdev.h"
+#include "pktbuf.h"
+#include "evloop.h"
 
 #include "log.h"
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <poll.h>
+#include <pthread.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <linux/if_packet.h>
 #include <libgen.h>
+#include <signal.h>
+#include <getopt.h>
 
 ustack_t *instance;
 
-static iface_info_t *fd_to_iface(int fd)
-{
-	iface_info_t *iface = NULL;
-	list_for_each_entry(iface, &instance->iface_list, list) {
-		if (iface->fd == fd)
-			return iface;
-	}
-
-	log(ERROR, "Could not find the desired interface according to fd '%d'", fd);
-	return NULL;
-}
+ustack_conf_t ustack_conf = {
+	.netdev = &packet_ops,
+	.ring_block_size = RX_RING_BLOCK_SIZE,
+	.ring_block_nr = RX_RING_BLOCK_NR,
+	.ring_block_timeout = RX_RING_BLOCK_TIMEOUT,
+	.tx_ring = 0,
+	.xdp_queue = 0,
+	.xdp_drv_mode = 0,
+	.xdp_zerocopy = 0,
+	.pipe_loss = 0,
+	.pipe_delay = 0,
+	.pipe_rate = 0,
+	.pipe_queue = 0,
+	.pipe_reorder = 0,
+	.pipe_reorder_delay = 0,
+	.pipe_spike = 0,
+	.pipe_spike_delay = 0,
+	.pcap_in = NULL,
+	.pcap_out = NULL,
+	.pcap_ip = 0x0a000001,			// 10.0.0.1
+	.pcap_mask = 0xffffff00,
+	.pcap_gw = 0,
+	.pcap_pace = 0,
+	.pcap_loops = 1,
+	.evloop = 0,
+	.rx_workers = 0,
+	.busy_poll = 0,
+	.tcp_sndbuf = TCP_DEFAULT_SNDBUF,
+	.tcp_rcvbuf = TCP_DEFAULT_RCVBUF,
+	.tcp_rcvbuf_max = TCP_DEFAULT_RCVBUF_MAX,
+	.tcp_delack = TCP_DELACK_TIMEOUT,
+	.tcp_sack = 1,
+	.tcp_timestamps = 1,
+	.tcp_rack = 1,
+	.tcp_undo = 1,
+	.tcp_rto_min = TCP_RTO_MIN,
+	.tcp_rto_max = TCP_RTO_MAX,
+	.tcp_cong = &tcp_reno_ops,
+	.tcp_cwnd_trace = 0,
+};
+
+// busy polling of the poll loop
+static struct busy_poll loop_busy;
+
+// set by SIGUSR1, the statistics are dumped by the receiving loop
+static volatile sig_atomic_t stats_requested = 0;
 
 void handle_packet(iface_info_t *iface, char *packet, int len)
 {
@@ -50,63 +94,14 @@ void handle_packet(iface_info_t *iface, char *packet, int len)
 		default:
 			log(ERROR, "Unknown packet type 0x%04hx, ingore it.", \
 					ntohs(eh->ether_type));
+			packet_free(packet);
 			break;
 	}
 }
 
-int open_device(const char *dname)
+// read the index, mac and ip address of a kernel interface
+void read_iface_info(iface_info_t *iface)
 {
-	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
-	if (sd < 0) { 
-		perror("creating SOCK_RAW failed!");
-		return -1;
-	}
-
-	struct ifreq ifr;
-	bzero(&ifr, sizeof(struct ifreq));
-	strcpy(ifr.ifr_name, dname);
-	if (ioctl(sd, SIOCGIFINDEX, &ifr) < 0) {
-		perror("ioctl() SIOCGIFINDEX failed!");
-		return -1;
-	}
-
-	struct sockaddr_ll sll;
-	bzero(&sll, sizeof(sll));
-	sll.sll_family = AF_PACKET;
-	sll.sll_ifindex = ifr.ifr_ifindex;
-
-	if (bind((int)sd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
-		perror("binding to device failed!");
-		return -1;
-	}
-
-	if (ioctl(sd, SIOCGIFHWADDR, &ifr) < 0) {
-		perror("Start(): SIOCGIFHWADDR failed!");
-		return -1;
-	}
-
-	// It seems that we could capture all the packets without promisc mode.
-#if 0
-	struct packet_mreq mr;
-	bzero(&mr, sizeof(mr));
-	mr.mr_ifindex = sll.sll_ifindex;
-	mr.mr_type = PACKET_MR_PROMISC;
-
-	if (setsockopt(sd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
-		perror("Start(): setsockopt() PACKET_ADD_MEMBERSHIP failed!");
-		return -1;
-	}
-#endif
-	
-	return sd;
-}
-
-int read_iface_info(iface_info_t *iface)
-{
-	int fd = open_device(iface->name);
-
-	iface->fd = fd;
-
 	int s = socket(AF_INET, SOCK_DGRAM, 0);
 	struct ifreq ifr;
 	strcpy(ifr.ifr_name, iface->name);
@@ -119,7 +114,7 @@ int read_iface_info(iface_info_t *iface)
 
 	struct in_addr ip, mask;
 	// get ip address
-	if (ioctl(fd, SIOCGIFADDR, &ifr) < 0) {
+	if (ioctl(s, SIOCGIFADDR, &ifr) < 0) {
 		perror("Get IP address failed");
 		exit(1);
 	}
@@ -128,14 +123,14 @@ int read_iface_info(iface_info_t *iface)
 	strcpy(iface->ip_str, inet_ntoa(ip));
 
 	// get net mask 
-	if (ioctl(fd, SIOCGIFNETMASK, &ifr) < 0) {
+	if (ioctl(s, SIOCGIFNETMASK, &ifr) < 0) {
 		perror("Get IP mask failed");
 		exit(1);
 	}
 	mask = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
 	iface->mask = ntohl(*(u32 *)&mask);
 
-	return fd;
+	close(s);
 }
 
 static void find_available_ifaces()
@@ -176,20 +171,99 @@ static void find_available_ifaces()
 
 void init_all_ifaces()
 {
-	find_available_ifaces();
+	const struct netdev_ops *ops = ustack_conf.netdev;
+
+	// virtual drivers create their own interfaces, otherwise the interfaces
+	// are taken from the kernel
+	if (ops->probe) {
+		if (ops->probe() < 0) {
+			log(ERROR, "could not create interfaces of %s driver.", ops->name);
+			exit(1);
+		}
+	}
+	else {
+		find_available_ifaces();
+	}
 
-	instance->fds = malloc(sizeof(struct pollfd) * instance->nifs);
-	bzero(instance->fds, sizeof(struct pollfd) * instance->nifs);
+	// the event loop polls its timer and event fds after the interfaces
+	int nfds = instance->nifs + (ustack_conf.evloop ? 2 : 0);
+	instance->fds = malloc(sizeof(struct pollfd) * nfds);
+	bzero(instance->fds, sizeof(struct pollfd) * nfds);
 
 	iface_info_t *iface = NULL;
 	int i = 0;
 	list_for_each_entry(iface, &instance->iface_list, list) {
-		int fd = read_iface_info(iface);
-		instance->fds[i].fd = fd;
+		if (!ops->probe)
+			read_iface_info(iface);
+
+		iface->nrxqs = ustack_conf.rx_workers ? ustack_conf.rx_workers : 1;
+		iface->rxqs = malloc(sizeof(struct rx_queue) * iface->nrxqs);
+		bzero(iface->rxqs, sizeof(struct rx_queue) * iface->nrxqs);
+		for (int j = 0; j < iface->nrxqs; j++) {
+			iface->rxqs[j].iface = iface;
+			iface->rxqs[j].id = j;
+			iface->rxqs[j].fd = -1;
+		}
+
+		iface->ops = ops;
+		if (ops->open(iface) < 0) {
+			log(ERROR, "could not open %s by %s driver.", iface->name, ops->name);
+			exit(1);
+		}
+
+		// only used by the poll loop, where each interface has one queue
+		instance->fds[i].fd = iface->rxqs[0].fd;
 		instance->fds[i].events |= POLLIN;
 
 		i += 1;
 	}
+
+	if (ustack_conf.evloop) {
+		instance->fds[i].fd = evloop_timer_fd();
+		instance->fds[i].events = POLLIN;
+		instance->fds[i + 1].fd = evloop_event_fd();
+		instance->fds[i + 1].events = POLLIN;
+	}
+}
+
+static void request_stats(int sig)
+{
+	stats_requested = 1;
+}
+
+// dump the statistics of the stack to stderr, triggered by SIGUSR1
+static void ustack_dump_stats()
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->ops->dump_stats)
+			iface->ops->dump_stats(iface, stderr);
+
+		for (int i = 0; i < iface->nrxqs; i++) {
+			struct rx_queue *rxq = &iface->rxqs[i];
+			fprintf(stderr, "%s queue %d: %lu frames in %lu polls\n",
+					iface->name, i, rxq->frames, rxq->polls);
+		}
+	}
+
+	if (ustack_conf.rx_workers) {
+		list_for_each_entry(iface, &instance->iface_list, list) {
+			for (int i = 0; i < iface->nrxqs; i++) {
+				char name[48];
+				snprintf(name, sizeof(name), "%s queue %d", iface->name, i);
+				busy_poll_dump_stats(&iface->rxqs[i].busy, name, stderr);
+			}
+		}
+	}
+	else {
+		busy_poll_dump_stats(&loop_busy, "poll loop", stderr);
+	}
+
+	pktbuf_dump_stats(stderr);
+	tcp_sock_dump_stats(stderr);
+
+	if (ustack_conf.evloop)
+		evloop_dump_stats(stderr);
 }
 
 void init_ustack()
@@ -199,71 +273,479 @@ void init_ustack()
 	bzero(instance, sizeof(ustack_t));
 	init_list_head(&instance->iface_list);
 
-	init_all_ifaces();
+	// SIGUSR1 is blocked in all the threads, and is only taken when the
+	// receiving loop waits for it (see ustack_run)
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	arpcache_init();
+	pktbuf_init();
 
+	if (ustack_conf.evloop)
+		evloop_init();
+
+	// virtual drivers add their routes when creating the interfaces
 	init_rtable();
 
-	load_rtable_from_kernel();
+	init_all_ifaces();
+
+	arpcache_init();
+
+	if (!ustack_conf.netdev->probe)
+		load_rtable_from_kernel();
 
 	init_tcp_stack();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_stats;
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+// the receiving thread of a queue, the frames of a flow are always received by
+// the same thread
+static void *rx_worker(void *arg)
+{
+	struct rx_queue *rxq = arg;
+	struct pollfd pfd;
+	pfd.fd = rxq->fd;
+	pfd.events = POLLIN;
+	busy_poll_init(&rxq->busy, ustack_conf.busy_poll);
+
+	while (1) {
+		int ready = ppoll(&pfd, 1, busy_poll_timeout(&rxq->busy), NULL);
+		if (ready < 0) {
+			busy_poll_update(&rxq->busy, 0);
+			if (errno == EINTR)
+				continue;
+			perror("Poll failed!");
+			break;
+		}
+		else if (ready == 0 || !(pfd.revents & POLLIN)) {
+			busy_poll_update(&rxq->busy, 0);
+			continue;
+		}
+
+		rxq->polls += 1;
+		iface_tx_batch_begin();
+		int frames = rxq->iface->ops->rx_burst(rxq, NETDEV_RX_BUDGET);
+		iface_tx_batch_end();
+
+		rxq->frames += frames;
+		busy_poll_update(&rxq->busy, frames);
+	}
+
+	return NULL;
+}
+
+// start the receiving threads of all the queues, and wait for SIGUSR1 to dump
+// the statistics
+static void ustack_run_workers()
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		for (int i = 0; i < iface->nrxqs; i++) {
+			struct rx_queue *rxq = &iface->rxqs[i];
+			if (pthread_create(&rxq->thread, NULL, rx_worker, rxq)) {
+				log(ERROR, "could not create receiving thread of %s.",
+						iface->name);
+				exit(1);
+			}
+		}
+	}
+
+	log(DEBUG, "%d receiving threads for each interface.", ustack_conf.rx_workers);
+
+	sigset_t set;
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	while (1) {
+		int sig;
+		if (sigwait(&set, &sig) == 0 && sig == SIGUSR1)
+			ustack_dump_stats();
+	}
 }
 
 void ustack_run()
 {
-	struct sockaddr_ll addr;
-	socklen_t addr_len = sizeof(addr);
-	char buf[ETH_FRAME_LEN];
-	int len;
+	if (ustack_conf.rx_workers) {
+		ustack_run_workers();
+		return ;
+	}
+
+	// SIGUSR1 is only unblocked while waiting for frames
+	sigset_t unblocked;
+	pthread_sigmask(SIG_SETMASK, NULL, &unblocked);
+	sigdelset(&unblocked, SIGUSR1);
 
+	int nfds = instance->nifs + (ustack_conf.evloop ? 2 : 0);
+	busy_poll_init(&loop_busy, ustack_conf.busy_poll);
 	while (1) {
-		int ready = poll(instance->fds, instance->nifs, -1);
+		if (ustack_conf.evloop)
+			evloop_arm();
+
+		// the timers and the socket operations of the event loop are served
+		// while spinning as well, as their descriptors are polled together
+		int ready = ppoll(instance->fds, nfds, busy_poll_timeout(&loop_busy),
+				&unblocked);
+		if (stats_requested) {
+			stats_requested = 0;
+			ustack_dump_stats();
+		}
+
 		if (ready < 0) {
+			busy_poll_update(&loop_busy, 0);
+			if (errno == EINTR)
+				continue;
 			perror("Poll failed!");
 			break;
 		}
-		else if (ready == 0)
+		else if (ready == 0) {
+			busy_poll_update(&loop_busy, 0);
 			continue;
+		}
 
-		for (int i = 0; i < instance->nifs; i++) {
-			if (instance->fds[i].revents & POLLIN) {
-				len = recvfrom(instance->fds[i].fd, buf, ETH_FRAME_LEN, 0, \
-						(struct sockaddr*)&addr, &addr_len);
-				if (len <= 0) {
-					log(ERROR, "receive packet error: %s", strerror(errno));
-				}
-				else if (addr.sll_pkttype == PACKET_OUTGOING) {
-					// XXX: Linux raw socket will capture both incoming and
-					// outgoing packets, we only care about the incoming ones.
-
-					// log(DEBUG, "received packet which is sent from the "
-					// 		"interface itself, drop it.");
-				}
-				else {
-					iface_info_t *iface = fd_to_iface(instance->fds[i].fd);
-					char *packet = malloc(len);
-					if (!packet) {
-						log(ERROR, "malloc failed when receiving packet.");
-						continue;
-					}
-					memcpy(packet, buf, len);
-					handle_packet(iface, packet, len);
-				}
+		// the interfaces are polled in the order of the list
+		iface_tx_batch_begin();
+		iface_info_t *iface = NULL;
+		int i = 0, frames = 0;
+		list_for_each_entry(iface, &instance->iface_list, list) {
+			if (instance->fds[i++].revents & POLLIN) {
+				struct rx_queue *rxq = &iface->rxqs[0];
+				int n = iface->ops->rx_burst(rxq, NETDEV_RX_BUDGET);
+				rxq->polls += 1;
+				rxq->frames += n;
+				frames += n;
 			}
 		}
+
+		if (ustack_conf.evloop) {
+			if (instance->fds[i].revents & POLLIN)
+				evloop_run_timers();
+			if (instance->fds[i + 1].revents & POLLIN)
+				evloop_run_calls();
+		}
+		iface_tx_batch_end();
+
+		busy_poll_update(&loop_busy, frames);
 	}
 }
 
 static void usage_and_exit(const char *basename)
 {
 	fprintf(stderr, "Usage: \n");
-	fprintf(stderr, "\t%s server local_port\n", basename);
-	fprintf(stderr, "\t%s client remote_ip remote_port\n", basename);
+	fprintf(stderr, "\t%s [options] server local_port\n", basename);
+	fprintf(stderr, "\t%s [options] client remote_ip remote_port\n", basename);
+	fprintf(stderr, "\t%s [options] bench [bytes [algorithm,...]]\n", basename);
+	fprintf(stderr, "\t%s [options] pingpong [count]\n", basename);
+	fprintf(stderr, "Options: \n");
+	fprintf(stderr, "\t-m ");
+	netdev_list(stderr);
+	fprintf(stderr, "\n\t\t\t\tdriver of the interfaces (default: %s)\n",
+			packet_ops.name);
+	fprintf(stderr, "\t-B bytes\t\tblock size of the receive ring (default: %d)\n",
+			RX_RING_BLOCK_SIZE);
+	fprintf(stderr, "\t-N count\t\tnumber of blocks of the receive ring (default: %d)\n",
+			RX_RING_BLOCK_NR);
+	fprintf(stderr, "\t-T ms\t\t\tblock retire timeout of the receive ring (default: %d)\n",
+			RX_RING_BLOCK_TIMEOUT);
+	fprintf(stderr, "\t-t\t\t\tsend frames through PACKET_TX_RING\n");
+	fprintf(stderr, "\t-q queue\t\tqueue bound by the AF_XDP socket (default: 0)\n");
+	fprintf(stderr, "\t-x skb|drv\t\tattach mode of the XDP program (default: skb)\n");
+	fprintf(stderr, "\t-z\t\t\tbind the AF_XDP socket in zero-copy mode\n");
+	fprintf(stderr, "\t-L percent\t\tloss rate of the pipe (default: 0)\n");
+	fprintf(stderr, "\t-D ms\t\t\tone-way delay of the pipe (default: 0)\n");
+	fprintf(stderr, "\t-R Mbit/s\t\tbandwidth of the pipe (default: unlimited)\n");
+	fprintf(stderr, "\t-Q bytes\t\tqueue of the pipe, only used with -R (default: unlimited)\n");
+	fprintf(stderr, "\t-X percent,ms\t\tframes of the pipe held for ms more, which are\n"
+			"\t\t\t\treordered behind the frames after them (default: 0)\n");
+	fprintf(stderr, "\t-J percent,ms\t\tframes of the pipe starting a delay spike of ms,\n"
+			"\t\t\t\twhich holds the frames after them as well (default: 0)\n");
+	fprintf(stderr, "\t-r file\t\t\tcapture replayed by the pcap driver\n");
+	fprintf(stderr, "\t-o file\t\t\tcapture of the frames sent by the pcap driver\n"
+			"\t\t\t\t(default: discarded)\n");
+	fprintf(stderr, "\t-A ip/len[,gw]\t\taddress of the pcap interface, and its default\n"
+			"\t\t\t\tgateway (default: 10.0.0.1/24)\n");
+	fprintf(stderr, "\t-P\t\t\treplay at the recorded timestamps (default: as fast as\n"
+			"\t\t\t\tpossible)\n");
+	fprintf(stderr, "\t-n count\t\ttimes the capture is replayed, 0 means forever (default: 1)\n");
+	fprintf(stderr, "\t-E\t\t\trun the timers and the socket operations in the poll\n"
+			"\t\t\t\tloop, instead of their own threads\n");
+	fprintf(stderr, "\t-w count\t\treceiving threads of each interface, the flows are\n"
+			"\t\t\t\tspread over them by PACKET_FANOUT (default: 0, all the\n"
+			"\t\t\t\tinterfaces are served by one poll loop)\n");
+	fprintf(stderr, "\t-b us\t\t\tkeep polling without blocking for up to us after frames\n"
+			"\t\t\t\tarrive, if they arrive that often (default: 0, always\n"
+			"\t\t\t\tblock)\n");
+	fprintf(stderr, "\t-S bytes\t\tsend buffer of each tcp sock (default: %d)\n",
+			TCP_DEFAULT_SNDBUF);
+	fprintf(stderr, "\t-W bytes\t\treceive buffer of each tcp sock, beyond 64 KB the\n"
+			"\t\t\t\twindow is scaled (default: %d)\n", TCP_DEFAULT_RCVBUF);
+	fprintf(stderr, "\t-M bytes\t\tthe most bytes the receive buffer grows to by\n"
+			"\t\t\t\tauto-tuning, 0 means no auto-tuning (default: %d)\n",
+			TCP_DEFAULT_RCVBUF_MAX);
+	fprintf(stderr, "\t-d us\t\t\tthe most time an ack is delayed, 0 means every segment\n"
+			"\t\t\t\tis acked at once (default: %d)\n", TCP_DELACK_TIMEOUT);
+	fprintf(stderr, "\t-s\t\t\tdo not negotiate selective acknowledgements (SACK)\n");
+	fprintf(stderr, "\t-k\t\t\tdo not negotiate timestamps\n");
+	fprintf(stderr, "\t-e\t\t\tdo not detect losses by the time (RACK) and the tail\n"
+			"\t\t\t\tloss probe (TLP), only by the duplicate acks and sacks\n");
+	fprintf(stderr, "\t-u\t\t\tdo not undo the window reduced by the retransmissions\n"
+			"\t\t\t\tfound spurious by D-SACK, timestamps or F-RTO\n");
+	fprintf(stderr, "\t-O min[,max]\t\tbounds of the retransmission timeout in us (default:\n"
+			"\t\t\t\t%d,%d)\n", TCP_RTO_MIN, TCP_RTO_MAX);
+	fprintf(stderr, "\t-c ");
+	tcp_cong_list(stderr);
+	fprintf(stderr, "\n\t\t\t\tcongestion control of each tcp sock (default: %s)\n",
+			tcp_reno_ops.name);
+	fprintf(stderr, "\t-g\t\t\ttrace the congestion window of each algorithm into\n"
+			"\t\t\t\tcwnd-<algorithm>.txt\n");
+	fprintf(stderr, "bench and pingpong run both ends in one process, the client connects to\n"
+			"the address of the last interface, e.g. with -m pipe.\n");
+	fprintf(stderr, "bench with the algorithms runs once with each, and reports the\n"
+			"retransmissions of each, e.g. -m pipe -L 2 -D 1 bench 16777216 reno,bbr\n"
+			"compares them on the lossy path of tcp_topo_loss.py.\n");
+	fprintf(stderr, "With -m pcap, the process reports the replay rate and exits once the\n"
+			"capture is replayed.\n");
+	fprintf(stderr, "Send SIGUSR1 to dump the statistics of the stack.\n");
 
 	exit(1);
 }
 
+// parse "ip/len[,gw]" into the address of the pcap interface
+static int parse_pcap_addr(const char *arg)
+{
+	char buf[64];
+	strncpy(buf, arg, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	char *gw = strchr(buf, ',');
+	if (gw)
+		*gw++ = '\0';
+
+	char *len = strchr(buf, '/');
+	if (!len)
+		return -1;
+	*len++ = '\0';
+
+	struct in_addr ip;
+	int prefix = atoi(len);
+	if (!inet_aton(buf, &ip) || prefix <= 0 || prefix > 32)
+		return -1;
+	ustack_conf.pcap_ip = ntohl(ip.s_addr);
+	ustack_conf.pcap_mask = 0xffffffff << (32 - prefix);
+
+	ustack_conf.pcap_gw = 0;
+	if (gw) {
+		if (!inet_aton(gw, &ip))
+			return -1;
+		ustack_conf.pcap_gw = ntohl(ip.s_addr);
+	}
+
+	return 0;
+}
+
+// parse the options in front of the application arguments into ustack_conf,
+// return the index of the first application argument
+static int parse_options(int argc, char **argv)
+{
+	const char *base = basename(argv[0]);
+	int opt;
+	while ((opt = getopt(argc, argv, "+m:B:N:T:tq:x:zL:D:R:Q:X:J:r:o:A:Pn:Ew:b:S:W:M:d:skeuO:c:g")) != -1) {
+		switch (opt) {
+			case 'm':
+				ustack_conf.netdev = netdev_find(optarg);
+				if (!ustack_conf.netdev)
+					usage_and_exit(base);
+				break;
+			case 'B':
+				ustack_conf.ring_block_size = atoi(optarg);
+				break;
+			case 'N':
+				ustack_conf.ring_block_nr = atoi(optarg);
+				break;
+			case 'T':
+				ustack_conf.ring_block_timeout = atoi(optarg);
+				break;
+			case 't':
+				ustack_conf.tx_ring = 1;
+				break;
+			case 'q':
+				ustack_conf.xdp_queue = atoi(optarg);
+				break;
+			case 'x':
+				if (strcmp(optarg, "skb") == 0)
+					ustack_conf.xdp_drv_mode = 0;
+				else if (strcmp(optarg, "drv") == 0)
+					ustack_conf.xdp_drv_mode = 1;
+				else
+					usage_and_exit(base);
+				break;
+			case 'z':
+				ustack_conf.xdp_zerocopy = 1;
+				break;
+			case 'L':
+				ustack_conf.pipe_loss = atof(optarg);
+				break;
+			case 'D':
+				ustack_conf.pipe_delay = atoi(optarg);
+				break;
+			case 'R':
+				ustack_conf.pipe_rate = atoi(optarg);
+				break;
+			case 'Q':
+				ustack_conf.pipe_queue = atoi(optarg);
+				break;
+			case 'X':
+				ustack_conf.pipe_reorder = atof(optarg);
+				if (strchr(optarg, ','))
+					ustack_conf.pipe_reorder_delay = atoi(strchr(optarg, ',') + 1);
+				break;
+			case 'J':
+				ustack_conf.pipe_spike = atof(optarg);
+				if (strchr(optarg, ','))
+					ustack_conf.pipe_spike_delay = atoi(strchr(optarg, ',') + 1);
+				break;
+			case 'r':
+				ustack_conf.pcap_in = optarg;
+				break;
+			case 'o':
+				ustack_conf.pcap_out = optarg;
+				break;
+			case 'A':
+				if (parse_pcap_addr(optarg) < 0)
+					usage_and_exit(base);
+				break;
+			case 'P':
+				ustack_conf.pcap_pace = 1;
+				break;
+			case 'n':
+				ustack_conf.pcap_loops = atoi(optarg);
+				break;
+			case 'E':
+				ustack_conf.evloop = 1;
+				break;
+			case 'w':
+				ustack_conf.rx_workers = atoi(optarg);
+				break;
+			case 'b':
+				ustack_conf.busy_poll = atoi(optarg);
+				break;
+			case 'S':
+				ustack_conf.tcp_sndbuf = atoi(optarg);
+				break;
+			case 'W':
+				ustack_conf.tcp_rcvbuf = atoi(optarg);
+				break;
+			case 'M':
+				ustack_conf.tcp_rcvbuf_max = atoi(optarg);
+				break;
+			case 'd':
+				ustack_conf.tcp_delack = atoi(optarg);
+				break;
+			case 's':
+				ustack_conf.tcp_sack = 0;
+				break;
+			case 'k':
+				ustack_conf.tcp_timestamps = 0;
+				break;
+			case 'e':
+				ustack_conf.tcp_rack = 0;
+				break;
+			case 'u':
+				ustack_conf.tcp_undo = 0;
+				break;
+			case 'O':
+				ustack_conf.tcp_rto_min = atoi(optarg);
+				if (strchr(optarg, ','))
+					ustack_conf.tcp_rto_max = atoi(strchr(optarg, ',') + 1);
+				break;
+			case 'c':
+				ustack_conf.tcp_cong = tcp_cong_find(optarg);
+				if (!ustack_conf.tcp_cong)
+					usage_and_exit(base);
+				break;
+			case 'g':
+				ustack_conf.tcp_cwnd_trace = 1;
+				break;
+			default:
+				usage_and_exit(base);
+		}
+	}
+
+	// the block should be a multiple of page size, and hold at least one frame
+	if (ustack_conf.ring_block_size < RX_RING_FRAME_SIZE || \
+			ustack_conf.ring_block_size % getpagesize() || \
+			ustack_conf.ring_block_nr <= 0 || ustack_conf.ring_block_timeout < 0) {
+		fprintf(stderr, "invalid geometry of the receive ring.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.pipe_loss < 0 || ustack_conf.pipe_loss > 100 || \
+			ustack_conf.pipe_delay < 0 || ustack_conf.pipe_rate < 0 || \
+			ustack_conf.pipe_queue < 0 || ustack_conf.pipe_reorder < 0 || \
+			ustack_conf.pipe_reorder > 100 || ustack_conf.pipe_reorder_delay < 0 || \
+			ustack_conf.pipe_spike < 0 || ustack_conf.pipe_spike > 100 || \
+			ustack_conf.pipe_spike_delay < 0) {
+		fprintf(stderr, "invalid emulation of the pipe.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.pcap_loops < 0) {
+		fprintf(stderr, "invalid times of replay.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.rx_workers < 0 || ustack_conf.rx_workers > NETDEV_MAX_WORKERS) {
+		fprintf(stderr, "invalid number of receiving threads.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.rx_workers && ustack_conf.evloop) {
+		fprintf(stderr, "the event loop is run by the poll loop, which is not used "
+				"with receiving threads.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.tcp_sndbuf <= 0) {
+		fprintf(stderr, "invalid size of send buffer.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.tcp_rcvbuf <= 0 ||
+			ustack_conf.tcp_rcvbuf > (TCP_MAX_WINDOW << TCP_MAX_WSCALE) ||
+			ustack_conf.tcp_rcvbuf_max < 0 ||
+			ustack_conf.tcp_rcvbuf_max > (TCP_MAX_WINDOW << TCP_MAX_WSCALE)) {
+		fprintf(stderr, "invalid size of receive buffer.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.tcp_rto_min < TCP_TIMER_SCAN_INTERVAL ||
+			ustack_conf.tcp_rto_max < ustack_conf.tcp_rto_min) {
+		fprintf(stderr, "invalid bounds of retransmission timeout.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.tcp_delack < 0) {
+		fprintf(stderr, "invalid time of delayed ack.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.busy_poll < 0) {
+		fprintf(stderr, "invalid time of busy polling.\n");
+		usage_and_exit(base);
+	}
+
+	if (ustack_conf.rx_workers > 1 && !ustack_conf.netdev->fanout) {
+		fprintf(stderr, "%s driver could not spread frames over receiving threads.\n",
+				ustack_conf.netdev->name);
+		usage_and_exit(base);
+	}
+
+	return optind;
+}
+
 static void run_application(const char *basename, char **args, int n)
 {
 	pthread_t thread;
@@ -272,7 +754,10 @@ static void run_application(const char *basename, char **args, int n)
 		if (n != 2)
 			usage_and_exit(basename);
 
-		u16 port = htons(atoi(args[1]));
+		// the arguments are read by the application thread, thus they should
+		// outlive this function
+		static u16 port;
+		port = htons(atoi(args[1]));
 		// pthread_create(&thread, NULL, tcp_server, &port);
 		pthread_create(&thread, NULL, tcp_server_file_ver, &port);
 	}
@@ -280,12 +765,40 @@ static void run_application(const char *basename, char **args, int n)
 		if (n != 3)
 			usage_and_exit(basename);
 
-		struct sock_addr skaddr;
+		static struct sock_addr skaddr;
 		skaddr.ip = inet_addr(args[1]);
 		skaddr.port = htons(atoi(args[2]));
 		// pthread_create(&thread, NULL, tcp_client, &skaddr);
 		pthread_create(&thread, NULL, tcp_client_file_ver, &skaddr);
 	}
+	else if (strcmp(args[0], "bench") == 0 || strcmp(args[0], "pingpong") == 0) {
+		if (n > 3 || (n > 2 && args[0][0] != 'b') || instance->nifs < 2) {
+			if (instance->nifs < 2)
+				fprintf(stderr, "%s needs two interfaces.\n", args[0]);
+			usage_and_exit(basename);
+		}
+
+		static struct tcp_bench_arg arg;
+		iface_info_t *server = list_entry(instance->iface_list.prev, \
+				iface_info_t, list);
+		arg.skaddr.ip = htonl(server->ip);
+		arg.skaddr.port = htons(TCP_BENCH_PORT);
+		arg.bytes = TCP_BENCH_BYTES;
+		arg.count = TCP_PINGPONG_COUNT;
+
+		if (args[0][0] == 'b') {
+			if (n >= 2)
+				arg.bytes = strtoull(args[1], NULL, 10);
+			if (n == 3)
+				arg.congs = args[2];
+			pthread_create(&thread, NULL, tcp_bench, &arg);
+		}
+		else {
+			if (n == 2)
+				arg.count = atoi(args[1]);
+			pthread_create(&thread, NULL, tcp_pingpong, &arg);
+		}
+	}
 	else {
 		usage_and_exit(basename);
 	}
@@ -293,18 +806,20 @@ static void run_application(const char *basename, char **args, int n)
 
 int main(int argc, char **argv)
 {
-	if (getuid() && geteuid()) {
-		fprintf(stderr, "Permission denied, should be superuser!\n");
-		exit(1);
+	int first = parse_options(argc, argv);
+	if (argc - first < 1) {
+		usage_and_exit(argv[0]);
 	}
 
-	if (argc < 2) {
-		usage_and_exit(argv[0]);
+	// only the interfaces of the kernel need raw sockets
+	if (!ustack_conf.netdev->probe && getuid() && geteuid()) {
+		fprintf(stderr, "Permission denied, should be superuser!\n");
+		exit(1);
 	}
 
 	init_ustack();
 
-	run_application(basename(argv[0]), argv+1, argc-1);
+	run_application(basename(argv[0]), argv+first, argc-first);
 
 	ustack_run();
 
@@ -0,0 +1,384 @@
+#include "netdev.h"
+#include "base.h"
+#include "ether.h"
+#include "packet_mmap.h"
+#include "packet_mmsg.h"
+#include "xsk.h"
+#include "pktbuf.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+static int open_device(const char *dname)
+{
+	int sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (sd < 0) {
+		perror("creating SOCK_RAW failed!");
+		return -1;
+	}
+
+	struct ifreq ifr;
+	bzero(&ifr, sizeof(struct ifreq));
+	strcpy(ifr.ifr_name, dname);
+	if (ioctl(sd, SIOCGIFINDEX, &ifr) < 0) {
+		perror("ioctl() SIOCGIFINDEX failed!");
+		return -1;
+	}
+
+	struct sockaddr_ll sll;
+	bzero(&sll, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = ifr.ifr_ifindex;
+
+	if (bind((int)sd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		perror("binding to device failed!");
+		return -1;
+	}
+
+	if (ioctl(sd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror("Start(): SIOCGIFHWADDR failed!");
+		return -1;
+	}
+
+	// It seems that we could capture all the packets without promisc mode.
+#if 0
+	struct packet_mreq mr;
+	bzero(&mr, sizeof(mr));
+	mr.mr_ifindex = sll.sll_ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+
+	if (setsockopt(sd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+		perror("Start(): setsockopt() PACKET_ADD_MEMBERSHIP failed!");
+		return -1;
+	}
+#endif
+
+	return sd;
+}
+
+// join fd into the fanout group of iface, the kernel hashes the flows over
+// the sockets in the group, so that the frames of one flow are always
+// received by the same queue
+static int fanout_join(int fd, iface_info_t *iface)
+{
+	// groups are shared by all the sockets of the network namespace
+	int id = (getpid() + iface->index) & 0xffff;
+	int arg = id | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0) {
+		perror("setsockopt() PACKET_FANOUT failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+// open the AF_PACKET socket of iface, together with the transmit ring if it
+// is configured
+//
+// The first receive queue shares the socket of iface, while the others have
+// their own sockets, all of them are joined into a fanout group if there are
+// more than one.
+static int packet_open(iface_info_t *iface)
+{
+	iface->fd = open_device(iface->name);
+	if (iface->fd < 0)
+		return -1;
+
+	for (int i = 0; i < iface->nrxqs; i++) {
+		struct rx_queue *rxq = &iface->rxqs[i];
+		rxq->fd = i ? open_device(iface->name) : iface->fd;
+		if (rxq->fd < 0)
+			return -1;
+
+		if (iface->nrxqs > 1 && fanout_join(rxq->fd, iface) < 0)
+			return -1;
+	}
+
+	if (ustack_conf.tx_ring && tx_ring_setup(iface) < 0) {
+		log(ERROR, "could not set up transmit ring on %s.", iface->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void packet_close(iface_info_t *iface)
+{
+	tx_ring_destroy(iface);
+
+	for (int i = 1; i < iface->nrxqs; i++) {
+		if (iface->rxqs[i].fd >= 0)
+			close(iface->rxqs[i].fd);
+		iface->rxqs[i].fd = -1;
+	}
+
+	close(iface->fd);
+	iface->fd = -1;
+	iface->rxqs[0].fd = -1;
+}
+
+static int packet_rx_burst(struct rx_queue *rxq, int budget)
+{
+	iface_info_t *iface = rxq->iface;
+	struct sockaddr_ll addr;
+	socklen_t addr_len = sizeof(addr);
+	char *buf = NULL;
+	int n = 0;
+
+	while (n < budget) {
+		// frames are received into packet buffers directly, a buffer is
+		// reused until a frame is handed to the stack
+		if (!buf && !(buf = pktbuf_alloc(ETH_FRAME_LEN)))
+			break;
+
+		int len = recvfrom(rxq->fd, buf, ETH_FRAME_LEN, MSG_DONTWAIT, \
+				(struct sockaddr*)&addr, &addr_len);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log(ERROR, "receive packet error: %s", strerror(errno));
+			break;
+		}
+		else if (len == 0) {
+			break;
+		}
+
+		n += 1;
+		if (addr.sll_pkttype == PACKET_OUTGOING) {
+			// XXX: Linux raw socket will capture both incoming and
+			// outgoing packets, we only care about the incoming ones.
+
+			// log(DEBUG, "received packet which is sent from the "
+			// 		"interface itself, drop it.");
+			continue;
+		}
+
+		handle_packet(iface, buf, len);
+		buf = NULL;
+	}
+
+	if (buf)
+		pktbuf_put(buf);
+
+	return n;
+}
+
+static void packet_sendto(iface_info_t *iface, const char *packet, int len)
+{
+	struct sockaddr_ll addr;
+	memset(&addr, 0, sizeof(struct sockaddr_ll));
+	addr.sll_family = AF_PACKET;
+	addr.sll_ifindex = iface->index;
+	addr.sll_halen = ETH_ALEN;
+	addr.sll_protocol = htons(ETH_P_ARP);
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
+
+	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
+				sizeof(struct sockaddr_ll)) < 0) {
+ 		perror("Send raw packet failed");
+	}
+}
+
+// frames are queued on the transmit ring if there is one, otherwise they are
+// sent right away by sendto
+static void packet_tx_burst(iface_info_t *iface, char **packets, int *lens, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (iface->tx_ring)
+			tx_ring_send(iface, packets[i], lens[i], 1);
+		else
+			packet_sendto(iface, packets[i], lens[i]);
+	}
+}
+
+static void packet_flush(iface_info_t *iface)
+{
+	tx_ring_flush(iface);
+}
+
+static void packet_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	tx_ring_dump_stats(iface, fp);
+}
+
+const struct netdev_ops packet_ops = {
+	.name = "recvfrom",
+	.probe = NULL,
+	.fanout = 1,
+	.open = packet_open,
+	.rx_burst = packet_rx_burst,
+	.tx_burst = packet_tx_burst,
+	.flush = packet_flush,
+	.close = packet_close,
+	.contains = NULL,
+	.dump_stats = packet_dump_stats,
+};
+
+static int mmap_open(iface_info_t *iface)
+{
+	if (packet_open(iface) < 0)
+		return -1;
+
+	for (int i = 0; i < iface->nrxqs; i++) {
+		if (rx_ring_setup(&iface->rxqs[i]) < 0) {
+			log(ERROR, "could not set up receive ring on %s.", iface->name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void mmap_close(iface_info_t *iface)
+{
+	for (int i = 0; i < iface->nrxqs; i++)
+		rx_ring_destroy(&iface->rxqs[i]);
+	packet_close(iface);
+}
+
+static void mmap_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	rx_ring_dump_stats(iface, fp);
+	tx_ring_dump_stats(iface, fp);
+}
+
+const struct netdev_ops mmap_ops = {
+	.name = "mmap",
+	.probe = NULL,
+	.fanout = 1,
+	.open = mmap_open,
+	.rx_burst = rx_ring_receive,
+	.tx_burst = packet_tx_burst,
+	.flush = packet_flush,
+	.close = mmap_close,
+	.contains = rx_ring_contains,
+	.dump_stats = mmap_dump_stats,
+};
+
+static int mmsg_open(iface_info_t *iface)
+{
+	if (packet_open(iface) < 0)
+		return -1;
+
+	if (mmsg_setup(iface) < 0) {
+		log(ERROR, "could not set up batched io on %s.", iface->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void mmsg_close(iface_info_t *iface)
+{
+	mmsg_destroy(iface);
+	packet_close(iface);
+}
+
+static void mmsg_tx_burst(iface_info_t *iface, char **packets, int *lens, int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (iface->tx_ring)
+			tx_ring_send(iface, packets[i], lens[i], 1);
+		else
+			mmsg_send(iface, packets[i], lens[i], 1);
+	}
+}
+
+static void mmsg_flush_all(iface_info_t *iface)
+{
+	tx_ring_flush(iface);
+	mmsg_flush(iface);
+}
+
+static void mmsg_dump_all_stats(iface_info_t *iface, FILE *fp)
+{
+	mmsg_dump_stats(iface, fp);
+	tx_ring_dump_stats(iface, fp);
+}
+
+const struct netdev_ops mmsg_ops = {
+	.name = "mmsg",
+	.probe = NULL,
+	.fanout = 1,
+	.open = mmsg_open,
+	.rx_burst = mmsg_receive,
+	.tx_burst = mmsg_tx_burst,
+	.flush = mmsg_flush_all,
+	.close = mmsg_close,
+	.contains = NULL,
+	.dump_stats = mmsg_dump_all_stats,
+};
+
+static int xdp_open(iface_info_t *iface)
+{
+	if (xsk_setup(iface) < 0) {
+		log(ERROR, "could not set up AF_XDP socket on %s.", iface->name);
+		return -1;
+	}
+
+	iface->rxqs[0].fd = iface->fd;
+
+	return 0;
+}
+
+// the socket is bound to a single queue of the device, thus the interface has
+// only one receive queue
+static int xdp_rx_burst(struct rx_queue *rxq, int budget)
+{
+	return xsk_receive(rxq->iface, budget);
+}
+
+static void xdp_tx_burst(iface_info_t *iface, char **packets, int *lens, int n)
+{
+	for (int i = 0; i < n; i++)
+		xsk_send(iface, packets[i], lens[i], 1);
+}
+
+const struct netdev_ops xdp_ops = {
+	.name = "xdp",
+	.probe = NULL,
+	.fanout = 0,
+	.open = xdp_open,
+	.rx_burst = xdp_rx_burst,
+	.tx_burst = xdp_tx_burst,
+	.flush = xsk_flush,
+	.close = xsk_destroy,
+	.contains = xsk_contains,
+	.dump_stats = xsk_dump_stats,
+};
+
+static const struct netdev_ops *netdev_drivers[] = {
+	&packet_ops,
+	&mmap_ops,
+	&mmsg_ops,
+	&xdp_ops,
+	&pipe_ops,
+	&pcap_ops,
+};
+
+#define NETDEV_DRIVER_NR	(sizeof(netdev_drivers) / sizeof(netdev_drivers[0]))
+
+const struct netdev_ops *netdev_find(const char *name)
+{
+	for (int i = 0; i < NETDEV_DRIVER_NR; i++) {
+		if (strcmp(netdev_drivers[i]->name, name) == 0)
+			return netdev_drivers[i];
+	}
+
+	return NULL;
+}
+
+// print the names of all the drivers, separated by '|'
+void netdev_list(FILE *fp)
+{
+	for (int i = 0; i < NETDEV_DRIVER_NR; i++)
+		fprintf(fp, "%s%s", i ? "|" : "", netdev_drivers[i]->name);
+}
@@ -0,0 +1,465 @@
+#include "netdev.h"
+#include "base.h"
+#include "ether.h"
+#include "ip.h"
+#include "rtable.h"
+#include "pktbuf.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <byteswap.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+// The pcap driver replays a capture file on one interface, the frames are
+// handed to handle_packet as fast as possible, or at their recorded
+// timestamps, and the frames sent by the stack are written to another capture
+// file. It gives a repeatable measurement of the receiving paths, without root
+// privilege or any network.
+//
+// The capture is mapped as a whole, and each frame is copied into a packet
+// buffer before it is handled, like the frames received by recvfrom. The
+// interface is readable through a timerfd: it is left expired in the fast
+// mode, and armed at the timestamp of the next frame in the paced mode.
+
+#define PCAP_MAGIC_USEC		0xa1b2c3d4		// timestamps in micro second
+#define PCAP_MAGIC_NSEC		0xa1b23c4d		// timestamps in nano second
+#define PCAP_MAGIC_USEC_SWAPPED	0xd4c3b2a1	// written in the other byte order
+#define PCAP_MAGIC_NSEC_SWAPPED	0x4d3cb2a1
+#define PCAP_VERSION_MAJOR	2
+#define PCAP_VERSION_MINOR	4
+#define PCAP_LINKTYPE_ETHER	1
+#define PCAP_SNAPLEN		65535
+
+#define PCAP_OUT_BUF_SIZE	(1 << 20)		// stdio buffer of the output file
+
+struct pcap_file_hdr {
+	u32 magic;
+	u16 version_major;
+	u16 version_minor;
+	u32 thiszone;
+	u32 sigfigs;
+	u32 snaplen;
+	u32 linktype;
+} __attribute__((packed));
+
+struct pcap_rec_hdr {
+	u32 ts_sec;
+	u32 ts_frac;			// micro or nano second, depending on the magic
+	u32 caplen;				// bytes saved in the file
+	u32 len;				// length of the frame on the wire
+} __attribute__((packed));
+
+struct pcap_dev {
+	int timer_fd;			// readable when the next frame should be replayed
+
+	char *map;				// the mapped input capture
+	size_t map_len;
+	size_t off;				// offset of the next record
+	int swapped;			// the capture is in the other byte order
+	int nsec;				// timestamps are in nano second
+	int loops;				// times the capture has been replayed
+
+	u64 base_ts;			// timestamp of the first frame (in nano second)
+	u64 start;				// when the current loop started (in nano second)
+
+	FILE *out;				// the output capture, NULL if not configured
+	pthread_mutex_t out_lock;	// senders come from different threads
+
+	u64 first_rx;			// when the first frame is replayed
+	u64 rx_frames;			// number of frames replayed
+	u64 rx_bytes;			// number of bytes replayed
+	u64 rx_dropped;			// number of records skipped as truncated
+	u64 tx_frames;			// number of frames sent by the stack
+	u64 tx_bytes;			// number of bytes sent by the stack
+};
+
+static inline u64 pcap_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline u32 pcap_u32(struct pcap_dev *dev, u32 v)
+{
+	return dev->swapped ? bswap_32(v) : v;
+}
+
+// the record at off, NULL if the capture ends or is truncated there
+static struct pcap_rec_hdr *pcap_record(struct pcap_dev *dev, size_t off)
+{
+	if (off + sizeof(struct pcap_rec_hdr) > dev->map_len)
+		return NULL;
+
+	struct pcap_rec_hdr *rec = (struct pcap_rec_hdr *)(dev->map + off);
+	if (off + sizeof(struct pcap_rec_hdr) + pcap_u32(dev, rec->caplen) > dev->map_len)
+		return NULL;
+
+	return rec;
+}
+
+// whether the frame of the record could be handed to the stack: the headers,
+// e.g. the total length of ip, are trusted there, so a frame cut by the
+// snaplen, or shorter than its headers tell, is not replayed
+static int pcap_record_ok(struct pcap_dev *dev, struct pcap_rec_hdr *rec)
+{
+	u32 caplen = pcap_u32(dev, rec->caplen);
+	if (caplen < pcap_u32(dev, rec->len) || caplen < ETHER_HDR_SIZE)
+		return 0;
+
+	char *frame = (char *)rec + sizeof(struct pcap_rec_hdr);
+	struct ether_header *eh = (struct ether_header *)frame;
+	if (ntohs(eh->ether_type) != ETH_P_IP)
+		return 1;
+
+	if (caplen < ETHER_HDR_SIZE + IP_BASE_HDR_SIZE)
+		return 0;
+
+	struct iphdr *ip = packet_to_ip_hdr(frame);
+	return IP_HDR_SIZE(ip) >= IP_BASE_HDR_SIZE &&
+		IP_HDR_SIZE(ip) <= ntohs(ip->tot_len) &&
+		ETHER_HDR_SIZE + ntohs(ip->tot_len) <= caplen;
+}
+
+static u64 pcap_record_ts(struct pcap_dev *dev, struct pcap_rec_hdr *rec)
+{
+	u64 frac = pcap_u32(dev, rec->ts_frac);
+	return (u64)pcap_u32(dev, rec->ts_sec) * 1000000000 + \
+		(dev->nsec ? frac : frac * 1000);
+}
+
+// fire the timer at due (in nano second of CLOCK_MONOTONIC), 0 disarms it
+static void pcap_arm(struct pcap_dev *dev, u64 due)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = due / 1000000000;
+	its.it_value.tv_nsec = due % 1000000000;
+
+	if (timerfd_settime(dev->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime() failed");
+}
+
+// map the input capture, and check that it holds ethernet frames
+static int pcap_map_input(struct pcap_dev *dev, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("open input capture failed");
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct pcap_file_hdr)) {
+		log(ERROR, "%s is not a capture file.", path);
+		close(fd);
+		return -1;
+	}
+
+	dev->map_len = st.st_size;
+	dev->map = mmap(NULL, dev->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (dev->map == MAP_FAILED) {
+		perror("mmap() input capture failed");
+		dev->map = NULL;
+		return -1;
+	}
+
+	struct pcap_file_hdr *hdr = (struct pcap_file_hdr *)dev->map;
+	switch (hdr->magic) {
+		case PCAP_MAGIC_USEC:
+			break;
+		case PCAP_MAGIC_NSEC:
+			dev->nsec = 1;
+			break;
+		case PCAP_MAGIC_USEC_SWAPPED:
+			dev->swapped = 1;
+			break;
+		case PCAP_MAGIC_NSEC_SWAPPED:
+			dev->swapped = 1;
+			dev->nsec = 1;
+			break;
+		default:
+			log(ERROR, "%s is not a capture file (pcapng is not supported).", path);
+			return -1;
+	}
+
+	if (pcap_u32(dev, hdr->linktype) != PCAP_LINKTYPE_ETHER) {
+		log(ERROR, "%s does not hold ethernet frames (link type %u).", path,
+				pcap_u32(dev, hdr->linktype));
+		return -1;
+	}
+
+	dev->off = sizeof(struct pcap_file_hdr);
+	struct pcap_rec_hdr *rec = pcap_record(dev, dev->off);
+	dev->base_ts = rec ? pcap_record_ts(dev, rec) : 0;
+
+	return 0;
+}
+
+static int pcap_open_output(struct pcap_dev *dev, const char *path)
+{
+	dev->out = fopen(path, "w");
+	if (!dev->out) {
+		perror("open output capture failed");
+		return -1;
+	}
+	setvbuf(dev->out, NULL, _IOFBF, PCAP_OUT_BUF_SIZE);
+
+	struct pcap_file_hdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_MAGIC_USEC;
+	hdr.version_major = PCAP_VERSION_MAJOR;
+	hdr.version_minor = PCAP_VERSION_MINOR;
+	hdr.snaplen = PCAP_SNAPLEN;
+	hdr.linktype = PCAP_LINKTYPE_ETHER;
+	fwrite(&hdr, sizeof(hdr), 1, dev->out);
+
+	return 0;
+}
+
+// create the interface replaying the capture, with the route to its network
+// and the default route if there is a gateway
+static int pcap_probe()
+{
+	if (!ustack_conf.pcap_in) {
+		log(ERROR, "pcap driver needs an input capture.");
+		return -1;
+	}
+
+	iface_info_t *iface = malloc(sizeof(iface_info_t));
+	bzero(iface, sizeof(iface_info_t));
+
+	init_list_head(&iface->list);
+	strcpy(iface->name, "pcap0");
+	iface->index = 1;
+	// locally administered address
+	iface->mac[0] = 0x02;
+	iface->mac[ETH_ALEN - 1] = 1;
+	iface->ip = ustack_conf.pcap_ip;
+	iface->mask = ustack_conf.pcap_mask;
+	struct in_addr ip = { htonl(iface->ip) };
+	strcpy(iface->ip_str, inet_ntoa(ip));
+
+	list_add_tail(&iface->list, &instance->iface_list);
+	instance->nifs += 1;
+
+	add_rt_entry(new_rt_entry(iface->ip & iface->mask, iface->mask, 0, iface));
+	if (ustack_conf.pcap_gw)
+		add_rt_entry(new_rt_entry(0, 0, ustack_conf.pcap_gw, iface));
+
+	log(DEBUG, "pcap %s (%s): replay %s %s, %d times, write %s.", iface->name,
+			iface->ip_str, ustack_conf.pcap_in,
+			ustack_conf.pcap_pace ? "at recorded timestamps" : "as fast as possible",
+			ustack_conf.pcap_loops,
+			ustack_conf.pcap_out ? ustack_conf.pcap_out : "nothing");
+
+	return 0;
+}
+
+static int pcap_open(iface_info_t *iface)
+{
+	struct pcap_dev *dev = malloc(sizeof(struct pcap_dev));
+	memset(dev, 0, sizeof(struct pcap_dev));
+	iface->priv = dev;
+
+	if (pcap_map_input(dev, ustack_conf.pcap_in) < 0)
+		return -1;
+
+	if (ustack_conf.pcap_out && pcap_open_output(dev, ustack_conf.pcap_out) < 0)
+		return -1;
+
+	dev->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (dev->timer_fd < 0) {
+		perror("timerfd_create() failed");
+		return -1;
+	}
+
+	pthread_mutex_init(&dev->out_lock, NULL);
+
+	// a time in the past fires the timer at once, the first frame is always
+	// due when the replay starts
+	pcap_arm(dev, 1);
+
+	iface->fd = dev->timer_fd;
+	iface->rxqs[0].fd = dev->timer_fd;
+
+	return 0;
+}
+
+static void pcap_close(iface_info_t *iface)
+{
+	struct pcap_dev *dev = iface->priv;
+	if (!dev)
+		return ;
+
+	if (dev->out) {
+		pthread_mutex_lock(&dev->out_lock);
+		fclose(dev->out);
+		dev->out = NULL;
+		pthread_mutex_unlock(&dev->out_lock);
+	}
+
+	if (dev->map)
+		munmap(dev->map, dev->map_len);
+	close(dev->timer_fd);
+	pthread_mutex_destroy(&dev->out_lock);
+	free(dev);
+
+	iface->priv = NULL;
+	iface->fd = -1;
+	iface->rxqs[0].fd = -1;
+}
+
+static void pcap_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	struct pcap_dev *dev = iface->priv;
+	if (!dev)
+		return ;
+
+	double elapsed = dev->rx_frames ? (pcap_now() - dev->first_rx) / 1e9 : 0.0;
+	fprintf(fp, "%s: pcap replayed %lu frames, %lu bytes in %.3lf s, %.0lf frames/s, "
+			"%.2lf Mbit/s, dropped %lu truncated, sent %lu frames, %lu bytes\n",
+			iface->name,
+			dev->rx_frames, dev->rx_bytes, elapsed,
+			elapsed > 0 ? dev->rx_frames / elapsed : 0.0,
+			elapsed > 0 ? dev->rx_bytes * 8 / elapsed / 1e6 : 0.0,
+			dev->rx_dropped, dev->tx_frames, dev->tx_bytes);
+}
+
+// the capture has been replayed for the configured times, report the rate and
+// quit, so that the replay could be timed by scripts
+static void pcap_finish(iface_info_t *iface)
+{
+	struct pcap_dev *dev = iface->priv;
+
+	pcap_dump_stats(iface, stderr);
+
+	if (dev->out) {
+		pthread_mutex_lock(&dev->out_lock);
+		fflush(dev->out);
+		pthread_mutex_unlock(&dev->out_lock);
+	}
+
+	exit(0);
+}
+
+// replay at most budget frames which are due
+static int pcap_rx_burst(struct rx_queue *rxq, int budget)
+{
+	iface_info_t *iface = rxq->iface;
+	struct pcap_dev *dev = iface->priv;
+	u64 expirations;
+	int n = 0, dropped = 0;
+
+	if (!dev->first_rx) {
+		dev->first_rx = pcap_now();
+		dev->start = dev->first_rx;
+	}
+
+	// the timer is left expired in the fast mode, so that the interface stays
+	// readable until the capture ends
+	if (ustack_conf.pcap_pace && read(dev->timer_fd, &expirations,
+				sizeof(expirations)) < 0 && errno != EAGAIN)
+		perror("read timerfd failed");
+
+	while (n + dropped < budget) {
+		struct pcap_rec_hdr *rec = pcap_record(dev, dev->off);
+		if (!rec) {
+			if (++dev->loops == ustack_conf.pcap_loops)
+				pcap_finish(iface);
+
+			dev->off = sizeof(struct pcap_file_hdr);
+			dev->start = pcap_now();
+			if (!pcap_record(dev, dev->off))
+				pcap_finish(iface);
+			continue;
+		}
+
+		if (ustack_conf.pcap_pace) {
+			u64 due = dev->start + (pcap_record_ts(dev, rec) - dev->base_ts);
+			if (due > pcap_now()) {
+				pcap_arm(dev, due);
+				return n;
+			}
+		}
+
+		int len = pcap_u32(dev, rec->caplen);
+		if (!pcap_record_ok(dev, rec)) {
+			dev->off += sizeof(struct pcap_rec_hdr) + len;
+			dev->rx_dropped += 1;
+			dropped += 1;
+			continue;
+		}
+
+		char *packet = pktbuf_alloc(len);
+		if (!packet)
+			break;
+		memcpy(packet, (char *)rec + sizeof(struct pcap_rec_hdr), len);
+		dev->off += sizeof(struct pcap_rec_hdr) + len;
+
+		dev->rx_frames += 1;
+		dev->rx_bytes += len;
+		n += 1;
+
+		handle_packet(iface, packet, len);
+	}
+
+	if (ustack_conf.pcap_pace)
+		pcap_arm(dev, 1);
+
+	return n;
+}
+
+// write the frames to the output capture, stamped with the current time
+static void pcap_tx_burst(iface_info_t *iface, char **packets, int *lens, int n)
+{
+	struct pcap_dev *dev = iface->priv;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	pthread_mutex_lock(&dev->out_lock);
+	for (int i = 0; i < n; i++) {
+		dev->tx_frames += 1;
+		dev->tx_bytes += lens[i];
+		if (!dev->out)
+			continue;
+
+		struct pcap_rec_hdr rec;
+		rec.ts_sec = now.tv_sec;
+		rec.ts_frac = now.tv_nsec / 1000;
+		rec.caplen = lens[i];
+		rec.len = lens[i];
+		fwrite(&rec, sizeof(rec), 1, dev->out);
+		fwrite(packets[i], lens[i], 1, dev->out);
+	}
+	pthread_mutex_unlock(&dev->out_lock);
+}
+
+// frames are buffered by stdio, and written out when the buffer is full or
+// the replay ends
+static void pcap_flush(iface_info_t *iface)
+{
+}
+
+const struct netdev_ops pcap_ops = {
+	.name = "pcap",
+	.probe = pcap_probe,
+	.fanout = 0,
+	.open = pcap_open,
+	.rx_burst = pcap_rx_burst,
+	.tx_burst = pcap_tx_burst,
+	.flush = pcap_flush,
+	.close = pcap_close,
+	.contains = NULL,
+	.dump_stats = pcap_dump_stats,
+};
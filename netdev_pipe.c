@@ -0,0 +1,341 @@
+#include "netdev.h"
+#include "base.h"
+#include "ether.h"
+#include "rtable.h"
+#include "pktbuf.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/timerfd.h>
+
+// The pipe driver connects two interfaces inside the process, the frames sent
+// on one interface are received on the other one, so that the whole stack could
+// be exercised without root privilege or any network.
+//
+// Each interface owns the queue of frames heading to it, the frames are
+// delivered once they are due, that is, after they are serialized at the
+// configured rate and have propagated for the configured delay. The timerfd
+// of the interface is armed at the due time of the first frame in the queue.
+//
+// Besides the losses, the path may reorder the frames, i.e. hold some of them
+// longer than the frames sent after them, or stall for a while (a delay
+// spike), which holds the frames sent meanwhile in order behind it.
+
+#define PIPE_NR			2
+
+// a frame travelling on the pipe
+struct pipe_frame {
+	struct list_head list;
+	u64 due;				// when the frame arrives (in nano second)
+	int len;
+	char *data;
+};
+
+// the receiving end of one direction of the pipe
+struct pipe_end {
+	pthread_mutex_t lock;	// senders come from different threads
+	struct list_head queue;	// frames on the way, in the order of due time
+	int timer_fd;			// readable when the first frame is due
+	u64 busy_until;			// when the link finishes serializing the queued
+							// frames (in nano second)
+	unsigned int seed;		// state of the loss generator
+	u64 stall_until;		// the end of the delay spike (in nano second)
+
+	u64 rx_frames;			// number of frames delivered
+	u64 rx_bytes;			// number of bytes delivered
+	u64 lost;				// frames dropped by the loss rate
+	u64 overflow;			// frames dropped for the queue is full
+	u64 oversized;			// frames dropped for larger than a frame
+	u64 reordered;			// frames held behind the frames after them
+	u64 spikes;				// delay spikes
+};
+
+static const char *pipe_names[PIPE_NR] = { "pipe0", "pipe1" };
+static const char *pipe_ips[PIPE_NR] = { "10.0.0.1", "10.0.0.2" };
+
+static iface_info_t *pipe_ifaces[PIPE_NR];
+
+static inline u64 pipe_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// whether the event of the chance (in percent) happens
+static inline int pipe_chance(struct pipe_end *end, double percent)
+{
+	return percent > 0 && rand_r(&end->seed) < percent / 100 * RAND_MAX;
+}
+
+static inline iface_info_t *pipe_peer(iface_info_t *iface)
+{
+	return iface == pipe_ifaces[0] ? pipe_ifaces[1] : pipe_ifaces[0];
+}
+
+// must be called with end->lock held
+static void pipe_arm(struct pipe_end *end)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	if (!list_empty(&end->queue)) {
+		struct pipe_frame *f = list_entry(end->queue.next, struct pipe_frame, list);
+		// a zero value disarms the timer, while a time in the past fires it
+		// at once
+		u64 due = f->due ? f->due : 1;
+		its.it_value.tv_sec = due / 1000000000;
+		its.it_value.tv_nsec = due % 1000000000;
+	}
+
+	if (timerfd_settime(end->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime() failed");
+}
+
+// create the two interfaces of the pipe, and the routes to each other
+static int pipe_probe()
+{
+	for (int i = 0; i < PIPE_NR; i++) {
+		iface_info_t *iface = malloc(sizeof(iface_info_t));
+		bzero(iface, sizeof(iface_info_t));
+
+		init_list_head(&iface->list);
+		strcpy(iface->name, pipe_names[i]);
+		iface->index = i + 1;
+		// locally administered addresses
+		iface->mac[0] = 0x02;
+		iface->mac[ETH_ALEN - 1] = i + 1;
+		iface->ip = ntohl(inet_addr(pipe_ips[i]));
+		iface->mask = 0xffffff00;
+		strcpy(iface->ip_str, pipe_ips[i]);
+
+		list_add_tail(&iface->list, &instance->iface_list);
+		instance->nifs += 1;
+
+		pipe_ifaces[i] = iface;
+	}
+
+	// both interfaces are in the same network, the host routes tell which
+	// end leads to the other
+	for (int i = 0; i < PIPE_NR; i++) {
+		iface_info_t *iface = pipe_ifaces[i];
+		add_rt_entry(new_rt_entry(pipe_peer(iface)->ip, 0xffffffff, 0, iface));
+	}
+
+	log(DEBUG, "pipe %s (%s) <-> %s (%s): loss %.2lf%%, delay %d ms, "
+			"rate %d Mbit/s, queue %d bytes, reorder %.2lf%% by %d ms, "
+			"spike %.2lf%% of %d ms.", pipe_names[0], pipe_ips[0],
+			pipe_names[1], pipe_ips[1], ustack_conf.pipe_loss,
+			ustack_conf.pipe_delay, ustack_conf.pipe_rate, ustack_conf.pipe_queue,
+			ustack_conf.pipe_reorder, ustack_conf.pipe_reorder_delay,
+			ustack_conf.pipe_spike, ustack_conf.pipe_spike_delay);
+
+	return 0;
+}
+
+static int pipe_open(iface_info_t *iface)
+{
+	struct pipe_end *end = malloc(sizeof(struct pipe_end));
+	memset(end, 0, sizeof(struct pipe_end));
+
+	end->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (end->timer_fd < 0) {
+		perror("timerfd_create() failed");
+		free(end);
+		return -1;
+	}
+
+	pthread_mutex_init(&end->lock, NULL);
+	init_list_head(&end->queue);
+	end->seed = iface->index;
+
+	iface->priv = end;
+	iface->fd = end->timer_fd;
+	iface->rxqs[0].fd = end->timer_fd;
+
+	return 0;
+}
+
+static void pipe_close(iface_info_t *iface)
+{
+	struct pipe_end *end = iface->priv;
+	if (!end)
+		return ;
+
+	struct pipe_frame *f, *q;
+	list_for_each_entry_safe(f, q, &end->queue, list) {
+		list_delete_entry(&f->list);
+		pktbuf_put(f->data);
+		free(f);
+	}
+
+	close(end->timer_fd);
+	pthread_mutex_destroy(&end->lock);
+	free(end);
+	iface->priv = NULL;
+	iface->fd = -1;
+	iface->rxqs[0].fd = -1;
+}
+
+// deliver at most budget frames which are due to the stack
+static int pipe_rx_burst(struct rx_queue *rxq, int budget)
+{
+	iface_info_t *iface = rxq->iface;
+	struct pipe_end *end = iface->priv;
+	struct list_head due;
+	u64 expirations;
+	int n = 0;
+
+	init_list_head(&due);
+
+	pthread_mutex_lock(&end->lock);
+
+	if (read(end->timer_fd, &expirations, sizeof(expirations)) < 0 && \
+			errno != EAGAIN)
+		perror("read timerfd failed");
+
+	u64 now = pipe_now();
+	struct pipe_frame *f, *q;
+	list_for_each_entry_safe(f, q, &end->queue, list) {
+		if (f->due > now || n == budget)
+			break;
+
+		list_delete_entry(&f->list);
+		list_add_tail(&f->list, &due);
+		n += 1;
+	}
+
+	pipe_arm(end);
+
+	pthread_mutex_unlock(&end->lock);
+
+	// the frames are handed to the stack out of the lock, since the stack may
+	// send frames on the way
+	list_for_each_entry_safe(f, q, &due, list) {
+		list_delete_entry(&f->list);
+		end->rx_frames += 1;
+		end->rx_bytes += f->len;
+		handle_packet(iface, f->data, f->len);
+		free(f);
+	}
+
+	return n;
+}
+
+// put the frames into the queue of the other end
+static void pipe_tx_burst(iface_info_t *iface, char **packets, int *lens, int n)
+{
+	struct pipe_end *end = pipe_peer(iface)->priv;
+
+	pthread_mutex_lock(&end->lock);
+
+	int new_first = 0;
+	u64 now = pipe_now();
+	for (int i = 0; i < n; i++) {
+		if (lens[i] > ETH_FRAME_LEN) {
+			end->oversized += 1;
+			continue;
+		}
+
+		if (pipe_chance(end, ustack_conf.pipe_loss)) {
+			end->lost += 1;
+			continue;
+		}
+
+		u64 depart = now;
+		if (ustack_conf.pipe_rate > 0) {
+			if (end->busy_until > now) {
+				// the bytes waiting for serialization are the backlog
+				u64 backlog = (end->busy_until - now) * ustack_conf.pipe_rate / 8000;
+				if (ustack_conf.pipe_queue > 0 && backlog >= ustack_conf.pipe_queue) {
+					end->overflow += 1;
+					continue;
+				}
+				depart = end->busy_until;
+			}
+			depart += (u64)lens[i] * 8000 / ustack_conf.pipe_rate;
+			end->busy_until = depart;
+		}
+
+		if (end->stall_until > depart)
+			depart = end->stall_until;
+		if (pipe_chance(end, ustack_conf.pipe_spike)) {
+			depart += (u64)ustack_conf.pipe_spike_delay * 1000000;
+			end->stall_until = depart;
+			end->spikes += 1;
+		}
+
+		struct pipe_frame *f = malloc(sizeof(struct pipe_frame));
+		char *data = pktbuf_alloc(lens[i]);
+		if (!f || !data) {
+			log(ERROR, "malloc failed when sending packet through pipe.");
+			free(f);
+			if (data)
+				pktbuf_put(data);
+			continue;
+		}
+		f->data = data;
+		memcpy(f->data, packets[i], lens[i]);
+		f->len = lens[i];
+		f->due = depart + (u64)ustack_conf.pipe_delay * 1000000;
+		if (pipe_chance(end, ustack_conf.pipe_reorder)) {
+			f->due += (u64)ustack_conf.pipe_reorder_delay * 1000000;
+			end->reordered += 1;
+		}
+
+		// the frames are due in order, except those held longer, which the
+		// frames after them overtake
+		struct list_head *prev = end->queue.prev;
+		while (prev != &end->queue) {
+			struct pipe_frame *p = list_entry(prev, struct pipe_frame, list);
+			if (p->due <= f->due)
+				break;
+			prev = prev->prev;
+		}
+		list_insert(&f->list, prev, prev->next);
+		new_first |= prev == &end->queue;
+	}
+
+	// the timer follows the first frame, which is changed only if a frame is
+	// put in front of the queue
+	if (new_first)
+		pipe_arm(end);
+
+	pthread_mutex_unlock(&end->lock);
+}
+
+// frames are in the queue of the other end once they are sent
+static void pipe_flush(iface_info_t *iface)
+{
+}
+
+static void pipe_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	struct pipe_end *end = iface->priv;
+	if (!end)
+		return ;
+
+	fprintf(fp, "%s: pipe received %lu frames, %lu bytes, dropped %lu by loss, "
+			"%lu by full queue, %lu oversized, reordered %lu, %lu delay spikes\n",
+			iface->name, end->rx_frames, end->rx_bytes, end->lost, end->overflow,
+			end->oversized, end->reordered, end->spikes);
+}
+
+const struct netdev_ops pipe_ops = {
+	.name = "pipe",
+	.probe = pipe_probe,
+	.fanout = 0,
+	.open = pipe_open,
+	.rx_burst = pipe_rx_burst,
+	.tx_burst = pipe_tx_burst,
+	.flush = pipe_flush,
+	.close = pipe_close,
+	.contains = NULL,
+	.dump_stats = pipe_dump_stats,
+};
@@ -1,37 +1,47 @@
 #include "packet.h"
 #include "types.h"
 #include "ether.h"
+#include "netdev.h"
+#include "pktbuf.h"
+
+#include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
-#include <arpa/inet.h>
-#include <linux/if_packet.h>
 
 extern ustack_t *instance;
 
+// set while the receiving loop is handling the frames of one poll, the frames
+// sent meanwhile are flushed at once by iface_tx_batch_end
+static __thread int tx_batching = 0;
+
+void iface_tx_batch_begin()
+{
+	tx_batching = 1;
+}
+
+void iface_tx_batch_end()
+{
+	tx_batching = 0;
+
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list)
+		iface->ops->flush(iface);
+}
+
 void _iface_send_packet(iface_info_t *iface, char *packet, int len)
 {
-	struct sockaddr_ll addr;
-	memset(&addr, 0, sizeof(struct sockaddr_ll));
-	addr.sll_family = AF_PACKET;
-	addr.sll_ifindex = iface->index;
-	addr.sll_halen = ETH_ALEN;
-	addr.sll_protocol = htons(ETH_P_ARP);
-	struct ether_header *eh = (struct ether_header *)packet;
-	memcpy(addr.sll_addr, eh->ether_dhost, ETH_ALEN);
-
-	if (sendto(iface->fd, packet, len, 0, (const struct sockaddr *)&addr,
-				sizeof(struct sockaddr_ll)) < 0) {
- 		perror("Send raw packet failed");
-	}
+	iface->ops->tx_burst(iface, &packet, &len, 1);
+	if (!tx_batching)
+		iface->ops->flush(iface);
 }
 
 void iface_send_packet(iface_info_t *iface, char *packet, int len)
 {
 	_iface_send_packet(iface, packet, len);
-	free(packet);
+	packet_free(packet);
 }
 
 void broadcast_packet(iface_info_t *in_iface, char *packet, int len)
@@ -44,5 +54,45 @@ void broadcast_packet(iface_info_t *in_iface, char *packet, int len)
 		_iface_send_packet(iface, packet, len);
 	}
 
-	free(packet);
+	packet_free(packet);
+}
+
+int packet_is_borrowed(const char *packet)
+{
+	iface_info_t *iface = NULL;
+	list_for_each_entry(iface, &instance->iface_list, list) {
+		if (iface->ops->contains && iface->ops->contains(iface, packet))
+			return 1;
+	}
+
+	return 0;
+}
+
+void packet_free(char *packet)
+{
+	if (!packet_is_borrowed(packet))
+		pktbuf_put(packet);
+}
+
+char *packet_own(char *packet, int len)
+{
+	if (!packet_is_borrowed(packet))
+		return packet;
+
+	char *copy = pktbuf_alloc(len);
+	if (!copy) {
+		log(ERROR, "could not copy borrowed packet.");
+		return NULL;
+	}
+	memcpy(copy, packet, len);
+
+	return copy;
+}
+
+char *packet_hold(char *packet, int len)
+{
+	if (!packet_is_borrowed(packet))
+		return pktbuf_get(packet);
+
+	return packet_own(packet, len);
 }
@@ -0,0 +1,346 @@
+#include "packet_mmap.h"
+#include "base.h"
+#include "ether.h"
+#include "netdev.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+// map a TPACKET_V3 receive ring on the socket of rxq, the geometry of the
+// ring is taken from ustack_conf
+int rx_ring_setup(struct rx_queue *rxq)
+{
+	int version = TPACKET_V3;
+	if (setsockopt(rxq->fd, SOL_PACKET, PACKET_VERSION, &version,
+				sizeof(version)) < 0) {
+		perror("setsockopt() PACKET_VERSION failed");
+		return -1;
+	}
+
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ustack_conf.ring_block_size;
+	req.tp_block_nr = ustack_conf.ring_block_nr;
+	req.tp_frame_size = RX_RING_FRAME_SIZE;
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+	req.tp_retire_blk_tov = ustack_conf.ring_block_timeout;
+
+	if (setsockopt(rxq->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt() PACKET_RX_RING failed");
+		return -1;
+	}
+
+	struct rx_ring *ring = malloc(sizeof(struct rx_ring));
+	memset(ring, 0, sizeof(struct rx_ring));
+	ring->block_size = req.tp_block_size;
+	ring->block_nr = req.tp_block_nr;
+	ring->map_len = (size_t)ring->block_size * ring->block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+			rxq->fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("mmap() receive ring failed");
+		free(ring);
+		return -1;
+	}
+
+	rxq->rx_ring = ring;
+
+	log(DEBUG, "receive ring of %s queue %d: %d blocks of %d bytes.",
+			rxq->iface->name, rxq->id, ring->block_nr, ring->block_size);
+
+	return 0;
+}
+
+void rx_ring_destroy(struct rx_queue *rxq)
+{
+	struct rx_ring *ring = rxq->rx_ring;
+	if (!ring)
+		return ;
+
+	munmap(ring->map, ring->map_len);
+	free(ring);
+	rxq->rx_ring = NULL;
+}
+
+static inline struct tpacket_block_desc *rx_ring_block(struct rx_ring *ring, int i)
+{
+	return (struct tpacket_block_desc *)(ring->map + (size_t)i * ring->block_size);
+}
+
+static void rx_ring_account_block(struct rx_ring *ring, u32 n)
+{
+	int bucket = 0;
+	while ((n >> (bucket + 1)) && bucket < RX_RING_HIST_BUCKETS - 1)
+		bucket += 1;
+
+	ring->blocks += 1;
+	ring->frames += n;
+	ring->hist[bucket] += 1;
+	if (n > ring->max_frames)
+		ring->max_frames = n;
+}
+
+// walk the blocks that have been retired to user space, hand each frame to
+// handle_packet without copying it, and give the blocks back to the kernel
+//
+// Blocks are consumed as a whole, thus the walk stops at the first block
+// boundary after budget frames have been handled.
+//
+// Frames stay in the ring only until its block is given back, that is, until
+// handle_packet returns. Those who want to keep the frame for longer should
+// call packet_own (see packet.h).
+int rx_ring_receive(struct rx_queue *rxq, int budget)
+{
+	iface_info_t *iface = rxq->iface;
+	struct rx_ring *ring = rxq->rx_ring;
+	int n = 0;
+
+	while (n < budget) {
+		struct tpacket_block_desc *bd = rx_ring_block(ring, ring->cur);
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+
+		__sync_synchronize();
+
+		u32 num_pkts = bd->hdr.bh1.num_pkts;
+		struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((char *)bd +
+				bd->hdr.bh1.offset_to_first_pkt);
+		for (u32 i = 0; i < num_pkts; i++) {
+			struct sockaddr_ll *sll = (struct sockaddr_ll *)((char *)hdr +
+					TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			// XXX: Like recvfrom, the ring also captures the outgoing packets,
+			// we only care about the incoming ones.
+			if (sll->sll_pkttype != PACKET_OUTGOING)
+				handle_packet(iface, (char *)hdr + hdr->tp_mac, hdr->tp_snaplen);
+
+			hdr = (struct tpacket3_hdr *)((char *)hdr + hdr->tp_next_offset);
+		}
+
+		if (num_pkts)
+			rx_ring_account_block(ring, num_pkts);
+		n += num_pkts;
+
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		ring->cur = (ring->cur + 1) % ring->block_nr;
+	}
+
+	return n;
+}
+
+// check whether packet points into one of the receive rings of iface
+int rx_ring_contains(iface_info_t *iface, const char *packet)
+{
+	for (int i = 0; i < iface->nrxqs; i++) {
+		struct rx_ring *ring = iface->rxqs[i].rx_ring;
+		if (ring && packet >= ring->map && packet < ring->map + ring->map_len)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void rx_ring_dump_queue_stats(struct rx_queue *rxq, FILE *fp)
+{
+	struct rx_ring *ring = rxq->rx_ring;
+	if (!ring)
+		return ;
+
+	fprintf(fp, "%s queue %d: rx ring %d x %d bytes, %lu blocks, %lu frames, "
+			"%.2lf frames/block on average, %u at most\n", rxq->iface->name,
+			rxq->id, ring->block_nr, ring->block_size, ring->blocks, ring->frames,
+			ring->blocks ? (double)ring->frames / ring->blocks : 0.0,
+			ring->max_frames);
+
+	fprintf(fp, "\tframes/block:");
+	for (int i = 0; i < RX_RING_HIST_BUCKETS; i++) {
+		if (i == RX_RING_HIST_BUCKETS - 1)
+			fprintf(fp, " [%d,inf)=%lu", 1 << i, ring->hist[i]);
+		else
+			fprintf(fp, " [%d,%d]=%lu", 1 << i, (2 << i) - 1, ring->hist[i]);
+	}
+	fprintf(fp, "\n");
+}
+
+void rx_ring_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	for (int i = 0; i < iface->nrxqs; i++)
+		rx_ring_dump_queue_stats(&iface->rxqs[i], fp);
+}
+
+// create a socket dedicated for sending on iface, and map a TPACKET_V2
+// transmit ring on it
+//
+// The socket is bound with protocol 0, so that it never receives any frame.
+int tx_ring_setup(iface_info_t *iface)
+{
+	int fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (fd < 0) {
+		perror("creating SOCK_RAW for transmit ring failed");
+		return -1;
+	}
+
+	int version = TPACKET_V2;
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		perror("setsockopt() PACKET_VERSION failed");
+		goto fail;
+	}
+
+	// skip malformed frames instead of stalling the ring
+	int discard = 1;
+	if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, &discard, sizeof(discard)) < 0) {
+		perror("setsockopt() PACKET_LOSS failed");
+		goto fail;
+	}
+
+	struct tpacket_req req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TX_RING_BLOCK_SIZE;
+	req.tp_frame_size = TX_RING_FRAME_SIZE;
+	req.tp_frame_nr = TX_RING_FRAME_NR;
+	req.tp_block_nr = TX_RING_FRAME_NR / (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE);
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		perror("setsockopt() PACKET_TX_RING failed");
+		goto fail;
+	}
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_ifindex = iface->index;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		perror("binding transmit ring to device failed");
+		goto fail;
+	}
+
+	struct tx_ring *ring = malloc(sizeof(struct tx_ring));
+	memset(ring, 0, sizeof(struct tx_ring));
+	ring->fd = fd;
+	ring->frame_nr = req.tp_frame_nr;
+	ring->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring->map == MAP_FAILED) {
+		perror("mmap() transmit ring failed");
+		free(ring);
+		goto fail;
+	}
+	pthread_mutex_init(&ring->lock, NULL);
+
+	iface->tx_ring = ring;
+
+	log(DEBUG, "transmit ring of %s: %d frames.", iface->name, ring->frame_nr);
+
+	return 0;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+void tx_ring_destroy(iface_info_t *iface)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	if (!ring)
+		return ;
+
+	tx_ring_flush(iface);
+	munmap(ring->map, ring->map_len);
+	close(ring->fd);
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+	iface->tx_ring = NULL;
+}
+
+static inline struct tpacket2_hdr *tx_ring_frame(struct tx_ring *ring, int i)
+{
+	return (struct tpacket2_hdr *)(ring->map + (size_t)i * TX_RING_FRAME_SIZE);
+}
+
+// ask the kernel to send all the frames queued in the ring, wait for them to
+// be sent if block is set
+static void tx_ring_kick(struct tx_ring *ring, int block)
+{
+	if (send(ring->fd, NULL, 0, block ? 0 : MSG_DONTWAIT) < 0 && \
+			errno != EAGAIN && errno != ENOBUFS)
+		perror("Send transmit ring failed");
+
+	ring->kicks += 1;
+	ring->queued = 0;
+}
+
+// copy packet into the next free slot of the transmit ring
+//
+// If defer is set, the frame is sent when tx_ring_flush is called, so that all
+// the frames queued during one pass of the event loop are sent by one syscall.
+void tx_ring_send(iface_info_t *iface, const char *packet, int len, int defer)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	int room = TX_RING_FRAME_SIZE - (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll));
+	if (len > room) {
+		log(ERROR, "packet of %d bytes does not fit in transmit ring, drop it.", len);
+		return ;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+
+	struct tpacket2_hdr *hdr = tx_ring_frame(ring, ring->cur);
+	if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+		// the ring is full, push out what has been queued and wait
+		ring->full += 1;
+		tx_ring_kick(ring, 1);
+		if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+			log(ERROR, "transmit ring of %s is full, drop packet.", iface->name);
+			pthread_mutex_unlock(&ring->lock);
+			return ;
+		}
+	}
+
+	char *data = (char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+	memcpy(data, packet, len);
+	hdr->tp_len = len;
+
+	__sync_synchronize();
+	hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+	ring->cur = (ring->cur + 1) % ring->frame_nr;
+	ring->queued += 1;
+	ring->frames += 1;
+
+	if (!defer)
+		tx_ring_kick(ring, 0);
+
+	pthread_mutex_unlock(&ring->lock);
+}
+
+// send all the frames queued in the transmit ring of iface
+void tx_ring_flush(iface_info_t *iface)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	if (!ring)
+		return ;
+
+	pthread_mutex_lock(&ring->lock);
+	if (ring->queued)
+		tx_ring_kick(ring, 0);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+void tx_ring_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	struct tx_ring *ring = iface->tx_ring;
+	if (!ring)
+		return ;
+
+	fprintf(fp, "%s: tx ring %d frames, %lu frames sent by %lu kicks, "
+			"%.2lf frames/kick on average, found full %lu times\n",
+			iface->name, ring->frame_nr, ring->frames, ring->kicks,
+			ring->kicks ? (double)ring->frames / ring->kicks : 0.0, ring->full);
+}
@@ -0,0 +1,270 @@
+#define _GNU_SOURCE		// recvmmsg, sendmmsg
+
+#include "packet_mmsg.h"
+#include "base.h"
+#include "ether.h"
+#include "netdev.h"
+#include "pktbuf.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+
+// frames received by one recvmmsg, each buffer is handed over to the stack
+// and replaced by a fresh one
+struct mmsg_rx {
+	struct mmsghdr msgs[MMSG_BATCH];
+	struct iovec iov[MMSG_BATCH];
+	struct sockaddr_ll addrs[MMSG_BATCH];
+	char *bufs[MMSG_BATCH];
+
+	u64 calls;				// number of recvmmsg returning frames
+	u64 frames;				// number of frames received
+};
+
+// frames queued for sending, flushed by one sendmmsg
+struct mmsg_tx {
+	struct mmsghdr msgs[MMSG_BATCH];
+	struct iovec iov[MMSG_BATCH];
+	struct sockaddr_ll addrs[MMSG_BATCH];
+	char bufs[MMSG_BATCH][ETH_FRAME_LEN];
+	int queued;				// number of frames in the queue
+	pthread_mutex_t lock;	// senders come from different threads
+
+	u64 calls;				// number of sendmmsg
+	u64 frames;				// number of frames sent
+};
+
+static inline void mmsg_rx_set_buf(struct mmsg_rx *rx, int i, char *buf)
+{
+	rx->bufs[i] = buf;
+	rx->iov[i].iov_base = buf;
+	rx->iov[i].iov_len = ETH_FRAME_LEN;
+}
+
+// allocate the receiving vector of rxq
+static int mmsg_rx_setup(struct rx_queue *rxq)
+{
+	struct mmsg_rx *rx = malloc(sizeof(struct mmsg_rx));
+	if (!rx) {
+		log(ERROR, "malloc failed when setting up batched io.");
+		return -1;
+	}
+	memset(rx, 0, sizeof(struct mmsg_rx));
+	rxq->mmsg_rx = rx;
+
+	for (int i = 0; i < MMSG_BATCH; i++) {
+		char *buf = pktbuf_alloc(ETH_FRAME_LEN);
+		if (!buf) {
+			log(ERROR, "malloc failed when setting up batched io.");
+			return -1;
+		}
+		mmsg_rx_set_buf(rx, i, buf);
+		rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msgs[i].msg_hdr.msg_iovlen = 1;
+		rx->msgs[i].msg_hdr.msg_name = &rx->addrs[i];
+	}
+
+	return 0;
+}
+
+static void mmsg_rx_destroy(struct rx_queue *rxq)
+{
+	struct mmsg_rx *rx = rxq->mmsg_rx;
+	if (!rx)
+		return ;
+
+	for (int i = 0; i < MMSG_BATCH; i++) {
+		if (rx->bufs[i])
+			pktbuf_put(rx->bufs[i]);
+	}
+	free(rx);
+	rxq->mmsg_rx = NULL;
+}
+
+// allocate the receiving vector of each receive queue and the sending queue
+// of iface
+int mmsg_setup(iface_info_t *iface)
+{
+	for (int i = 0; i < iface->nrxqs; i++) {
+		if (mmsg_rx_setup(&iface->rxqs[i]) < 0)
+			return -1;
+	}
+
+	struct mmsg_tx *tx = malloc(sizeof(struct mmsg_tx));
+	if (!tx) {
+		log(ERROR, "malloc failed when setting up batched io.");
+		return -1;
+	}
+	memset(tx, 0, sizeof(struct mmsg_tx));
+
+	for (int i = 0; i < MMSG_BATCH; i++) {
+		tx->iov[i].iov_base = tx->bufs[i];
+		tx->msgs[i].msg_hdr.msg_iov = &tx->iov[i];
+		tx->msgs[i].msg_hdr.msg_iovlen = 1;
+		tx->msgs[i].msg_hdr.msg_name = &tx->addrs[i];
+		tx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+	}
+	pthread_mutex_init(&tx->lock, NULL);
+
+	iface->mmsg_tx = tx;
+
+	return 0;
+}
+
+void mmsg_destroy(iface_info_t *iface)
+{
+	for (int i = 0; i < iface->nrxqs; i++)
+		mmsg_rx_destroy(&iface->rxqs[i]);
+
+	if (iface->mmsg_tx) {
+		mmsg_flush(iface);
+		pthread_mutex_destroy(&iface->mmsg_tx->lock);
+		free(iface->mmsg_tx);
+		iface->mmsg_tx = NULL;
+	}
+}
+
+// receive at most budget frames from the socket of rxq by recvmmsg, and hand
+// them to handle_packet
+int mmsg_receive(struct rx_queue *rxq, int budget)
+{
+	iface_info_t *iface = rxq->iface;
+	struct mmsg_rx *rx = rxq->mmsg_rx;
+	int n = 0;
+
+	while (n < budget) {
+		int batch = budget - n < MMSG_BATCH ? budget - n : MMSG_BATCH;
+		for (int i = 0; i < batch; i++)
+			rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+
+		int cnt = recvmmsg(rxq->fd, rx->msgs, batch, MSG_DONTWAIT, NULL);
+		if (cnt < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log(ERROR, "receive packets error: %s", strerror(errno));
+			break;
+		}
+		else if (cnt == 0)
+			break;
+
+		rx->calls += 1;
+		rx->frames += cnt;
+
+		for (int i = 0; i < cnt; i++) {
+			// XXX: Linux raw socket will capture both incoming and outgoing
+			// packets, we only care about the incoming ones.
+			if (rx->addrs[i].sll_pkttype == PACKET_OUTGOING)
+				continue;
+
+			char *buf = pktbuf_alloc(ETH_FRAME_LEN);
+			if (!buf) {
+				log(ERROR, "malloc failed when receiving packet.");
+				continue;
+			}
+
+			// the stack owns the packet from now on
+			char *packet = rx->bufs[i];
+			mmsg_rx_set_buf(rx, i, buf);
+			handle_packet(iface, packet, rx->msgs[i].msg_len);
+		}
+
+		n += cnt;
+		if (cnt < batch)
+			break;
+	}
+
+	return n;
+}
+
+// must be called with tx->lock held
+static void mmsg_tx_flush_locked(iface_info_t *iface, struct mmsg_tx *tx)
+{
+	int sent = 0;
+	while (sent < tx->queued) {
+		int cnt = sendmmsg(iface->fd, tx->msgs + sent, tx->queued - sent, 0);
+		if (cnt < 0) {
+			perror("Send raw packets failed");
+			break;
+		}
+		tx->calls += 1;
+		tx->frames += cnt;
+		sent += cnt;
+	}
+
+	tx->queued = 0;
+}
+
+// copy packet into the sending queue of iface
+//
+// If defer is set, the packet is sent when mmsg_flush is called, so that all
+// the frames queued during one pass of the event loop are sent by one syscall.
+void mmsg_send(iface_info_t *iface, const char *packet, int len, int defer)
+{
+	struct mmsg_tx *tx = iface->mmsg_tx;
+	if (len > ETH_FRAME_LEN) {
+		log(ERROR, "packet of %d bytes is larger than a frame, drop it.", len);
+		return ;
+	}
+
+	pthread_mutex_lock(&tx->lock);
+
+	if (tx->queued == MMSG_BATCH)
+		mmsg_tx_flush_locked(iface, tx);
+
+	int i = tx->queued;
+	struct sockaddr_ll *addr = &tx->addrs[i];
+	memset(addr, 0, sizeof(struct sockaddr_ll));
+	addr->sll_family = AF_PACKET;
+	addr->sll_ifindex = iface->index;
+	addr->sll_halen = ETH_ALEN;
+	addr->sll_protocol = htons(ETH_P_ARP);
+	struct ether_header *eh = (struct ether_header *)packet;
+	memcpy(addr->sll_addr, eh->ether_dhost, ETH_ALEN);
+
+	memcpy(tx->bufs[i], packet, len);
+	tx->iov[i].iov_len = len;
+	tx->queued += 1;
+
+	if (!defer)
+		mmsg_tx_flush_locked(iface, tx);
+
+	pthread_mutex_unlock(&tx->lock);
+}
+
+// send all the frames queued on iface
+void mmsg_flush(iface_info_t *iface)
+{
+	struct mmsg_tx *tx = iface->mmsg_tx;
+	if (!tx)
+		return ;
+
+	pthread_mutex_lock(&tx->lock);
+	if (tx->queued)
+		mmsg_tx_flush_locked(iface, tx);
+	pthread_mutex_unlock(&tx->lock);
+}
+
+void mmsg_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	struct mmsg_tx *tx = iface->mmsg_tx;
+	if (!tx)
+		return ;
+
+	for (int i = 0; i < iface->nrxqs; i++) {
+		struct mmsg_rx *rx = iface->rxqs[i].mmsg_rx;
+		if (!rx)
+			continue;
+
+		fprintf(fp, "%s queue %d: recvmmsg %lu frames by %lu calls, "
+				"%.2lf frames/call on average\n", iface->name, i, rx->frames,
+				rx->calls, rx->calls ? (double)rx->frames / rx->calls : 0.0);
+	}
+	fprintf(fp, "%s: sendmmsg %lu frames by %lu calls, %.2lf frames/call on average\n",
+			iface->name, tx->frames, tx->calls,
+			tx->calls ? (double)tx->frames / tx->calls : 0.0);
+}
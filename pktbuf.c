@@ -0,0 +1,297 @@
+#include "pktbuf.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#define PKTBUF_MAGIC		0x70627566		// "pbuf"
+#define PKTBUF_DATA_OFF		32				// headroom starts here
+#define PKTBUF_FRAME_OFF	(PKTBUF_DATA_OFF + PKTBUF_HEADROOM)
+
+static const char *pktbuf_class_str[PKTBUF_CLASS_NR] = { "ctrl", "mtu", "large" };
+static const int pktbuf_class_size[PKTBUF_CLASS_NR] = {
+	PKTBUF_CTRL_SIZE, PKTBUF_MTU_SIZE, 0,
+};
+
+// the global pool of one size class
+struct pktbuf_pool {
+	pthread_mutex_t lock;
+	struct pktbuf *free;	// buffers in the pool
+	int nfree;				// number of buffers in the pool
+	int total;				// number of buffers carved from slabs
+
+	u64 allocs;				// number of allocations
+	u64 frees;				// number of buffers freed
+	u64 slabs;				// times the pool grows
+};
+
+// buffers of one size class cached by a thread
+struct pktbuf_cache {
+	struct pktbuf *free;
+	int nfree;
+};
+
+static struct pktbuf_pool pools[PKTBUF_CLASS_NR] = {
+	[0 ... PKTBUF_CLASS_NR - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
+
+static __thread struct pktbuf_cache caches[PKTBUF_CLASS_NR];
+static __thread int cache_registered = 0;
+
+// used to give the cache back when the thread exits
+static pthread_key_t cache_key;
+
+// statistics at the last dump, used to compute the allocation rate
+static u64 last_allocs[PKTBUF_CLASS_NR];
+static struct timespec last_dump;
+
+static inline struct pktbuf *packet_to_pktbuf(char *packet)
+{
+	struct pktbuf *pb = (struct pktbuf *)((unsigned long)packet & ~(PKTBUF_ALIGN - 1UL));
+	assert(pb->magic == PKTBUF_MAGIC);
+	return pb;
+}
+
+static inline char *pktbuf_frame(struct pktbuf *pb)
+{
+	return (char *)pb + PKTBUF_FRAME_OFF;
+}
+
+// give a list of n buffers back to the pool
+static void pktbuf_pool_put(int cls, struct pktbuf *head, struct pktbuf *tail, int n)
+{
+	struct pktbuf_pool *pool = &pools[cls];
+
+	pthread_mutex_lock(&pool->lock);
+	tail->next = pool->free;
+	pool->free = head;
+	pool->nfree += n;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// the buffers cached by an exiting thread go back to the pools
+static void pktbuf_cache_destroy(void *arg)
+{
+	struct pktbuf_cache *cache = arg;
+	for (int cls = 0; cls < PKTBUF_LARGE; cls++) {
+		if (!cache[cls].nfree)
+			continue;
+
+		struct pktbuf *tail = cache[cls].free;
+		while (tail->next)
+			tail = tail->next;
+		pktbuf_pool_put(cls, cache[cls].free, tail, cache[cls].nfree);
+		cache[cls].free = NULL;
+		cache[cls].nfree = 0;
+	}
+}
+
+static struct pktbuf_cache *pktbuf_cache(int cls)
+{
+	if (!cache_registered) {
+		pthread_setspecific(cache_key, caches);
+		cache_registered = 1;
+	}
+
+	return &caches[cls];
+}
+
+// carve a slab of buffers, must be called with pool->lock held
+static int pktbuf_pool_grow(int cls)
+{
+	struct pktbuf_pool *pool = &pools[cls];
+	int size = pktbuf_class_size[cls];
+
+	char *slab = aligned_alloc(PKTBUF_ALIGN, (size_t)size * PKTBUF_SLAB_NR);
+	if (!slab)
+		return -1;
+
+	for (int i = 0; i < PKTBUF_SLAB_NR; i++) {
+		struct pktbuf *pb = (struct pktbuf *)(slab + (size_t)i * size);
+		pb->magic = PKTBUF_MAGIC;
+		pb->cls = cls;
+		pb->size = size;
+		pb->next = pool->free;
+		pool->free = pb;
+	}
+
+	pool->nfree += PKTBUF_SLAB_NR;
+	pool->total += PKTBUF_SLAB_NR;
+	pool->slabs += 1;
+
+	return 0;
+}
+
+// move a batch of buffers from the pool into the cache
+static void pktbuf_cache_refill(int cls, struct pktbuf_cache *cache)
+{
+	struct pktbuf_pool *pool = &pools[cls];
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->nfree < PKTBUF_BATCH_NR && pktbuf_pool_grow(cls) < 0)
+		log(ERROR, "could not grow the pool of %s packet buffers.",
+				pktbuf_class_str[cls]);
+
+	for (int i = 0; i < PKTBUF_BATCH_NR && pool->free; i++) {
+		struct pktbuf *pb = pool->free;
+		pool->free = pb->next;
+		pool->nfree -= 1;
+
+		pb->next = cache->free;
+		cache->free = pb;
+		cache->nfree += 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// move a batch of buffers from the cache back to the pool
+static void pktbuf_cache_drain(int cls, struct pktbuf_cache *cache)
+{
+	struct pktbuf *head = cache->free, *tail = head;
+	for (int i = 1; i < PKTBUF_BATCH_NR; i++)
+		tail = tail->next;
+
+	cache->free = tail->next;
+	cache->nfree -= PKTBUF_BATCH_NR;
+	pktbuf_pool_put(cls, head, tail, PKTBUF_BATCH_NR);
+}
+
+static struct pktbuf *pktbuf_alloc_large(int len)
+{
+	int size = (PKTBUF_FRAME_OFF + len + PKTBUF_ALIGN - 1) & ~(PKTBUF_ALIGN - 1);
+	struct pktbuf *pb = aligned_alloc(PKTBUF_ALIGN, size);
+	if (!pb)
+		return NULL;
+
+	pb->magic = PKTBUF_MAGIC;
+	pb->cls = PKTBUF_LARGE;
+	pb->size = size;
+
+	return pb;
+}
+
+void pktbuf_init()
+{
+	pthread_key_create(&cache_key, pktbuf_cache_destroy);
+	clock_gettime(CLOCK_MONOTONIC, &last_dump);
+}
+
+char *pktbuf_alloc(int len)
+{
+	int cls = PKTBUF_LARGE;
+	if (len <= PKTBUF_CTRL_SIZE - PKTBUF_FRAME_OFF)
+		cls = PKTBUF_CTRL;
+	else if (len <= PKTBUF_MTU_SIZE - PKTBUF_FRAME_OFF)
+		cls = PKTBUF_MTU;
+
+	struct pktbuf *pb = NULL;
+	if (cls == PKTBUF_LARGE) {
+		pb = pktbuf_alloc_large(len);
+	}
+	else {
+		struct pktbuf_cache *cache = pktbuf_cache(cls);
+		if (!cache->free)
+			pktbuf_cache_refill(cls, cache);
+
+		pb = cache->free;
+		if (pb) {
+			cache->free = pb->next;
+			cache->nfree -= 1;
+		}
+	}
+
+	if (!pb) {
+		log(ERROR, "could not allocate packet buffer of %d bytes.", len);
+		return NULL;
+	}
+
+	pb->refcnt = 1;
+	pb->next = NULL;
+	__sync_fetch_and_add(&pools[cls].allocs, 1);
+
+	return pktbuf_frame(pb);
+}
+
+char *pktbuf_get(char *packet)
+{
+	struct pktbuf *pb = packet_to_pktbuf(packet);
+	__sync_fetch_and_add(&pb->refcnt, 1);
+	return packet;
+}
+
+void pktbuf_put(char *packet)
+{
+	struct pktbuf *pb = packet_to_pktbuf(packet);
+	if (__sync_sub_and_fetch(&pb->refcnt, 1) > 0)
+		return ;
+
+	int cls = pb->cls;
+	__sync_fetch_and_add(&pools[cls].frees, 1);
+
+	if (cls == PKTBUF_LARGE) {
+		pb->magic = 0;
+		free(pb);
+		return ;
+	}
+
+	struct pktbuf_cache *cache = pktbuf_cache(cls);
+	pb->next = cache->free;
+	cache->free = pb;
+	cache->nfree += 1;
+	if (cache->nfree > PKTBUF_CACHE_NR)
+		pktbuf_cache_drain(cls, cache);
+}
+
+int pktbuf_headroom(char *packet)
+{
+	struct pktbuf *pb = packet_to_pktbuf(packet);
+	return packet - ((char *)pb + PKTBUF_DATA_OFF);
+}
+
+char *pktbuf_push(char *packet, int len)
+{
+	if (pktbuf_headroom(packet) < len) {
+		log(ERROR, "no headroom for %d bytes in packet buffer.", len);
+		return NULL;
+	}
+
+	return packet - len;
+}
+
+// dump the occupancy of the pools, and the allocation rate since the last dump
+void pktbuf_dump_stats(FILE *fp)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - last_dump.tv_sec) + \
+					 (now.tv_nsec - last_dump.tv_nsec) / 1e9;
+	last_dump = now;
+
+	for (int cls = 0; cls < PKTBUF_CLASS_NR; cls++) {
+		struct pktbuf_pool *pool = &pools[cls];
+
+		pthread_mutex_lock(&pool->lock);
+		u64 allocs = pool->allocs, frees = pool->frees;
+		int total = pool->total, nfree = pool->nfree;
+		pthread_mutex_unlock(&pool->lock);
+
+		u64 in_use = allocs - frees;
+		double rate = elapsed > 0 ? (allocs - last_allocs[cls]) / elapsed : 0.0;
+		last_allocs[cls] = allocs;
+
+		if (cls == PKTBUF_LARGE) {
+			fprintf(fp, "pktbuf %s: %lu in use, %lu allocations, %.0lf/s\n",
+					pktbuf_class_str[cls], in_use, allocs, rate);
+			continue;
+		}
+
+		fprintf(fp, "pktbuf %s: %d buffers in %lu slabs, %d in pool, %lu cached "
+				"by threads, %lu in use, %lu allocations, %.0lf/s\n",
+				pktbuf_class_str[cls], total, pool->slabs, nfree,
+				total - nfree - in_use, in_use, allocs, rate);
+	}
+}
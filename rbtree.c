@@ -0,0 +1,258 @@
+#include "rbtree.h"
+
+// the pointer to old of parent (or the root) is changed to new
+static inline void rb_change_child(struct rb_node *old, struct rb_node *new,
+				   struct rb_node *parent, struct rb_root *root)
+{
+	if (!parent)
+		root->rb_node = new;
+	else if (parent->left == old)
+		parent->left = new;
+	else
+		parent->right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *right = node->right;
+
+	node->right = right->left;
+	if (right->left)
+		right->left->parent = node;
+	right->parent = node->parent;
+	rb_change_child(node, right, node->parent, root);
+	right->left = node;
+	node->parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *left = node->left;
+
+	node->left = left->right;
+	if (left->right)
+		left->right->parent = node;
+	left->parent = node->parent;
+	rb_change_child(node, left, node->parent, root);
+	left->right = node;
+	node->parent = left;
+}
+
+static inline int rb_is_black(struct rb_node *node)
+{
+	// the leaves (NULL) are black
+	return !node || node->color == RB_BLACK;
+}
+
+void rb_insert_color(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *parent, *gparent, *uncle;
+
+	// a red node must not have a red parent
+	while ((parent = node->parent) && parent->color == RB_RED) {
+		// the parent is red, thus not the root
+		gparent = parent->parent;
+		if (parent == gparent->left) {
+			uncle = gparent->right;
+			if (!rb_is_black(uncle)) {
+				parent->color = uncle->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->right) {
+				rb_rotate_left(parent, root);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rb_rotate_right(gparent, root);
+		}
+		else {
+			uncle = gparent->left;
+			if (!rb_is_black(uncle)) {
+				parent->color = uncle->color = RB_BLACK;
+				gparent->color = RB_RED;
+				node = gparent;
+				continue;
+			}
+			if (node == parent->left) {
+				rb_rotate_right(parent, root);
+				node = parent;
+				parent = node->parent;
+			}
+			parent->color = RB_BLACK;
+			gparent->color = RB_RED;
+			rb_rotate_left(gparent, root);
+		}
+	}
+
+	root->rb_node->color = RB_BLACK;
+}
+
+// a black node is removed from above node (which may be NULL), whose parent
+// is given, restore the black height of the paths through it
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+			   struct rb_root *root)
+{
+	struct rb_node *sibling;
+
+	while (node != root->rb_node && rb_is_black(node)) {
+		// the paths through node lack a black node, thus the sibling is
+		// not NULL
+		if (node == parent->left) {
+			sibling = parent->right;
+			if (sibling->color == RB_RED) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rb_rotate_left(parent, root);
+				sibling = parent->right;
+			}
+			if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+				sibling->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (rb_is_black(sibling->right)) {
+				sibling->left->color = RB_BLACK;
+				sibling->color = RB_RED;
+				rb_rotate_right(sibling, root);
+				sibling = parent->right;
+			}
+			sibling->color = parent->color;
+			parent->color = RB_BLACK;
+			sibling->right->color = RB_BLACK;
+			rb_rotate_left(parent, root);
+		}
+		else {
+			sibling = parent->left;
+			if (sibling->color == RB_RED) {
+				sibling->color = RB_BLACK;
+				parent->color = RB_RED;
+				rb_rotate_right(parent, root);
+				sibling = parent->left;
+			}
+			if (rb_is_black(sibling->left) && rb_is_black(sibling->right)) {
+				sibling->color = RB_RED;
+				node = parent;
+				parent = node->parent;
+				continue;
+			}
+			if (rb_is_black(sibling->left)) {
+				sibling->right->color = RB_BLACK;
+				sibling->color = RB_RED;
+				rb_rotate_left(sibling, root);
+				sibling = parent->left;
+			}
+			sibling->color = parent->color;
+			parent->color = RB_BLACK;
+			sibling->left->color = RB_BLACK;
+			rb_rotate_right(parent, root);
+		}
+		node = root->rb_node;
+		break;
+	}
+
+	if (node)
+		node->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root)
+{
+	struct rb_node *child, *parent;
+	int color;
+
+	if (!node->left || !node->right) {
+		// the child (if any) takes the place of node
+		child = node->left ? node->left : node->right;
+		parent = node->parent;
+		color = node->color;
+		if (child)
+			child->parent = parent;
+		rb_change_child(node, child, parent, root);
+	}
+	else {
+		// the successor, which has no left child, takes the place of node,
+		// and its right child takes the place of the successor
+		struct rb_node *succ = node->right;
+		while (succ->left)
+			succ = succ->left;
+
+		child = succ->right;
+		color = succ->color;
+		if (succ->parent == node) {
+			parent = succ;
+		}
+		else {
+			parent = succ->parent;
+			if (child)
+				child->parent = parent;
+			parent->left = child;
+			succ->right = node->right;
+			node->right->parent = succ;
+		}
+
+		succ->left = node->left;
+		node->left->parent = succ;
+		succ->parent = node->parent;
+		succ->color = node->color;
+		rb_change_child(node, succ, node->parent, root);
+	}
+
+	if (color == RB_BLACK)
+		rb_erase_color(child, parent, root);
+}
+
+struct rb_node *rb_first(const struct rb_root *root)
+{
+	struct rb_node *node = root->rb_node;
+	if (node)
+		while (node->left)
+			node = node->left;
+
+	return node;
+}
+
+struct rb_node *rb_last(const struct rb_root *root)
+{
+	struct rb_node *node = root->rb_node;
+	if (node)
+		while (node->right)
+			node = node->right;
+
+	return node;
+}
+
+struct rb_node *rb_next(const struct rb_node *node)
+{
+	if (node->right) {
+		node = node->right;
+		while (node->left)
+			node = node->left;
+		return (struct rb_node *)node;
+	}
+
+	// go up until coming from the left
+	while (node->parent && node == node->parent->right)
+		node = node->parent;
+
+	return node->parent;
+}
+
+struct rb_node *rb_prev(const struct rb_node *node)
+{
+	if (node->left) {
+		node = node->left;
+		while (node->right)
+			node = node->right;
+		return (struct rb_node *)node;
+	}
+
+	// go up until coming from the right
+	while (node->parent && node == node->parent->left)
+		node = node->parent;
+
+	return node->parent;
+}
@@ -5,6 +5,9 @@
 #include "log.h"
 
 #include <arpa/inet.h>
+#include <pthread.h>
+
+pthread_mutex_t tcp_lock = PTHREAD_MUTEX_INITIALIZER;
 
 const char *tcp_state_str[] = { "CLOSED", "LISTEN", "SYN_RECV",
 	"SYN_SENT", "ESTABLISHED", "CLOSE_WAIT", "LAST_ACK", "FIN_WAIT-1",
@@ -45,6 +48,53 @@ void tcp_copy_flags_to_str(u8 flags, char buf[32])
 		buf[len-1] = '\0';
 }
 
+// read a 32-bit field of an option, which is not aligned
+static inline u32 tcp_opt_u32(u8 *p)
+{
+	return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+// parse the options of the tcp header into cb, malformed options are ignored
+static void tcp_parse_options(struct tcphdr *tcp, struct tcp_cb *cb)
+{
+	u8 *opt = (u8 *)tcp + TCP_BASE_HDR_SIZE;
+	u8 *end = (u8 *)tcp + TCP_HDR_SIZE(tcp);
+
+	while (opt < end) {
+		if (*opt == TCP_OPT_END)
+			break;
+		if (*opt == TCP_OPT_NOP) {
+			opt += 1;
+			continue;
+		}
+
+		if (opt + 2 > end || opt[1] < 2 || opt + opt[1] > end)
+			break;
+
+		if (*opt == TCP_OPT_MSS && opt[1] == TCP_OPT_MSS_LEN)
+			cb->mss = (opt[2] << 8) | opt[3];
+		else if (*opt == TCP_OPT_WSCALE && opt[1] == TCP_OPT_WSCALE_LEN)
+			cb->wscale = min(opt[2], TCP_MAX_WSCALE);
+		else if (*opt == TCP_OPT_SACK_PERM && opt[1] == TCP_OPT_SACK_PERM_LEN)
+			cb->sack_perm = 1;
+		else if (*opt == TCP_OPT_TS && opt[1] == TCP_OPT_TS_LEN) {
+			cb->ts = 1;
+			cb->tsval = tcp_opt_u32(opt + 2);
+			cb->tsecr = tcp_opt_u32(opt + 6);
+		}
+		else if (*opt == TCP_OPT_SACK && (opt[1] - 2) % 8 == 0) {
+			for (u8 *blk = opt + 2; blk < opt + opt[1] && cb->nr_sacks < TCP_MAX_SACKS;
+					blk += 8) {
+				cb->sacks[cb->nr_sacks].start = tcp_opt_u32(blk);
+				cb->sacks[cb->nr_sacks].end = tcp_opt_u32(blk + 4);
+				cb->nr_sacks += 1;
+			}
+		}
+
+		opt += opt[1];
+	}
+}
+
 // let tcp control block (cb) to store all the necessary information of a TCP
 // packet
 void tcp_cb_init(struct iphdr *ip, struct tcphdr *tcp, struct tcp_cb *cb)
@@ -61,6 +111,13 @@ void tcp_cb_init(struct iphdr *ip, struct tcphdr *tcp, struct tcp_cb *cb)
 	cb->pl_len = len;
 	cb->rwnd = ntohs(tcp->rwnd);
 	cb->flags = tcp->flags;
+	cb->mss = 0;
+	cb->wscale = -1;
+	cb->sack_perm = 0;
+	cb->nr_sacks = 0;
+	cb->ts = 0;
+	if (TCP_HDR_SIZE(tcp) > TCP_BASE_HDR_SIZE)
+		tcp_parse_options(tcp, cb);
 }
 
 // handle TCP packet: find the appropriate tcp sock, and let the tcp sock 
@@ -75,7 +132,13 @@ void handle_tcp_packet(char *packet, struct iphdr *ip, struct tcphdr *tcp)
 	struct tcp_cb cb;
 	tcp_cb_init(ip, tcp, &cb);
 
+	// the socket tables and the state machine expect the segments to come
+	// from a single thread, thus the receiving threads take turns
+	pthread_mutex_lock(&tcp_lock);
+
 	struct tcp_sock *tsk = tcp_sock_lookup(&cb);
 
 	tcp_process(tsk, &cb, packet);
+
+	pthread_mutex_unlock(&tcp_lock);
 }
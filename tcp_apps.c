@@ -1,10 +1,14 @@
+#include "tcp_apps.h"
 #include "tcp_sock.h"
 
 #include "log.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 // tcp server application, listens to port (specified by arg) and serves only one
 // connection request
@@ -156,12 +160,11 @@ void *tcp_client_file_ver(void *arg)
 		{
 			break;
 		}
-		usleep(30000);
 	}
 	fclose(fp);
 	log(DEBUG, "Client sending file ends.");
 	log(DEBUG, "Close connection.");
-	sleep(1);
+	// the data still in the send buffer goes before FIN
 	tcp_sock_close(tsk);
 	return NULL;
 }
@@ -219,4 +222,220 @@ void *tcp_server_file_ver(void *arg)
 	sleep(5);
 	tcp_sock_close(csk);
 	return NULL;
-}
\ No newline at end of file
+}
+
+static inline double tcp_apps_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// listen to the port of arg, and start client (with arg) once listening
+static struct tcp_sock *tcp_apps_listen(struct tcp_bench_arg *arg, void *(*client)(void *))
+{
+	struct tcp_sock *tsk = alloc_tcp_sock();
+
+	struct sock_addr addr;
+	addr.ip = htonl(0);
+	addr.port = arg->skaddr.port;
+	if (tcp_sock_bind(tsk, &addr) < 0)
+	{
+		log(ERROR, "tcp_sock bind to port %hu failed", ntohs(addr.port));
+		exit(1);
+	}
+
+	if (tcp_sock_listen(tsk, 3) < 0)
+	{
+		log(ERROR, "tcp_sock listen failed");
+		exit(1);
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, client, arg);
+
+	return tsk;
+}
+
+static struct tcp_sock *tcp_apps_connect(struct tcp_bench_arg *arg)
+{
+	struct tcp_sock *tsk = alloc_tcp_sock();
+
+	if (arg->cong && tcp_sock_set_congestion(tsk, arg->cong) < 0)
+		exit(1);
+
+	if (tcp_sock_connect(tsk, &arg->skaddr) < 0)
+	{
+		log(ERROR, "tcp_sock connect to server (" IP_FMT ":%hu)failed.",
+			NET_IP_FMT_STR(arg->skaddr.ip), ntohs(arg->skaddr.port));
+		exit(1);
+	}
+
+	return tsk;
+}
+
+static void *tcp_bench_client(void *param)
+{
+	struct tcp_bench_arg *arg = param;
+	struct tcp_sock *tsk = tcp_apps_connect(arg);
+	arg->tsk = tsk;
+
+	// the stack cuts the writes into segments
+	char buf[TCP_BENCH_BUF_SIZE];
+	for (int i = 0; i < sizeof(buf); i++)
+		buf[i] = i;
+
+	u64 sent = 0;
+	while (sent < arg->bytes)
+	{
+		int len = min(arg->bytes - sent, (u64)sizeof(buf));
+		int wlen = tcp_sock_write(tsk, buf, len);
+		if (wlen < 0)
+		{
+			log(DEBUG, "tcp_sock_write return negative value, something goes wrong.");
+			exit(1);
+		}
+		sent += wlen;
+	}
+
+	tcp_sock_close(tsk);
+
+	return NULL;
+}
+
+// a run of bench with the congestion control of arg, return the bytes received
+static u64 tcp_bench_run(struct tcp_bench_arg *arg)
+{
+	struct tcp_sock *tsk = tcp_apps_listen(arg, tcp_bench_client);
+	struct tcp_sock *csk = tcp_sock_accept(tsk);
+
+	double start = tcp_apps_now();
+	char buf[TCP_BENCH_BUF_SIZE];
+	u64 received = 0;
+	while (1)
+	{
+		int rlen = tcp_sock_read(csk, buf, sizeof(buf));
+		if (rlen == 0)
+			break;
+		else if (rlen < 0)
+		{
+			log(DEBUG, "tcp_sock_read return negative value, something goes wrong.");
+			exit(1);
+		}
+		received += rlen;
+	}
+	double elapsed = tcp_apps_now() - start;
+
+	tcp_sock_close(csk);
+
+	fprintf(stdout, "bench: received %lu bytes in %.3lf s, %.2lf Mbit/s",
+			received, elapsed, elapsed > 0 ? received * 8 / elapsed / 1e6 : 0.0);
+	// the client has sent all the data, and FIN, once the server reads the
+	// end of it, thus its retransmissions include those of the tail
+	if (arg->cong)
+		fprintf(stdout, ", %s with %u retransmissions", arg->cong,
+				tcp_sock_retrans(arg->tsk));
+	fprintf(stdout, "\n");
+	fflush(stdout);
+
+	return received;
+}
+
+// bulk transfer benchmark, a client sends bytes to the server (both specified
+// by arg) in the same process, the server reports the throughput and exits
+//
+// With congs, the transfer runs once with each congestion control in turn,
+// each on the next port, which compares them on the same path.
+void *tcp_bench(void *param)
+{
+	struct tcp_bench_arg *arg = param;
+	if (!arg->congs)
+		exit(tcp_bench_run(arg) == arg->bytes ? 0 : 1);
+
+	char congs[256];
+	snprintf(congs, sizeof(congs), "%s", arg->congs);
+	int ok = 1;
+	char *saveptr;
+	for (char *name = strtok_r(congs, ",", &saveptr); name;
+		 name = strtok_r(NULL, ",", &saveptr))
+	{
+		arg->cong = name;
+		ok = tcp_bench_run(arg) == arg->bytes && ok;
+		arg->skaddr.port = htons(ntohs(arg->skaddr.port) + 1);
+	}
+
+	exit(ok ? 0 : 1);
+}
+
+static void *tcp_pingpong_client(void *param)
+{
+	struct tcp_bench_arg *arg = param;
+	struct tcp_sock *tsk = tcp_apps_connect(arg);
+	// each message is sent at once, instead of waiting for the ack of the
+	// previous one
+	tcp_sock_setopt(tsk, TCP_NODELAY, 1);
+
+	char buf[TCP_PINGPONG_MSG_SIZE];
+	memset(buf, 'p', sizeof(buf));
+
+	double total = 0, lo = 0, hi = 0;
+	for (int i = 0; i < arg->count; i++)
+	{
+		double start = tcp_apps_now();
+		if (tcp_sock_write(tsk, buf, sizeof(buf)) < 0)
+		{
+			log(DEBUG, "tcp_sock_write return negative value, something goes wrong.");
+			exit(1);
+		}
+
+		int got = 0;
+		while (got < sizeof(buf))
+		{
+			int rlen = tcp_sock_read(tsk, buf + got, sizeof(buf) - got);
+			if (rlen <= 0)
+			{
+				log(DEBUG, "connection closed during pingpong.");
+				exit(1);
+			}
+			got += rlen;
+		}
+
+		double rtt = (tcp_apps_now() - start) * 1e6;
+		total += rtt;
+		if (i == 0 || rtt < lo)
+			lo = rtt;
+		if (rtt > hi)
+			hi = rtt;
+	}
+
+	fprintf(stdout, "pingpong: %d round trips of %d bytes, "
+			"avg %.1lf us, min %.1lf us, max %.1lf us\n", arg->count,
+			TCP_PINGPONG_MSG_SIZE, arg->count ? total / arg->count : 0.0, lo, hi);
+	fflush(stdout);
+
+	exit(0);
+}
+
+// latency benchmark, a client in the same process sends count messages to the
+// server (both specified by arg) one by one, and waits for each to be echoed
+void *tcp_pingpong(void *param)
+{
+	struct tcp_bench_arg *arg = param;
+	struct tcp_sock *tsk = tcp_apps_listen(arg, tcp_pingpong_client);
+	struct tcp_sock *csk = tcp_sock_accept(tsk);
+	tcp_sock_setopt(csk, TCP_NODELAY, 1);
+
+	char buf[TCP_PINGPONG_MSG_SIZE];
+	while (1)
+	{
+		int rlen = tcp_sock_read(csk, buf, sizeof(buf));
+		if (rlen <= 0)
+			break;
+		if (tcp_sock_write(csk, buf, rlen) < 0)
+			break;
+	}
+
+	tcp_sock_close(csk);
+
+	return NULL;
+}
@@ -0,0 +1,493 @@
+#include "tcp_cong.h"
+#include "tcp_sock.h"
+#include "tcp_timer.h"
+
+#include <stdlib.h>
+
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+// BBR (draft-cardwell-iccrg-bbr-congestion-control), the window and the pacing
+// rate follow a model of the path, i.e. the bottleneck bandwidth (the max
+// delivery rate in the last rounds) and the round trip propagation time (the
+// min rtt in the last seconds), instead of the losses, thus the queue of the
+// path is kept short, and random losses do not cut the rate.
+//
+// The model is probed in turns: STARTUP doubles the rate each round trip until
+// the bandwidth stops growing, DRAIN takes the queue built by it away, then
+// PROBE_BW cycles the rate around the bandwidth, and PROBE_RTT cuts the flight
+// down for a while once the min rtt is not seen for long.
+
+enum bbr_mode {
+	BBR_STARTUP,
+	BBR_DRAIN,
+	BBR_PROBE_BW,
+	BBR_PROBE_RTT,
+};
+
+// the bandwidth is in bytes per micro second, scaled by BBR_BW_UNIT
+#define BBR_BW_SCALE 24
+#define BBR_BW_UNIT (1ULL << BBR_BW_SCALE)
+// the gains are scaled by BBR_UNIT
+#define BBR_UNIT 256
+
+// 2/ln(2), the least gain to double the delivery rate each round trip
+#define BBR_HIGH_GAIN (BBR_UNIT * 2885 / 1000 + 1)
+// the inverse of it, to drain the queue in a round trip
+#define BBR_DRAIN_GAIN (BBR_UNIT * 1000 / 2885)
+// the window of PROBE_BW, the acks delayed or stretched are still covered
+#define BBR_CWND_GAIN (BBR_UNIT * 2)
+// the pacing gains of PROBE_BW, each phase lasts a min rtt
+#define BBR_CYCLE_LEN 8
+static const int bbr_pacing_gain[BBR_CYCLE_LEN] = {
+	BBR_UNIT * 5 / 4,	// probe for more bandwidth
+	BBR_UNIT * 3 / 4,	// drain the queue built by probing
+	BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT, BBR_UNIT,
+};
+// the pacing rate is a bit lower than the bandwidth, to keep the queue short
+#define BBR_PACING_MARGIN 99
+
+// the bandwidth is the max of the samples in this many round trips
+#define BBR_BW_RTTS (BBR_CYCLE_LEN + 2)
+// the min rtt is refreshed by PROBE_RTT if not seen for this long
+#define BBR_MIN_RTT_WIN (10 * 1000000ULL)
+// PROBE_RTT lasts this long (and a round trip) at the min window
+#define BBR_PROBE_RTT_TIME (200 * 1000ULL)
+// the min window, in segments
+#define BBR_MIN_CWND 4
+// the bandwidth is deemed full once it grows less than 1.25 times in
+// BBR_FULL_BW_CNT round trips in a row
+#define BBR_FULL_BW_THRESH (BBR_UNIT * 5 / 4)
+#define BBR_FULL_BW_CNT 3
+
+// windowed max of the last three samples, each the max of a third of the window
+// (the minmax of Kathleen Nichols)
+struct bbr_minmax_sample
+{
+	u32 t;
+	u64 v;
+};
+
+struct bbr
+{
+	u32 mode;
+	u32 prev_state;			// cong_state of tcp sock at the last ack
+
+	u32 min_rtt;			// the min rtt in the window (in micro second)
+	u64 min_rtt_stamp;		// when min_rtt is sampled
+	u64 probe_rtt_done_stamp;	// when PROBE_RTT may end, 0 if not yet
+	int probe_rtt_round_done;
+
+	// a round trip ends once the data sent at its start is delivered
+	u64 next_rtt_delivered;
+	u32 rtt_cnt;
+	int round_start;
+
+	struct bbr_minmax_sample bw[3];	// the max bandwidth in BBR_BW_RTTS rounds
+
+	int pacing_gain;
+	int cwnd_gain;
+
+	int full_bw_reached;
+	u64 full_bw;			// the bandwidth to grow from in STARTUP
+	int full_bw_cnt;		// the rounds without growth
+
+	int cycle_idx;			// the phase of PROBE_BW
+	u64 cycle_stamp;		// when the phase starts
+
+	u32 prior_cwnd;			// the window before recovery or PROBE_RTT
+	int packet_conservation;	// the first round trip of recovery
+	int idle_restart;		// sending restarts after idle
+};
+
+static u64 bbr_minmax_reset(struct bbr_minmax_sample *s, u32 t, u64 v)
+{
+	s[0].t = s[1].t = s[2].t = t;
+	s[0].v = s[1].v = s[2].v = v;
+	return v;
+}
+
+// the sample is taken in the window of win from t, the best one, the second
+// best in the later two thirds, and the third best in the last third are kept
+static u64 bbr_minmax_running_max(struct bbr_minmax_sample *s, u32 win, u32 t, u64 v)
+{
+	struct bbr_minmax_sample val = {.t = t, .v = v};
+	if (v >= s[0].v || t - s[2].t > win)
+		return bbr_minmax_reset(s, t, v);
+
+	if (v >= s[1].v)
+		s[2] = s[1] = val;
+	else if (v >= s[2].v)
+		s[2] = val;
+
+	u32 dt = t - s[0].t;
+	if (dt > win)
+	{
+		// the best one passes out of the window
+		s[0] = s[1];
+		s[1] = s[2];
+		s[2] = val;
+		if (t - s[0].t > win)
+		{
+			s[0] = s[1];
+			s[1] = s[2];
+			s[2] = val;
+		}
+	}
+	else if (s[1].t == s[0].t && dt > win / 4)
+		s[2] = s[1] = val;
+	else if (s[2].t == s[1].t && dt > win / 2)
+		s[2] = val;
+
+	return s[0].v;
+}
+
+static inline u64 bbr_bw(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	return bbr->bw[0].v;
+}
+
+// bytes of the bandwidth-delay product scaled by gain, plus the segments
+// queued by the sender and delayed acks, the initial window before any rtt
+static u32 bbr_inflight(struct tcp_sock *tsk, u64 bw, int gain)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->min_rtt == ~0U)
+		return TCP_INIT_CWND * tsk->mss;
+
+	u64 bdp = (bw * bbr->min_rtt) >> BBR_BW_SCALE;
+	return (u32)min((bdp * gain) / BBR_UNIT + 3 * tsk->mss, (u64)0x7fffffff);
+}
+
+// bytes per second of the bandwidth scaled by gain, less the margin
+static inline u64 bbr_rate_bytes_per_sec(u64 bw, int gain)
+{
+	return ((bw * gain / BBR_UNIT) * 1000000 >> BBR_BW_SCALE) * BBR_PACING_MARGIN / 100;
+}
+
+// the rate only goes down once the bandwidth is full, the rate of STARTUP
+// keeps the initial one until the samples catch up
+static void bbr_set_pacing_rate(struct tcp_sock *tsk, u64 bw, int gain)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	u64 rate = bbr_rate_bytes_per_sec(bw, gain);
+	if (rate && (bbr->full_bw_reached || rate > tsk->pacing_rate))
+		tsk->pacing_rate = rate;
+}
+
+// the initial rate sends the initial window in the smoothed rtt (or a milli
+// second if none) at the gain of STARTUP
+static void bbr_init_pacing_rate(struct tcp_sock *tsk)
+{
+	u32 rtt = tsk->srtt ? tsk->srtt : 1000;
+	u64 bw = (u64)tsk->cwnd * BBR_BW_UNIT / rtt;
+	tsk->pacing_rate = bbr_rate_bytes_per_sec(bw, BBR_HIGH_GAIN);
+}
+
+static void bbr_reset_startup_mode(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr->mode = BBR_STARTUP;
+	bbr->pacing_gain = BBR_HIGH_GAIN;
+	bbr->cwnd_gain = BBR_HIGH_GAIN;
+}
+
+static void bbr_advance_cycle_phase(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr->cycle_idx = (bbr->cycle_idx + 1) % BBR_CYCLE_LEN;
+	bbr->cycle_stamp = tcp_time_us();
+	bbr->pacing_gain = bbr_pacing_gain[bbr->cycle_idx];
+}
+
+// PROBE_BW starts at a random phase but the draining one, thus the flows do not
+// probe in step
+static void bbr_reset_probe_bw_mode(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr->mode = BBR_PROBE_BW;
+	bbr->cwnd_gain = BBR_CWND_GAIN;
+	bbr->cycle_idx = BBR_CYCLE_LEN - 1 - rand() % (BBR_CYCLE_LEN - 1);
+	bbr_advance_cycle_phase(tsk);
+}
+
+static void bbr_reset_mode(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->full_bw_reached)
+		bbr_reset_probe_bw_mode(tsk);
+	else
+		bbr_reset_startup_mode(tsk);
+}
+
+// the window to restore after recovery or PROBE_RTT
+static void bbr_save_cwnd(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->prev_state == open && bbr->mode != BBR_PROBE_RTT)
+		bbr->prior_cwnd = tsk->cwnd;
+	else
+		bbr->prior_cwnd = max(bbr->prior_cwnd, tsk->cwnd);
+}
+
+static void bbr_update_bw(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr->round_start = 0;
+	if (!rs->interval || !rs->delivered)
+		return;
+
+	// the data sent at the start of the round trip is delivered
+	if (rs->prior_delivered >= bbr->next_rtt_delivered)
+	{
+		bbr->next_rtt_delivered = tsk->delivered;
+		bbr->rtt_cnt += 1;
+		bbr->round_start = 1;
+		bbr->packet_conservation = 0;
+	}
+
+	// the interval shorter than the min rtt is of the acks compressed
+	if (bbr->min_rtt != ~0U && rs->interval < bbr->min_rtt)
+		return;
+
+	// the sample limited by the application only tells a lower bound
+	u64 bw = (u64)rs->delivered * BBR_BW_UNIT / rs->interval;
+	if (!rs->is_app_limited || bw >= bbr_bw(tsk))
+		bbr_minmax_running_max(bbr->bw, BBR_BW_RTTS, bbr->rtt_cnt, bw);
+}
+
+// each phase of PROBE_BW lasts a min rtt, the probing one until the flight
+// reaches the gain (or the probing loses), and the draining one until the
+// queue is gone
+static void bbr_update_cycle_phase(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->mode != BBR_PROBE_BW)
+		return;
+
+	int full_length = tcp_time_us() - bbr->cycle_stamp > bbr->min_rtt;
+	int next;
+	if (bbr->pacing_gain == BBR_UNIT)
+		next = full_length;
+	else if (bbr->pacing_gain > BBR_UNIT)
+		next = full_length && (rs->losses ||
+			rs->prior_in_flight >= bbr_inflight(tsk, bbr_bw(tsk), bbr->pacing_gain));
+	else
+		next = full_length ||
+			rs->prior_in_flight <= bbr_inflight(tsk, bbr_bw(tsk), BBR_UNIT);
+
+	if (next)
+		bbr_advance_cycle_phase(tsk);
+}
+
+static void bbr_check_full_bw_reached(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->full_bw_reached || !bbr->round_start || rs->is_app_limited)
+		return;
+
+	if (bbr_bw(tsk) >= bbr->full_bw * BBR_FULL_BW_THRESH / BBR_UNIT)
+	{
+		bbr->full_bw = bbr_bw(tsk);
+		bbr->full_bw_cnt = 0;
+		return;
+	}
+	if (++bbr->full_bw_cnt >= BBR_FULL_BW_CNT)
+		bbr->full_bw_reached = 1;
+}
+
+static void bbr_check_drain(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (bbr->mode == BBR_STARTUP && bbr->full_bw_reached)
+	{
+		bbr->mode = BBR_DRAIN;
+		bbr->pacing_gain = BBR_DRAIN_GAIN;
+		bbr->cwnd_gain = BBR_HIGH_GAIN;
+	}
+	if (bbr->mode == BBR_DRAIN &&
+		tcp_in_flight(tsk) <= bbr_inflight(tsk, bbr_bw(tsk), BBR_UNIT))
+		bbr_reset_probe_bw_mode(tsk);
+}
+
+// the min rtt not seen for BBR_MIN_RTT_WIN is probed by cutting the flight down
+// to BBR_MIN_CWND for BBR_PROBE_RTT_TIME and a round trip
+static void bbr_update_min_rtt(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	u64 now = tcp_time_us();
+	int expired = now > bbr->min_rtt_stamp + BBR_MIN_RTT_WIN;
+	if (rs->rtt && (rs->rtt < bbr->min_rtt || expired))
+	{
+		bbr->min_rtt = rs->rtt;
+		bbr->min_rtt_stamp = now;
+	}
+
+	if (expired && !bbr->idle_restart && bbr->mode != BBR_PROBE_RTT)
+	{
+		bbr_save_cwnd(tsk);
+		bbr->mode = BBR_PROBE_RTT;
+		bbr->pacing_gain = BBR_UNIT;
+		bbr->cwnd_gain = BBR_UNIT;
+		bbr->probe_rtt_done_stamp = 0;
+	}
+
+	if (bbr->mode == BBR_PROBE_RTT)
+	{
+		// the samples of the flight cut down tell nothing of the bandwidth
+		tsk->app_limited = max(tsk->delivered + tcp_in_flight(tsk), 1);
+		if (!bbr->probe_rtt_done_stamp &&
+			tcp_in_flight(tsk) <= BBR_MIN_CWND * tsk->mss)
+		{
+			bbr->probe_rtt_done_stamp = now + BBR_PROBE_RTT_TIME;
+			bbr->probe_rtt_round_done = 0;
+			bbr->next_rtt_delivered = tsk->delivered;
+		}
+		else if (bbr->probe_rtt_done_stamp)
+		{
+			if (bbr->round_start)
+				bbr->probe_rtt_round_done = 1;
+			if (bbr->probe_rtt_round_done && now > bbr->probe_rtt_done_stamp)
+			{
+				bbr->min_rtt_stamp = now;
+				tsk->cwnd = max(tsk->cwnd, bbr->prior_cwnd);
+				bbr_reset_mode(tsk);
+			}
+		}
+	}
+
+	if (rs->delivered)
+		bbr->idle_restart = 0;
+}
+
+// the window in recovery, return whether it is set by packet conservation, i.e.
+// a segment is sent for each one delivered in the first round trip
+static int bbr_set_cwnd_to_recover_or_restore(struct tcp_sock *tsk,
+											   const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	u32 state = tsk->cong_state, prev_state = bbr->prev_state;
+	u32 cwnd = tsk->cwnd, in_flight = tcp_in_flight(tsk);
+
+	if (rs->losses)
+		cwnd = max(cwnd - min(rs->losses, cwnd), tsk->mss);
+
+	if (state == fast_recovery && prev_state != fast_recovery)
+	{
+		bbr->packet_conservation = 1;
+		bbr->next_rtt_delivered = tsk->delivered;
+		cwnd = in_flight + rs->acked;
+	}
+	else if (prev_state != open && state == open)
+	{
+		cwnd = max(cwnd, bbr->prior_cwnd);
+		bbr->packet_conservation = 0;
+	}
+	bbr->prev_state = state;
+
+	if (bbr->packet_conservation)
+	{
+		tsk->cwnd = max(cwnd, in_flight + rs->acked);
+		return 1;
+	}
+	tsk->cwnd = cwnd;
+	return 0;
+}
+
+// the window goes toward the bandwidth-delay product scaled by cwnd_gain, and
+// grows by the bytes delivered before the bandwidth is full
+static void bbr_set_cwnd(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (rs->acked && !bbr_set_cwnd_to_recover_or_restore(tsk, rs))
+	{
+		u32 target = bbr_inflight(tsk, bbr_bw(tsk), bbr->cwnd_gain);
+		if (bbr->full_bw_reached)
+			tsk->cwnd = min(tsk->cwnd + rs->acked, target);
+		else if (tsk->cwnd < target || tsk->delivered < TCP_INIT_CWND * tsk->mss)
+			tsk->cwnd += rs->acked;
+		tsk->cwnd = max(tsk->cwnd, BBR_MIN_CWND * tsk->mss);
+	}
+
+	if (bbr->mode == BBR_PROBE_RTT)
+		tsk->cwnd = min(tsk->cwnd, BBR_MIN_CWND * tsk->mss);
+}
+
+static void bbr_init(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	u64 now = tcp_time_us();
+	bbr->prev_state = open;
+	bbr->min_rtt = tsk->srtt ? tsk->srtt : ~0U;
+	bbr->min_rtt_stamp = now;
+	bbr->next_rtt_delivered = tsk->delivered;
+	bbr->cycle_stamp = now;
+	bbr_reset_startup_mode(tsk);
+	bbr_init_pacing_rate(tsk);
+}
+
+static void bbr_cong_control(struct tcp_sock *tsk, const struct tcp_rate_sample *rs)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr_update_bw(tsk, rs);
+	bbr_update_cycle_phase(tsk, rs);
+	bbr_check_full_bw_reached(tsk, rs);
+	bbr_check_drain(tsk);
+	bbr_update_min_rtt(tsk, rs);
+
+	bbr_set_pacing_rate(tsk, bbr_bw(tsk), bbr->pacing_gain);
+	bbr_set_cwnd(tsk, rs);
+}
+
+// the window is set by the next ack in recovery, see
+// bbr_set_cwnd_to_recover_or_restore
+static void bbr_on_loss(struct tcp_sock *tsk)
+{
+	bbr_save_cwnd(tsk);
+}
+
+// the timeout ends the round trip, and the bandwidth after it is probed again
+static void bbr_on_rto(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr_save_cwnd(tsk);
+	tsk->cwnd = tsk->mss;
+	bbr->prev_state = loss;
+	bbr->full_bw = 0;
+	bbr->round_start = 1;
+}
+
+// the losses are spurious, the window saved is restored by the next ack once
+// the state is open, while the bandwidth, which may not grow in the meantime,
+// is probed again for growth
+static void bbr_undo(struct tcp_sock *tsk)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	bbr->full_bw = 0;
+	bbr->full_bw_cnt = 0;
+}
+
+// sending restarts after idle at the bandwidth, instead of the gain of the
+// phase, and the min rtt is not probed before the samples of it
+static void bbr_cwnd_event(struct tcp_sock *tsk, enum tcp_cong_event event)
+{
+	struct bbr *bbr = tcp_cong_priv(tsk);
+	if (event != TCP_CONG_EVENT_TX_START || !tsk->app_limited)
+		return;
+
+	bbr->idle_restart = 1;
+	if (bbr->mode == BBR_PROBE_BW)
+		bbr_set_pacing_rate(tsk, bbr_bw(tsk), BBR_UNIT);
+}
+
+const struct tcp_cong_ops tcp_bbr_ops = {
+	.name = "bbr",
+	.init = bbr_init,
+	.cong_control = bbr_cong_control,
+	.on_loss = bbr_on_loss,
+	.on_rto = bbr_on_rto,
+	.undo = bbr_undo,
+	.cwnd_event = bbr_cwnd_event,
+};
@@ -0,0 +1,264 @@
+#include "tcp_cong.h"
+#include "tcp_sock.h"
+#include "tcp_timer.h"
+#include "log.h"
+
+#include <string.h>
+
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+static const struct tcp_cong_ops *tcp_cong_algos[] = {
+	&tcp_reno_ops,
+	&tcp_cubic_ops,
+	&tcp_bbr_ops,
+};
+
+#define TCP_CONG_NR	(sizeof(tcp_cong_algos) / sizeof(tcp_cong_algos[0]))
+
+// the trace of each algorithm, opened once it is written (see -g)
+static FILE *tcp_cong_trace_fp[TCP_CONG_NR];
+
+const struct tcp_cong_ops *tcp_cong_find(const char *name)
+{
+	for (int i = 0; i < TCP_CONG_NR; i++)
+	{
+		if (strcmp(tcp_cong_algos[i]->name, name) == 0)
+			return tcp_cong_algos[i];
+	}
+
+	return NULL;
+}
+
+// print the names of all the algorithms, separated by '|'
+void tcp_cong_list(FILE *fp)
+{
+	for (int i = 0; i < TCP_CONG_NR; i++)
+		fprintf(fp, "%s%s", i ? "|" : "", tcp_cong_algos[i]->name);
+}
+
+// append the window to cwnd-<algorithm>.txt if it is changed, as the time (in
+// milli second), the local port, cwnd and ssthresh (in bytes)
+static void tcp_cong_trace(struct tcp_sock *tsk, u32 cwnd, u32 ssthresh)
+{
+	if (!ustack_conf.tcp_cwnd_trace || (tsk->cwnd == cwnd && tsk->ssthresh == ssthresh))
+		return;
+
+	int i = 0;
+	while (i < TCP_CONG_NR && tcp_cong_algos[i] != tsk->cong_ops)
+		i++;
+	if (i == TCP_CONG_NR)
+		return;
+
+	if (!tcp_cong_trace_fp[i])
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "cwnd-%s.txt", tsk->cong_ops->name);
+		tcp_cong_trace_fp[i] = fopen(path, "a");
+		if (!tcp_cong_trace_fp[i])
+		{
+			log(ERROR, "open %s failed: %s", path, strerror(errno));
+			ustack_conf.tcp_cwnd_trace = 0;
+			return;
+		}
+		setvbuf(tcp_cong_trace_fp[i], NULL, _IOLBF, 0);
+	}
+
+	fprintf(tcp_cong_trace_fp[i], "%.3lf %hu %u %u\n", tcp_time_us() / 1000.0,
+			tsk->sk_sport, tsk->cwnd, tsk->ssthresh);
+}
+
+// the initial window of the connection, with the mss negotiated
+static inline u32 tcp_init_cwnd(struct tcp_sock *tsk)
+{
+	return TCP_INIT_CWND * tsk->mss;
+}
+
+// start the window over with cong_ops of tcp sock, e.g. once mss is negotiated
+void tcp_cong_init(struct tcp_sock *tsk)
+{
+	tsk->cwnd = tcp_init_cwnd(tsk);
+	tsk->ssthresh = TCP_INFINITE_SSTHRESH;
+	tsk->cong_avoid_ack = 0;
+	tsk->pacing_rate = 0;
+	memset(tsk->cong_priv, 0, sizeof(tsk->cong_priv));
+	if (tsk->cong_ops->init)
+		tsk->cong_ops->init(tsk);
+}
+
+// whether the window is used up before the ack, i.e. the data sent is not
+// limited by the application or by the window of the peer, otherwise the window
+// does not grow, since it is not validated by the acks (RFC 7661)
+//
+// snd_wnd is still the room left in the window, and slow start lets the window
+// double the flight of the last round trip.
+static inline int tcp_cwnd_limited(struct tcp_sock *tsk)
+{
+	if (tsk->cwnd < tsk->ssthresh)
+		return tsk->snd_wnd < tsk->cwnd / 2;
+	return tsk->snd_wnd < 2 * tsk->mss;
+}
+
+void tcp_cong_on_ack(struct tcp_sock *tsk, u32 acked)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	if (!tsk->cong_ops->on_ack || !tcp_cwnd_limited(tsk))
+		return;
+	tsk->cong_ops->on_ack(tsk, acked, tsk->ack_rtt);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// every ack, after it is processed by recovery, makes a rate sample for the
+// algorithms taking control of the window
+void tcp_cong_control(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	tcp_rate_gen(tsk);
+	if (!tsk->cong_ops->cong_control)
+		return;
+	tsk->cong_ops->cong_control(tsk, &tsk->rs);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+void tcp_cong_on_loss(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	tsk->cong_ops->on_loss(tsk);
+	tsk->prr_delivered = 0;
+	tsk->prr_out = 0;
+	tsk->recover_fs = max(tsk->snd_nxt - tsk->snd_una, 1);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// each ack in fast recovery sets the window to the flight plus the bytes to
+// send, which is in proportion to the bytes delivered, thus the flight goes
+// down to ssthresh at the end of recovery (PRR of RFC 6937) instead of
+// stalling until half of the acks come back; once the flight is below
+// ssthresh by more losses, it grows back at most as fast as slow start
+void tcp_cong_prr(struct tcp_sock *tsk, u32 delivered)
+{
+	if (tsk->cong_ops->cong_control || !delivered)
+		return;
+
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	u32 pipe = tcp_in_flight(tsk);
+	int64_t sndcnt;
+	tsk->prr_delivered += delivered;
+	if (pipe > tsk->ssthresh)
+	{
+		sndcnt = ((u64)tsk->prr_delivered * tsk->ssthresh + tsk->recover_fs - 1) /
+			tsk->recover_fs;
+		sndcnt -= tsk->prr_out;
+	}
+	else
+	{
+		int64_t limit = (int64_t)tsk->prr_delivered - tsk->prr_out;
+		limit = max(limit, (int64_t)delivered) + tsk->mss;
+		sndcnt = min((int64_t)(tsk->ssthresh - pipe), limit);
+	}
+	tsk->cwnd = pipe + max(sndcnt, 0);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// the recovery point is acked, the window is ssthresh, instead of the flight
+// left by PRR or by the duplicate acks
+void tcp_cong_end_recovery(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	if (!tsk->cong_ops->cong_control && tsk->ssthresh != TCP_INFINITE_SSTHRESH)
+		tsk->cwnd = max(tsk->ssthresh, tsk->mss);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// the timeouts in a row keep ssthresh of the first one (RFC 5681), which
+// tells the window before the loss
+void tcp_cong_on_rto(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	if (tsk->cong_state == loss)
+		tsk->cwnd = tsk->mss;
+	else
+		tsk->cong_ops->on_rto(tsk);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// the reduction by recovery or by the timeout is spurious, the window and
+// ssthresh go back to prior_cwnd and prior_ssthresh, unless they have grown
+// beyond since
+void tcp_cong_undo(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	if (tsk->cong_ops->undo)
+		tsk->cong_ops->undo(tsk);
+	tsk->cwnd = max(tsk->cwnd, tsk->prior_cwnd);
+	tsk->ssthresh = max(tsk->ssthresh, tsk->prior_ssthresh);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// data is about to be sent with nothing in flight, the window is not validated
+// by any ack while idle, thus it restarts from the initial window once idle for
+// an rto (RFC 5681), while ssthresh keeps most of it to regain in slow start
+void tcp_cong_tx_start(struct tcp_sock *tsk)
+{
+	u32 cwnd = tsk->cwnd, ssthresh = tsk->ssthresh;
+	if (!tsk->cong_ops->cong_control && tsk->snd_time &&
+		tcp_time_us() - tsk->snd_time > tsk->rto &&
+		tsk->cwnd > tcp_init_cwnd(tsk))
+	{
+		tsk->ssthresh = max(tsk->ssthresh, tsk->cwnd / 4 * 3);
+		tsk->cwnd = tcp_init_cwnd(tsk);
+	}
+	if (tsk->cong_ops->cwnd_event)
+		tsk->cong_ops->cwnd_event(tsk, TCP_CONG_EVENT_TX_START);
+	tcp_cong_trace(tsk, cwnd, ssthresh);
+}
+
+// the window grows by the bytes acked, at most 2 segments per ack (RFC 3465)
+void tcp_slow_start(struct tcp_sock *tsk, u32 acked)
+{
+	tsk->cwnd += min(acked, 2 * tsk->mss);
+}
+
+// the window grows by a segment once wnd bytes are acked
+void tcp_cong_avoid_ai(struct tcp_sock *tsk, u32 wnd, u32 acked)
+{
+	tsk->cong_avoid_ack += acked;
+	if (tsk->cong_avoid_ack >= wnd)
+	{
+		tsk->cong_avoid_ack -= wnd;
+		tsk->cwnd += tsk->mss;
+	}
+}
+
+// half of the window, but at least 2 segments (RFC 5681)
+static inline u32 tcp_reno_ssthresh(struct tcp_sock *tsk)
+{
+	return max(tsk->cwnd / 2, 2 * tsk->mss);
+}
+
+static void tcp_reno_on_ack(struct tcp_sock *tsk, u32 acked, u32 rtt)
+{
+	if (tsk->cwnd < tsk->ssthresh)
+		tcp_slow_start(tsk, acked);
+	else
+		tcp_cong_avoid_ai(tsk, tsk->cwnd, acked);
+}
+
+static void tcp_reno_on_loss(struct tcp_sock *tsk)
+{
+	tsk->ssthresh = tcp_reno_ssthresh(tsk);
+}
+
+static void tcp_reno_on_rto(struct tcp_sock *tsk)
+{
+	tsk->ssthresh = tcp_reno_ssthresh(tsk);
+	tsk->cwnd = tsk->mss;
+}
+
+const struct tcp_cong_ops tcp_reno_ops = {
+	.name = "reno",
+	.on_ack = tcp_reno_on_ack,
+	.on_loss = tcp_reno_on_loss,
+	.on_rto = tcp_reno_on_rto,
+};
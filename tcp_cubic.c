@@ -0,0 +1,179 @@
+#include "tcp_cong.h"
+#include "tcp_sock.h"
+#include "tcp_timer.h"
+
+#include <math.h>
+
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+// CUBIC (RFC 9438), the window grows by a cubic function of the time since the
+// last reduction, which is flat around the window before it, thus the window
+// on long round trip paths comes back in seconds instead of many round trips
+//
+// Slow start exits on the delay increase of HyStart (see RFC 9406), before the
+// queue of the path overflows.
+
+#define CUBIC_C 0.4			// aggressiveness of the cubic function
+#define CUBIC_BETA 0.7		// the window kept after a loss
+// the window of reno with the same losses grows this much per round trip,
+// i.e. the same average window as reno with its beta of 0.5
+#define CUBIC_ALPHA (3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA))
+
+// HyStart only works on windows of this many segments or more
+#define HYSTART_LOW_WINDOW 16
+// the rtt samples of a round trip to compare with the last round trip
+#define HYSTART_MIN_SAMPLES 8
+// bounds of the rtt increase to exit slow start (in micro second)
+#define HYSTART_DELAY_MIN 4000
+#define HYSTART_DELAY_MAX 16000
+
+struct cubic
+{
+	u32 w_max;			// the window before the last reduction (in bytes)
+	u32 origin;			// the window the cubic function is flat at
+	u64 epoch_start;	// when congestion avoidance starts, 0 if not yet
+	double k;			// time from epoch_start to reach origin (in second)
+	double w_est;		// the window of reno since epoch_start
+	u64 cnt;			// the growth below a byte carried to the next ack
+
+	// a round trip of slow start ends once round_end is acked, the least rtt
+	// sampled in it, in the last round trip, and the samples in it
+	int rounds;
+	u32 round_end;
+	u32 round_min_rtt;
+	u32 last_round_min_rtt;
+	int round_samples;
+};
+
+static void cubic_hystart(struct tcp_sock *tsk, u32 rtt)
+{
+	struct cubic *ca = tcp_cong_priv(tsk);
+	if (!ca->rounds || greater_or_equal_32b(tsk->snd_una, ca->round_end))
+	{
+		ca->rounds += 1;
+		ca->round_end = tsk->snd_nxt;
+		ca->last_round_min_rtt = ca->round_min_rtt;
+		ca->round_min_rtt = 0;
+		ca->round_samples = 0;
+	}
+
+	if (!rtt || ca->round_samples >= HYSTART_MIN_SAMPLES)
+		return;
+	if (!ca->round_min_rtt || rtt < ca->round_min_rtt)
+		ca->round_min_rtt = rtt;
+	ca->round_samples += 1;
+
+	// the queue is building up once the rtt of the round trip increases
+	if (ca->round_samples == HYSTART_MIN_SAMPLES && ca->last_round_min_rtt &&
+		tsk->cwnd >= HYSTART_LOW_WINDOW * tsk->mss)
+	{
+		u32 eta = min(max(ca->last_round_min_rtt / 8, HYSTART_DELAY_MIN),
+					  HYSTART_DELAY_MAX);
+		if (ca->round_min_rtt >= ca->last_round_min_rtt + eta)
+			tsk->ssthresh = tsk->cwnd;
+	}
+}
+
+// the cubic function, starting at the window of now (W_cubic of RFC 9438)
+static void cubic_epoch_start(struct tcp_sock *tsk, u64 now)
+{
+	struct cubic *ca = tcp_cong_priv(tsk);
+	ca->epoch_start = now;
+	ca->cnt = 0;
+	ca->w_est = tsk->cwnd;
+	if (tsk->cwnd < ca->w_max)
+	{
+		ca->k = cbrt((double)(ca->w_max - tsk->cwnd) / tsk->mss / CUBIC_C);
+		ca->origin = ca->w_max;
+	}
+	else
+	{
+		ca->k = 0;
+		ca->origin = tsk->cwnd;
+	}
+}
+
+static void cubic_cong_avoid(struct tcp_sock *tsk, u32 acked)
+{
+	struct cubic *ca = tcp_cong_priv(tsk);
+	u64 now = tcp_time_us();
+	if (!ca->epoch_start)
+		cubic_epoch_start(tsk, now);
+
+	// the window to reach in a round trip, at most 1.5 times of the window
+	double t = (now - ca->epoch_start + tsk->srtt) / 1e6 - ca->k;
+	double target = ca->origin + CUBIC_C * t * t * t * tsk->mss;
+	target = min(max(target, tsk->cwnd), 1.5 * tsk->cwnd);
+
+	// the window grows at least as fast as reno would
+	double alpha = ca->w_est < ca->w_max ? CUBIC_ALPHA : 1;
+	ca->w_est += alpha * acked * tsk->mss / tsk->cwnd;
+	if (ca->w_est > target)
+	{
+		tsk->cwnd = max(tsk->cwnd, (u32)ca->w_est);
+		return;
+	}
+
+	// the window grows by (target - cwnd) / cwnd for each byte acked
+	ca->cnt += (u64)(target - tsk->cwnd) * acked;
+	tsk->cwnd += ca->cnt / tsk->cwnd;
+	ca->cnt %= tsk->cwnd;
+}
+
+static void cubic_on_ack(struct tcp_sock *tsk, u32 acked, u32 rtt)
+{
+	if (tsk->cwnd < tsk->ssthresh)
+	{
+		tcp_slow_start(tsk, acked);
+		cubic_hystart(tsk, rtt);
+	}
+	else
+		cubic_cong_avoid(tsk, acked);
+}
+
+// the window is reduced to beta of it, the window before it is remembered
+// lower if the window is already below it, which gives way to new flows (fast
+// convergence)
+static void cubic_reduce(struct tcp_sock *tsk)
+{
+	struct cubic *ca = tcp_cong_priv(tsk);
+	if (tsk->cwnd < ca->w_max)
+		ca->w_max = tsk->cwnd * (1 + CUBIC_BETA) / 2;
+	else
+		ca->w_max = tsk->cwnd;
+	ca->epoch_start = 0;
+	tsk->ssthresh = max((u32)(tsk->cwnd * CUBIC_BETA), 2 * tsk->mss);
+}
+
+static void cubic_on_loss(struct tcp_sock *tsk)
+{
+	cubic_reduce(tsk);
+}
+
+static void cubic_on_rto(struct tcp_sock *tsk)
+{
+	cubic_reduce(tsk);
+	tsk->cwnd = tsk->mss;
+}
+
+// the time idle is not counted in the cubic function, which goes on from where
+// it stops
+static void cubic_cwnd_event(struct tcp_sock *tsk, enum tcp_cong_event event)
+{
+	struct cubic *ca = tcp_cong_priv(tsk);
+	if (event == TCP_CONG_EVENT_TX_START && ca->epoch_start && tsk->snd_time)
+	{
+		u64 now = tcp_time_us();
+		ca->epoch_start = min(ca->epoch_start + (now - tsk->snd_time), now);
+	}
+}
+
+const struct tcp_cong_ops tcp_cubic_ops = {
+	.name = "cubic",
+	.on_ack = cubic_on_ack,
+	.on_loss = cubic_on_loss,
+	.on_rto = cubic_on_rto,
+	.cwnd_event = cubic_cwnd_event,
+};
@@ -6,16 +6,20 @@
 #include "ring_buffer.h"
 
 #include <stdlib.h>
-// update the snd_wnd of tcp_sock
+// update the snd_wnd of tcp_sock, the bytes still in flight are taken out of
+// the congestion window, and remember the window advertised by the peer, which
+// is scaled unless it is carried by SYN
 //
-// if the snd_wnd before updating is zero, notify tcp_sock_send (wait_send)
+// The bytes sacked or deemed lost are not in flight, unless retransmitted
+// (pipe of RFC 6675). The data waiting in snd_buf is sent by tcp_push once the
+// window opens.
 static inline void tcp_update_window(struct tcp_sock *tsk, struct tcp_cb *cb)
 {
-	u16 old_snd_wnd = tsk->snd_wnd;
-	// tsk->snd_wnd = cb->rwnd;
-	tsk->snd_wnd = min(cb->rwnd, tsk->cwnd * TCP_DEFAULT_MSS);
-	if (old_snd_wnd == 0)
-		wake_up(tsk->wait_send);
+	tsk->adv_wnd = (cb->flags & TCP_SYN) ? cb->rwnd : cb->rwnd << tsk->snd_wscale;
+	u32 wnd = tsk->cwnd;
+	u32 in_flight = tsk->snd_nxt - cb->ack - tsk->sacked_out - tsk->lost_out +
+		tsk->retrans_out;
+	tsk->snd_wnd = wnd > in_flight ? wnd - in_flight : 0;
 }
 
 // update the snd_wnd safely: cb->ack should be between snd_una and snd_nxt
@@ -31,6 +35,40 @@ static inline void tcp_update_window_safe(struct tcp_sock *tsk, struct tcp_cb *c
 #define max(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+// a pure ack of nothing new while data is in flight
+static inline int tcp_is_dup_ack(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	return cb->ack == tsk->snd_una && tsk->snd_una != tsk->snd_nxt &&
+		!cb->pl_len && !(cb->flags & (TCP_SYN | TCP_FIN));
+}
+
+// without SACK, each duplicate ack tells a segment above the hole has left the
+// network, which is counted in sacked_out (and delivered) as if it is sacked,
+// thus the flight goes down in recovery like with SACK; the new ack takes them
+// out again, but the hole filled by it
+static void tcp_reno_sack_update(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	u32 sacked_out = tsk->sacked_out;
+	if (greater_than_32b(cb->ack, tsk->snd_una))
+	{
+		u32 acked = cb->ack - tsk->snd_una;
+		sacked_out -= min(sacked_out, acked - min(acked, tsk->mss));
+	}
+	else if (tcp_is_dup_ack(tsk, cb))
+		sacked_out += tsk->mss;
+
+	// at most all the data in flight, which is not known to be lost
+	u32 outstanding = tsk->snd_nxt - max(tsk->snd_una, cb->ack);
+	sacked_out = min(sacked_out, outstanding - min(outstanding, tsk->lost_out));
+
+	// the data acked is counted in delivered by the segments acked
+	if (sacked_out > tsk->sacked_out)
+		tsk->delivered += sacked_out - tsk->sacked_out;
+	else
+		tsk->delivered -= min(tsk->delivered, (u64)(tsk->sacked_out - sacked_out));
+	tsk->sacked_out = sacked_out;
+}
+
 // check whether the sequence number of the incoming packet is in the receiving
 // window
 static inline int is_tcp_seq_valid(struct tcp_sock *tsk, struct tcp_cb *cb)
@@ -47,6 +85,396 @@ static inline int is_tcp_seq_valid(struct tcp_sock *tsk, struct tcp_cb *cb)
 	}
 }
 
+// the mss of the connection, the peer assumes the default one if it does not
+// announce its mss in SYN, and a tiny one is raised to TCP_MIN_MSS
+static inline u16 tcp_negotiate_mss(struct tcp_cb *cb)
+{
+	u16 mss = cb->mss ? cb->mss : TCP_DEFAULT_MSS;
+	return min(TCP_MSS, max(mss, TCP_MIN_MSS));
+}
+
+// the window scale is used in both directions only if both ends send the option
+// in SYN, otherwise the windows are not scaled
+static inline void tcp_negotiate_wscale(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	tsk->wscale_ok = tsk->wscale_ok && cb->wscale >= 0;
+	tsk->snd_wscale = tsk->wscale_ok ? cb->wscale : 0;
+	if (!tsk->wscale_ok)
+		tsk->rcv_wscale = 0;
+}
+
+// the timestamps are sent in every segment only if both ends send the option in
+// SYN, taking the room of the option out of mss
+static inline void tcp_negotiate_ts(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	tsk->ts_ok = tsk->ts_ok && cb->ts;
+	if (tsk->ts_ok)
+	{
+		tsk->ts_recent = cb->tsval;
+		tsk->ts_recent_stamp = tcp_time_us();
+		tsk->mss = max(tsk->mss - TCP_OPT_TS_SPACE, 1);
+	}
+}
+
+// protection against wrapped sequence numbers (PAWS), the segment carrying a
+// timestamp older than the last one taken from the peer is an old duplicate,
+// unless the connection has been idle long enough for the clock to wrap
+static int tcp_paws_reject(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	if (!tsk->ts_ok || !cb->ts || !tsk->ts_recent_stamp)
+		return 0;
+	if (greater_or_equal_32b(cb->tsval, tsk->ts_recent))
+		return 0;
+	return tcp_time_us() - tsk->ts_recent_stamp < TCP_PAWS_IDLE;
+}
+
+// the timestamp to echo is taken from the segment starting at or before the
+// last ack sent, thus the one which the next ack is about (RFC 7323)
+static void tcp_ts_update(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	tsk->rx_tsecr = cb->ts ? cb->tsecr : 0;
+	if (!tsk->ts_ok || !cb->ts || !tsk->ts_recent_stamp)
+		return;
+	if (less_or_equal_32b(cb->seq, tsk->rcv_acked) &&
+		greater_or_equal_32b(cb->tsval, tsk->ts_recent))
+	{
+		tsk->ts_recent = cb->tsval;
+		tsk->ts_recent_stamp = tcp_time_us();
+	}
+}
+
+// find the child tcp sock in listen_queue serving the connection of cb
+static struct tcp_sock *tcp_sock_lookup_pending(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	struct tcp_sock *csk = NULL;
+	list_for_each_entry(csk, &tsk->listen_queue, list)
+	{
+		if (csk->sk_dip == cb->saddr && csk->sk_dport == cb->sport)
+			return csk;
+	}
+
+	return NULL;
+}
+
+// the data received again is reported by the next ack (D-SACK of RFC 2883),
+// which tells the peer its retransmission is spurious
+static inline void tcp_dsack_set(struct tcp_sock *tsk, u32 seq, u32 seq_end)
+{
+	if (!tsk->sack_ok)
+		return;
+	tsk->rcv_dsack = 1;
+	tsk->rcv_dsack_seq = seq;
+	tsk->rcv_dsack_seq_end = seq_end;
+}
+
+// store the payload received out of order in rcv_buf, at its offset from
+// rcv_nxt (i.e. the tail of rcv_buf), and merge its range with the ranges in
+// rcv_ofo which overlap or adjoin it
+static void tcp_ofo_queue(struct tcp_sock *tsk, struct tcp_cb *cb)
+{
+	if (cb->pl_len > 0)
+	{
+		pthread_mutex_lock(&tsk->rcv_buf_lock);
+		write_ring_buffer_at(tsk->rcv_buf, cb->seq - tsk->rcv_nxt, cb->payload,
+							 cb->pl_len);
+		pthread_mutex_unlock(&tsk->rcv_buf_lock);
+	}
+
+	// find the last range starting at or before the segment
+	struct rb_node **link = &tsk->rcv_ofo.rb_node, *parent = NULL, *prev = NULL;
+	while (*link)
+	{
+		parent = *link;
+		struct tcp_ofo_range *r = rb_entry(parent, struct tcp_ofo_range, node);
+		if (greater_than_32b(r->seq, cb->seq))
+			link = &parent->left;
+		else
+		{
+			prev = parent;
+			link = &parent->right;
+		}
+	}
+
+	tsk->rcv_ofo_seq = cb->seq;
+
+	int fin = (cb->flags & TCP_FIN) ? 1 : 0;
+	struct tcp_ofo_range *cur = prev ? rb_entry(prev, struct tcp_ofo_range, node) : NULL;
+	if (cur && less_or_equal_32b(cb->seq, cur->seq_end))
+	{
+		if (cb->pl_len > 0 && less_or_equal_32b(cb->seq_end, cur->seq_end))
+			tcp_dsack_set(tsk, cb->seq, cb->seq_end);
+		if (greater_than_32b(cb->seq_end, cur->seq_end))
+		{
+			cur->seq_end = cb->seq_end;
+			cur->fin = fin;
+		}
+	}
+	else
+	{
+		cur = malloc(sizeof(struct tcp_ofo_range));
+		if (cur == NULL)
+		{
+			log(ERROR, "Malloc failed during %s", __FUNCTION__);
+			exit(-1);
+		}
+		cur->seq = cb->seq;
+		cur->seq_end = cb->seq_end;
+		cur->fin = fin;
+		rb_link_node(&cur->node, parent, link);
+		rb_insert_color(&cur->node, &tsk->rcv_ofo);
+	}
+
+	// swallow the following ranges covered by the merged one
+	struct rb_node *node;
+	while ((node = rb_next(&cur->node)) != NULL)
+	{
+		struct tcp_ofo_range *r = rb_entry(node, struct tcp_ofo_range, node);
+		if (greater_than_32b(r->seq, cur->seq_end))
+			break;
+		if (greater_than_32b(r->seq_end, cur->seq_end))
+		{
+			cur->seq_end = r->seq_end;
+			cur->fin = r->fin;
+		}
+		rb_erase(node, &tsk->rcv_ofo);
+		free(r);
+	}
+}
+
+// deliver the data received out of order which rcv_nxt has caught up with, by
+// producing it in rcv_buf where it is stored, and release the ranges
+static void tcp_ofo_deliver(struct tcp_sock *tsk)
+{
+	struct rb_node *node;
+	while ((node = rb_first(&tsk->rcv_ofo)) != NULL)
+	{
+		struct tcp_ofo_range *r = rb_entry(node, struct tcp_ofo_range, node);
+		if (greater_than_32b(r->seq, tsk->rcv_nxt))
+			break;
+
+		if (greater_than_32b(r->seq_end, tsk->rcv_nxt))
+		{
+			int size = r->seq_end - tsk->rcv_nxt - r->fin;
+			pthread_mutex_lock(&tsk->rcv_buf_lock);
+			tsk->rcv_wnd -= size;
+			commit_ring_buffer(tsk->rcv_buf, size);
+			pthread_mutex_unlock(&tsk->rcv_buf_lock);
+			tsk->rcv_nxt = r->seq_end;
+			if (r->fin)
+			{
+				tsk->state = TCP_CLOSE_WAIT;
+				log(DEBUG, "Passively close connection");
+			}
+		}
+
+		rb_erase(node, &tsk->rcv_ofo);
+		free(r);
+	}
+}
+
+// the receiver has no rtt sample of its own, but the data beyond the window
+// advertised at some time is only sent once the peer gets the advertisement,
+// thus it arrives at least a round trip later, and the least such time is an
+// estimate of rtt
+static void tcp_rcv_rtt_measure(struct tcp_sock *tsk, u64 now)
+{
+	if (tsk->rcv_rtt_time && less_or_equal_32b(tsk->rcv_nxt, tsk->rcv_rtt_seq))
+		return;
+
+	if (tsk->rcv_rtt_time)
+	{
+		u32 sample = max(now - tsk->rcv_rtt_time, 1);
+		if (tsk->rcv_rtt == 0 || sample < tsk->rcv_rtt)
+			tsk->rcv_rtt = sample;
+	}
+	tsk->rcv_rtt_seq = tsk->rcv_nxt + tsk->rcv_wnd;
+	tsk->rcv_rtt_time = now;
+}
+
+// dynamic right-sizing of rcv_buf (DRS), called when data arrives in order:
+// once a round trip, rcv_buf grows to twice the data the application consumed
+// in the round trip, since the sender may double it in the next one (slow
+// start), and more if the consumption keeps growing
+static void tcp_rcv_space_adjust(struct tcp_sock *tsk)
+{
+	u64 now = tcp_time_us();
+	tsk->rcv_time = now;
+	tcp_rcv_rtt_measure(tsk, now);
+
+	pthread_mutex_lock(&tsk->rcv_buf_lock);
+	u32 copied_seq = tsk->rcv_nxt - ring_buffer_used(tsk->rcv_buf);
+	pthread_mutex_unlock(&tsk->rcv_buf_lock);
+
+	if (tsk->rcvq_time == 0)
+	{
+		// the sender starts with the initial window (RFC 6928)
+		tsk->rcvq_space = min(tsk->rcv_wnd, 10 * tsk->mss);
+		tsk->rcvq_seq = copied_seq;
+		tsk->rcvq_time = now;
+		return;
+	}
+	if (tsk->rcv_rtt == 0 || now - tsk->rcvq_time < tsk->rcv_rtt)
+		return;
+
+	u32 copied = copied_seq - tsk->rcvq_seq;
+	if (copied > tsk->rcvq_space)
+	{
+		u64 size = 2 * (u64)copied + 16 * tsk->mss;
+		size += 2 * size * (copied - tsk->rcvq_space) / tsk->rcvq_space;
+		// the window beyond the scale is never advertised
+		size = min(size, min(tsk->rcv_buf_max, TCP_MAX_WINDOW << tsk->rcv_wscale));
+		// the demand is back before rcv_buf shrinks, thus it is kept
+		if (size > tsk->rcv_buf_init)
+			tsk->rcv_shrink = 0;
+		if (size > tsk->rcv_buf->size - 1 && tcp_sock_tune_rcv_buf(tsk, size) == 0)
+			tcp_set_rcvbuf_timer(tsk);
+		tsk->rcvq_space = copied;
+	}
+	tsk->rcvq_seq = copied_seq;
+	tsk->rcvq_time = now;
+}
+
+// the window is about to be reduced by recovery or by the timeout, which is
+// saved to be restored once the retransmissions turn out to be spurious, unless
+// it is reduced already, i.e. the timeout in recovery is undone along with it
+void tcp_undo_mark(struct tcp_sock *tsk)
+{
+	if (!ustack_conf.tcp_undo || tsk->cong_state != open)
+		return;
+	tsk->prior_cwnd = tsk->cwnd;
+	tsk->prior_ssthresh = tsk->ssthresh;
+	tsk->undo_marker = tsk->snd_una;
+	tsk->undo_retrans = 0;
+	tsk->retrans_stamp = 0;
+}
+
+// the retransmissions are spurious, the window reduced for them is restored,
+// and the segments deemed lost are in flight again, which ends the recovery
+static void tcp_undo(struct tcp_sock *tsk)
+{
+	tcp_cong_undo(tsk);
+	tcp_txq_untag_lost(tsk);
+	tsk->prior_cwnd = 0;
+	tsk->frto = 0;
+	tsk->dup_ack = 0;
+	tsk->cong_state = open;
+}
+
+// once reordering is seen (or D-SACK), the losses are detected by the time
+// (RACK) only, since counting the duplicate acks and the sacks takes the
+// segments reordered for lost
+static inline int tcp_rack_only(struct tcp_sock *tsk)
+{
+	return ustack_conf.tcp_rack && tsk->sack_ok && tsk->rack_reordering_seen;
+}
+
+// the first sack block reports the data received more than once, if it is
+// below the ack, or within the second block (D-SACK of RFC 2883)
+static inline int tcp_is_dsack(struct tcp_cb *cb)
+{
+	struct tcp_sack_block *b = cb->sacks;
+	if (cb->nr_sacks == 0)
+		return 0;
+	return less_or_equal_32b(b[0].end, cb->ack) ||
+		(cb->nr_sacks > 1 && greater_or_equal_32b(b[0].start, b[1].start) &&
+		 less_or_equal_32b(b[0].end, b[1].end));
+}
+
+// the D-SACK reports a spurious retransmission, once those since the window is
+// reduced are all reported, the reduction is undone
+static void tcp_dsack(struct tcp_sock *tsk, u32 start, u32 end)
+{
+	tsk->dsacks += 1;
+	tcp_rack_dsack(tsk);
+	if (!tsk->prior_cwnd || !tsk->retrans_stamp || less_than_32b(start, tsk->undo_marker))
+		return;
+
+	tsk->undo_retrans -= min(tsk->undo_retrans, end - start);
+	if (tsk->undo_retrans == 0)
+	{
+		tcp_undo(tsk);
+		tsk->undo_dsack += 1;
+	}
+}
+
+// whether the ack tells the retransmissions of recovery or of the timeout are
+// spurious: the timestamp echoed is older than the first retransmission (Eifel
+// of RFC 3522), or after the timeout, segments never retransmitted are
+// delivered (F-RTO of RFC 5682, which is also enhanced by SACK)
+//
+// F-RTO sends new data after the first ack acks the retransmission, instead of
+// the other retransmissions, and the next ack tells whether the new data is
+// delivered along with the data sent before the timeout; any other ack tells
+// the loss is real.
+static void tcp_try_undo(struct tcp_sock *tsk, struct tcp_cb *cb, int new_ack, int dup_ack)
+{
+	if (tsk->cong_state == open || !tsk->prior_cwnd)
+		return;
+
+	if (new_ack && tsk->retrans_stamp && tsk->rx_tsecr &&
+		less_than_32b(tsk->rx_tsecr, tsk->retrans_stamp))
+	{
+		tcp_undo(tsk);
+		tsk->undo_eifel += 1;
+		return;
+	}
+
+	if (tsk->cong_state != loss || !tsk->frto)
+		return;
+	if (tsk->ack_orig)
+	{
+		tcp_undo(tsk);
+		tsk->undo_frto += 1;
+	}
+	else if (tsk->frto == 1 && new_ack && less_than_32b(cb->ack, tsk->recovery_point) &&
+			 less_than_32b(tsk->snd_nxt, tsk->write_seq) &&
+			 less_than_32b(tsk->snd_nxt, tsk->snd_una + tsk->adv_wnd))
+		tsk->frto = 2;
+	else if (new_ack || dup_ack || cb->nr_sacks)
+		tsk->frto = 0;
+}
+
+// the first segment is deemed lost, fast recovery starts with the
+// retransmission of it, regardless of the window
+void tcp_enter_recovery(struct tcp_sock *tsk)
+{
+	tcp_undo_mark(tsk);
+	tcp_cong_on_loss(tsk);
+	tsk->dup_ack = 0;
+	tsk->cong_state = fast_recovery;
+	// log(DEBUG, "Fast recovery. Current cwnd=%u", tsk->cwnd);
+	tsk->recovery_point = tsk->snd_nxt;
+	tcp_retransmit(tsk, tcp_txq_first(tsk));
+}
+
+// the ack of the tail loss probe ends it: the data after the probe acked
+// along with the probe retransmitted tells a loss repaired by it, which
+// reduces the window like fast recovery would (RFC 8985), while a D-SACK of
+// the probe, or a duplicate ack, tells both the probe and the segment before
+// it are received
+static void tcp_tlp_ack(struct tcp_sock *tsk, struct tcp_cb *cb, int new_ack)
+{
+	if (!tsk->tlp_high_seq || less_than_32b(cb->ack, tsk->tlp_high_seq))
+		return;
+
+	if (!tsk->tlp_retrans)
+		tsk->tlp_high_seq = 0;
+	else if (tsk->sack_ok && tcp_is_dsack(cb) && cb->sacks[0].end == tsk->tlp_high_seq)
+		tsk->tlp_high_seq = 0;
+	else if (greater_than_32b(cb->ack, tsk->tlp_high_seq))
+	{
+		tsk->tlp_high_seq = 0;
+		tsk->tlp_recoveries += 1;
+		if (tsk->cong_state == open)
+		{
+			tcp_cong_on_loss(tsk);
+			tcp_cong_end_recovery(tsk);
+		}
+	}
+	else if (!new_ack && !cb->pl_len && !cb->nr_sacks)
+		tsk->tlp_high_seq = 0;
+}
+
 // Process the incoming packet according to TCP state machine.
 void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 {
@@ -63,11 +491,38 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 		return;
 	}
 
+	if (tcp_paws_reject(tsk, cb))
+	{
+		// the old duplicate is dropped, but acked like any other duplicate
+		if (!(cb->flags & TCP_SYN))
+			tcp_send_ack(tsk, 1);
+		return;
+	}
+	tcp_ts_update(tsk, cb);
+
 	// Remember only to update cwnd in established mode
 
 	if (cb->flags & TCP_ACK)
 	{
 		tcp_update_retrans_timer(tsk, cb->ack);
+		tcp_clean_snd_buf(tsk, cb->ack);
+		int dsack = tsk->sack_ok && tcp_is_dsack(cb);
+		if (dsack)
+			tcp_dsack(tsk, cb->sacks[0].start, cb->sacks[0].end);
+		for (int i = dsack; tsk->sack_ok && i < cb->nr_sacks; i++)
+			tcp_txq_sack(tsk, cb->sacks[i].start, cb->sacks[i].end);
+		if (!tsk->sack_ok)
+			tcp_reno_sack_update(tsk, cb);
+		else
+		{
+			if (tsk->sacked_out && !tcp_rack_only(tsk))
+				tcp_txq_mark_lost(tsk);
+			// the segments not deemed lost yet are checked again later
+			u32 timeout = ustack_conf.tcp_rack && tsk->rack_advanced ?
+				tcp_rack_detect_loss(tsk) : 0;
+			if (timeout)
+				tcp_set_reo_timer(tsk, timeout);
+		}
 	}
 
 	if (tsk->state == TCP_SYN_SENT)
@@ -76,14 +531,20 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 		if (cb->flags & TCP_SYN)
 		{
 			tsk->rcv_nxt = cb->seq_end;
+			tsk->rcv_adv = tsk->rcv_nxt;
 			tsk->snd_una = max(tsk->snd_una, cb->ack);
+			tsk->mss = tcp_negotiate_mss(cb);
+			tsk->sack_ok = tsk->sack_ok && cb->sack_perm;
+			tcp_negotiate_wscale(tsk, cb);
+			tcp_negotiate_ts(tsk, cb);
+			// the initial window is counted in the mss negotiated
+			tcp_cong_init(tsk);
 		}
 		if (cb->flags & (TCP_SYN | TCP_ACK))
 		{
 			log(DEBUG, "Connection established");
 			tcp_send_control_packet(tsk, TCP_ACK);
 			tsk->state = TCP_ESTABLISHED;
-			tsk->rcv_buf = alloc_ring_buffer(tsk->rcv_wnd);
 			pthread_mutex_init(&tsk->rcv_buf_lock, NULL);
 			wake_up(tsk->wait_connect);
 		}
@@ -95,7 +556,14 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 			// Receive SYN from a client in a passive connection establishment
 			// Create a child socket and put it into listen_queue
 			log(DEBUG, "Received TCP_SYN in listen state");
+			// the SYN is retransmitted, its SYN|ACK is retransmitted by the
+			// timer of the pending child
+			if (tcp_sock_lookup_pending(tsk, cb))
+				return;
 			struct tcp_sock *csk = alloc_tcp_sock();
+			// the child takes the buffer sizes of the listening sock
+			tcp_sock_resize_snd_buf(csk, tsk->snd_buf->size - 1);
+			tcp_sock_resize_rcv_buf(csk, tsk->rcv_buf_init, tsk->rcv_buf_max);
 			csk->state = TCP_SYN_RECV;
 			csk->parent = tsk;
 			csk->sk_sip = cb->daddr;
@@ -103,8 +571,15 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 			csk->sk_dip = cb->saddr;
 			csk->sk_dport = cb->sport;
 			csk->rcv_nxt = cb->seq_end;
+			csk->rcv_adv = csk->rcv_nxt;
 			csk->snd_una = max(csk->snd_una, cb->ack);
 			csk->snd_wnd = tsk->snd_wnd;
+			csk->mss = tcp_negotiate_mss(cb);
+			csk->sack_ok = csk->sack_ok && cb->sack_perm;
+			tcp_negotiate_wscale(csk, cb);
+			tcp_negotiate_ts(csk, cb);
+			csk->cong_ops = tsk->cong_ops;
+			tcp_cong_init(csk);
 			list_add_head(&csk->list, &tsk->listen_queue);
 			csk->ref_cnt += 1;
 
@@ -116,27 +591,108 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 		if (cb->flags & (TCP_ACK))
 		{
 			// Receive the last ACK from a client in a passive connection establishment
-			struct tcp_sock *csk = NULL;
-			if (list_empty(&tsk->listen_queue))
+			struct tcp_sock *csk = tcp_sock_lookup_pending(tsk, cb);
+			if (csk == NULL)
 			{
 				log(ERROR, "No waiting client socket for last ACK in handshaking");
 				return;
 			}
 			log(DEBUG, "Connection established");
-			csk = list_entry((&tsk->listen_queue)->next, struct tcp_sock, list);
 			list_delete_entry(&csk->list);
+			// the ACK of SYN|ACK is handled by the listening tcp sock, since
+			// the child is not hashed yet
+			tcp_update_retrans_timer(csk, cb->ack);
+			csk->snd_una = max(csk->snd_una, cb->ack);
+			tcp_update_window_safe(csk, cb);
 			csk->state = TCP_ESTABLISHED;
 			list_add_head(&csk->list, &tsk->accept_queue);
 			tcp_hash(csk);
-			csk->rcv_buf = alloc_ring_buffer(csk->rcv_wnd);
 			pthread_mutex_init(&csk->rcv_buf_lock, NULL);
 			wake_up(tsk->wait_accept);
 		}
 	}
 
+	// the data written before *close* is in flight until FIN is acked, thus the
+	// acks drive the recovery and the window in the closing states too
+	if (tcp_sock_sending(tsk))
+	{
+		// Congestion management
+		if (cb->flags & TCP_ACK)
+		{
+			int new_ack = greater_than_32b(cb->ack, tsk->snd_una);
+			int dup_ack = tcp_is_dup_ack(tsk, cb);
+			u32 acked = new_ack ? cb->ack - tsk->snd_una : 0;
+			if (new_ack)
+			{
+				tsk->dup_ack = 0;
+				tsk->snd_una = cb->ack;
+			}
+			else if (dup_ack)
+				tsk->dup_ack += 1;
+			tcp_tlp_ack(tsk, cb, new_ack);
+			tcp_try_undo(tsk, cb, new_ack, dup_ack);
+
+			if (tsk->cong_state == open || tsk->cong_state == loss)
+			{
+				// the window grows with the data acked
+				if (new_ack)
+					tcp_cong_on_ack(tsk, acked);
+				// the data sent before the timeout is acked
+				if (tsk->cong_state == loss &&
+					greater_or_equal_32b(cb->ack, tsk->recovery_point))
+				{
+					tsk->cong_state = open;
+					tsk->frto = 0;
+					tcp_rack_recovered(tsk);
+				}
+			}
+			if (tsk->cong_state == open)
+			{
+				// the first segment is deemed lost by duplicate acks, or by
+				// the segments sacked above it
+				struct tcp_tx_seg *seg = tcp_txq_first(tsk);
+				int dup_thresh = tsk->dup_ack >= TCP_DUPTHRESH && !tcp_rack_only(tsk);
+				if (seg && (dup_thresh || (seg->state & TCP_SEG_LOST)))
+					tcp_enter_recovery(tsk);
+			}
+			else if (tsk->cong_state == fast_recovery)
+			{
+				// Fast recovery
+				if (new_ack && less_than_32b(cb->ack, tsk->recovery_point))
+				{
+					// Partial ack, the next hole is lost as well (NewReno
+					// of RFC 6582), which is retransmitted at once
+					struct tcp_tx_seg *seg = tcp_txq_first(tsk);
+					if (seg && !(seg->state & TCP_SEG_RETRANS))
+					{
+						tcp_retransmit(tsk, seg);
+					}
+				}
+				else if (greater_or_equal_32b(cb->ack, tsk->recovery_point))
+				{
+					// Full ack
+					tsk->cong_state = open;
+					if (!tsk->sack_ok)
+						tsk->sacked_out = 0;
+					tcp_cong_end_recovery(tsk);
+					tcp_rack_recovered(tsk);
+					// log(DEBUG, "Congestion state: open");
+				}
+			}
+			// the window follows the data delivered in recovery, including
+			// the ack starting it
+			if (tsk->cong_state == fast_recovery)
+				tcp_cong_prr(tsk, tsk->delivered - tsk->rs.start_delivered);
+			// the window (and the pacing rate) is set by the rate sample of
+			// the ack, once the state of recovery is known
+			tcp_cong_control(tsk);
+		}
+		tcp_update_window_safe(tsk, cb);
+	}
 	if (tsk->state == TCP_LAST_ACK)
 	{
-		if (cb->flags == TCP_ACK)
+		// FIN is acked, along with the data before it
+		if (tsk->snd_una == tsk->snd_nxt)
 		{
 			log(DEBUG, "Received last TCP_ACK, close connection");
 			tsk->state = TCP_CLOSED;
@@ -144,7 +700,7 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 	}
 	if (tsk->state == TCP_FIN_WAIT_1)
 	{
-		if (cb->flags & TCP_ACK)
+		if (tsk->snd_una == tsk->snd_nxt)
 		{
 			log(DEBUG, "Receied TCP_ACK in state TCP_FIN_WATI_1, switched to TCP_FIN_WAIT_2");
 			tsk->state = TCP_FIN_WAIT_2;
@@ -156,7 +712,6 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 		{
 			tsk->state = TCP_TIME_WAIT;
 			tsk->rcv_nxt = cb->seq_end;
-			tsk->snd_una = max(tsk->snd_una, cb->ack);
 			tcp_send_control_packet(tsk, TCP_ACK);
 			log(DEBUG, "Switched to TIME_WAIT state");
 			tcp_set_timewait_timer(tsk);
@@ -164,84 +719,26 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 	}
 	if (tsk->state == TCP_ESTABLISHED)
 	{
-		tcp_update_window_safe(tsk, cb);
-		// Congestion management
-		if (cb->flags & TCP_ACK)
-		{
-			if (tsk->cong_state == open)
-			{
-				if (tsk->cwnd < tsk->ssthresh)
-				{
-					tsk->cwnd += 1;
-					log_cwnd_update(tsk->cwnd, tsk->ssthresh);
-				}
-				else
-				{
-					tsk->cong_avoid_ack += cb->ack - tsk->snd_una;
-					if (tsk->cong_avoid_ack >= tsk->cwnd * TCP_DEFAULT_MSS)
-					{
-						tsk->cong_avoid_ack = 0;
-						tsk->cwnd += 1;
-						log_cwnd_update(tsk->cwnd, tsk->ssthresh);
-					}
-				}
-				if (cb->ack == tsk->snd_una)
-				{
-					tsk->dup_ack += 1;
-				}
-				if (tsk->dup_ack >= 3)
-				{
-					tsk->ssthresh = max(1, tsk->cwnd / 2);
-					tsk->cwnd = tsk->ssthresh;
-					tsk->dup_ack = 0;
-					log_cwnd_update(tsk->cwnd, tsk->ssthresh);
-					tsk->cong_state = fast_recovery;
-					// log(DEBUG, "Fast recovery. Current cwnd=%u", tsk->cwnd);
-					tsk->recovery_point = tsk->snd_nxt;
-				}
-			}
-			else if (tsk->cong_state == fast_recovery)
-			{
-				// Fast recovery
-				if (cb->ack == tsk->snd_una)
-				{
-					tsk->cwnd += 1;
-					log_cwnd_update(tsk->cwnd, tsk->ssthresh);
-				}
-				else if (cb->ack > tsk->snd_una && cb->ack < tsk->recovery_point)
-				{
-					// Partial ack. Retransmission
-					struct pended_packet *ppkt = NULL;
-					list_for_each_entry(ppkt, &tsk->send_buf, list)
-					{
-						if (ppkt->seq == cb->ack)
-						{
-							char *packet = (char *)malloc(ppkt->len);
-							if (packet == NULL)
-							{
-								log(ERROR, "Malloc failed during %s", __FUNCTION__);
-								exit(-1);
-							}
-							memcpy(packet, ppkt->packet, ppkt->len);
-							ip_send_packet(packet, ppkt->len);
-						}
-					}
-				}
-				else if (cb->ack == tsk->recovery_point)
-				{
-					// Full ack
-					tsk->cong_state = open;
-					// log(DEBUG, "Congestion state: open");
-				}
-			}
-		}
+		// the segment out of order, or filling a hole, is acked at once,
+		// which lets the peer detect and recover the loss quickly
+		int ofo = tsk->rcv_nxt != cb->seq || !rb_empty_root(&tsk->rcv_ofo);
+		if (ofo)
+			tsk->quick_acks = TCP_QUICK_ACKS;
 		// Receiving possibly out-of-order packets
 		if (tsk->rcv_nxt == cb->seq)
 		{
 			// in-order receive
 
+			// the data sent beyond the window, which is never retracted, is
+			// dropped and sent again
+			if (cb->pl_len > tsk->rcv_wnd)
+			{
+				cb->pl_len = tsk->rcv_wnd;
+				cb->seq_end = cb->seq + cb->pl_len;
+				cb->flags &= ~TCP_FIN;
+			}
+
 			tsk->rcv_nxt = cb->seq_end;
-			tsk->rcv_wnd -= cb->pl_len;
 
 			if (cb->flags & TCP_FIN)
 			{
@@ -259,128 +756,33 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 
 				// You have to write buffer only if size > 0, cause there
 				// might be empty ACK packet.
+				// rcv_wnd is given back by tcp_sock_read, under the same lock
 				if (size > 0)
 				{
 					pthread_mutex_lock(&tsk->rcv_buf_lock);
+					tsk->rcv_wnd -= size;
 					write_ring_buffer(tsk->rcv_buf, data, size);
 					pthread_mutex_unlock(&tsk->rcv_buf_lock);
 				}
-				// Check if there are already received following packets
-				struct pended_packet *ppkt = NULL, *tmp_ppkt = NULL;
-				list_for_each_entry_safe(ppkt, tmp_ppkt, &tsk->rcv_ofo_buf, list)
-				{
-					if (ppkt->seq == tsk->rcv_nxt)
-					{
-						// log(DEBUG, "Removing sequential packet into ring buffer. %u-%d", cb->seq, ppkt->seq);
-
-						struct iphdr *ip = (struct iphdr *)packet_to_ip_hdr(ppkt->packet);
-						struct tcphdr *tcp = (struct tcphdr *)((char *)ip + IP_HDR_SIZE(ip));
-						size = (int)ntohs(ip->tot_len) - (int)IP_HDR_SIZE(ip) - (int)TCP_HDR_SIZE(tcp);
-						data = (char *)tcp + tcp->off * 4;
-						tsk->rcv_nxt = ppkt->seq_end;
-						tsk->rcv_wnd -= size;
-						if (size > 0)
-						{
-							pthread_mutex_lock(&tsk->rcv_buf_lock);
-							write_ring_buffer(tsk->rcv_buf, data, size);
-							pthread_mutex_unlock(&tsk->rcv_buf_lock);
-						}
-						list_delete_entry(&ppkt->list);
-						free(ppkt->packet);
-						free(ppkt);
-					}
-					else if (ppkt->seq < tsk->rcv_nxt)
-					{
-						log(ERROR, "Abnormal ofo queue.");
-						list_delete_entry(&ppkt->list);
-						free(ppkt->packet);
-						free(ppkt);
-					}
-					else
-					{
-						break;
-					}
-				}
+				// the data received out of order behind the segment is
+				// already in rcv_buf
+				tcp_ofo_deliver(tsk);
+				if (size > 0)
+					tcp_rcv_space_adjust(tsk);
 
 				// Woken wait won't be woken up again
 				wake_up(tsk->wait_recv);
 				// tcp_send_control_packet(tsk, TCP_ACK);
 			}
 		}
-		else if (tsk->rcv_nxt < cb->seq && tsk->rcv_nxt + (u32)tsk->rcv_wnd - 1 > cb->seq_end)
+		else if (greater_than_32b(cb->seq, tsk->rcv_nxt) &&
+				 less_or_equal_32b(cb->seq_end, tsk->rcv_nxt + tsk->rcv_wnd))
 		{
 			// out of order receive
 			if (cb->flags & TCP_ACK)
 			{
 				// log(DEBUG, "Received an out-of-order packet. Packet loss may occur.");
-				struct pended_packet *ppkt = (struct pended_packet *)malloc(sizeof(struct pended_packet));
-				if (ppkt == NULL)
-				{
-					log(ERROR, "Malloc failed during %s", __FUNCTION__);
-					exit(-1);
-				}
-				struct iphdr *ip = packet_to_ip_hdr(packet);
-				ppkt->len = (u32)ETHER_HDR_SIZE + (u32)ntohs(ip->tot_len);
-				ppkt->seq = cb->seq;
-				ppkt->seq_end = cb->seq_end;
-				ppkt->packet = malloc(ppkt->len);
-				if (ppkt->packet == NULL)
-				{
-					log(ERROR, "Malloc failed during %s", __FUNCTION__);
-					exit(-1);
-				}
-				memcpy(ppkt->packet, packet, ppkt->len);
-				// Insert this packet into out of order packet buffer
-				struct pended_packet *true_head =
-					list_entry(tsk->rcv_ofo_buf.next, struct pended_packet, list);
-				struct pended_packet *true_tail =
-					list_entry(tsk->rcv_ofo_buf.prev, struct pended_packet, list);
-				if (list_empty(&tsk->rcv_ofo_buf))
-				{
-					list_add_head(&ppkt->list, &tsk->rcv_ofo_buf);
-				}
-				else if (true_head == true_tail)
-				{
-					if (ppkt->seq_end < true_head->seq)
-					{
-						list_add_head(&ppkt->list, &tsk->rcv_ofo_buf);
-					}
-					else if (ppkt->seq_end > true_head->seq)
-					{
-						list_add_tail(&ppkt->list, &tsk->rcv_ofo_buf);
-					}
-				}
-				else
-				{
-					if (ppkt->seq < true_head->seq)
-					{
-						list_add_head(&ppkt->list, &tsk->rcv_ofo_buf);
-					}
-					else if (ppkt->seq > true_tail->seq)
-					{
-						list_add_tail(&ppkt->list, &tsk->rcv_ofo_buf);
-					}
-					else
-					{
-						struct pended_packet *cur =
-							list_entry(true_head->list.next, struct pended_packet, list);
-						struct pended_packet *nxt = NULL;
-						while (cur != true_tail)
-						{
-							nxt = list_entry(cur->list.next, struct pended_packet, list);
-							if (ppkt->seq == cur->seq || ppkt->seq == nxt->seq)
-							{
-								break;
-							}
-							if (ppkt->seq > cur->seq && ppkt->seq < nxt->seq)
-							{
-								list_insert(&ppkt->list, &cur->list, &nxt->list);
-								break;
-							}
-							cur = nxt;
-						}
-					}
-				}
+				tcp_ofo_queue(tsk, cb);
 			}
 		}
 		else
@@ -390,10 +792,24 @@ void tcp_process(struct tcp_sock *tsk, struct tcp_cb *cb, char *packet)
 			 * Others are out of receiving window so are dropped.
 			 */
 			// log(DEBUG, "Redundant retransmission for ofo packets.");
+			if (cb->pl_len > 0 && less_than_32b(cb->seq, tsk->rcv_nxt))
+				tcp_dsack_set(tsk, cb->seq, less_than_32b(cb->seq_end, tsk->rcv_nxt) ?
+							  cb->seq_end : tsk->rcv_nxt);
 		}
-		if (cb->pl_len || (cb->flags & (TCP_FIN | TCP_SYN)))
+		// the acked data and the opened window let more data go, whatever
+		// the segment carrying the ack
+		if (cb->flags & TCP_ACK)
+			tcp_push(tsk, 0);
+		// the segment received before (e.g. a window probe) is acked at once
+		if (cb->pl_len || (cb->flags & (TCP_FIN | TCP_SYN)) ||
+			less_than_32b(cb->seq, tsk->rcv_nxt))
 		{
-			tcp_send_control_packet(tsk, TCP_ACK);
+			tcp_send_ack(tsk, ofo || (cb->flags & (TCP_FIN | TCP_SYN)));
 		}
 	}
+	else if ((cb->flags & TCP_ACK) && tcp_sock_sending(tsk))
+	{
+		// the data left by *close*
+		tcp_push(tsk, 0);
+	}
 }
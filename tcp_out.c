@@ -2,6 +2,7 @@
 #include "tcp_sock.h"
 #include "ip.h"
 #include "ether.h"
+#include "pktbuf.h"
 
 #include "log.h"
 #include "list.h"
@@ -9,6 +10,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
 // initialize tcp header according to the arguments
 static void tcp_init_hdr(struct tcphdr *tcp, u16 sport, u16 dport, u32 seq, u32 ack,
 						 u8 flags, u16 rwnd)
@@ -24,123 +29,675 @@ static void tcp_init_hdr(struct tcphdr *tcp, u16 sport, u16 dport, u32 seq, u32
 	tcp->rwnd = htons(rwnd);
 }
 
-// send a tcp packet
-//
-// Given that the payload of the tcp packet has been filled, initialize the tcp
-// header and ip header (remember to set the checksum in both header), and emit
-// the packet by calling ip_send_packet.
-void tcp_send_packet(struct tcp_sock *tsk, char *packet, int len)
+// the sequence number of the first byte in snd_buf
+static inline u32 tcp_snd_buf_seq(struct tcp_sock *tsk)
 {
-	struct iphdr *ip = packet_to_ip_hdr(packet);
-	struct tcphdr *tcp = (struct tcphdr *)((char *)ip + IP_BASE_HDR_SIZE);
-
-	int ip_tot_len = len - ETHER_HDR_SIZE;
-	int tcp_data_len = ip_tot_len - IP_BASE_HDR_SIZE - TCP_BASE_HDR_SIZE;
-
-	u32 saddr = tsk->sk_sip;
-	u32 daddr = tsk->sk_dip;
-	u16 sport = tsk->sk_sport;
-	u16 dport = tsk->sk_dport;
-
-	u32 seq = tsk->snd_nxt;
-	u32 ack = tsk->rcv_nxt;
-	u16 rwnd = tsk->rcv_wnd;
+	return tsk->write_seq - ring_buffer_used(tsk->snd_buf);
+}
 
-	tcp_init_hdr(tcp, sport, dport, seq, ack, TCP_PSH | TCP_ACK, rwnd);
-	ip_init_hdr(ip, saddr, daddr, ip_tot_len, IPPROTO_TCP);
+// the blocks of the data received out of order, the one holding the latest
+// segment first, followed by the others in order of sequence number (RFC 2018),
+// and the data received again in front of them, if any (RFC 2883)
+static int tcp_sack_blocks(struct tcp_sock *tsk, struct tcp_sack_block *blocks, int max)
+{
+	int n = 0;
+	if (tsk->rcv_dsack && max > 0)
+	{
+		blocks[0].start = tsk->rcv_dsack_seq;
+		blocks[0].end = tsk->rcv_dsack_seq_end;
+		n = 1;
+	}
 
-	tcp->checksum = tcp_checksum(ip, tcp);
+	int latest = n;
+	struct rb_node *node = tsk->rcv_ofo.rb_node;
+	while (node && n < max)
+	{
+		struct tcp_ofo_range *r = rb_entry(node, struct tcp_ofo_range, node);
+		if (less_than_32b(tsk->rcv_ofo_seq, r->seq))
+			node = node->left;
+		else if (greater_or_equal_32b(tsk->rcv_ofo_seq, r->seq_end))
+			node = node->right;
+		else
+		{
+			blocks[n].start = r->seq;
+			blocks[n].end = r->seq_end;
+			n += 1;
+			break;
+		}
+	}
 
-	ip->checksum = ip_checksum(ip);
+	for (node = rb_first(&tsk->rcv_ofo); node && n < max; node = rb_next(node))
+	{
+		struct tcp_ofo_range *r = rb_entry(node, struct tcp_ofo_range, node);
+		if (n > latest && r->seq == blocks[latest].start)
+			continue;
+		blocks[n].start = r->seq;
+		blocks[n].end = r->seq_end;
+		n += 1;
+	}
 
-	tsk->snd_nxt += tcp_data_len;
-	tsk->snd_wnd -= tcp_data_len;
+	return n;
+}
 
-	// Add packet to unacked packet buffer
+// write the options of a segment carrying len bytes of data, i.e. mss, sack
+// permitted and window scale in SYN, timestamps in every segment once agreed
+// on (and in SYN to offer them), and sack blocks in the others as long as the
+// segment fits in mss
+//
+// Return the length of the options, which is a multiple of 4.
+static int tcp_write_options(struct tcp_sock *tsk, u8 flags, int len, u8 *opt)
+{
+	int opt_len = 0;
+	if (flags & TCP_SYN)
+	{
+		opt[0] = TCP_OPT_MSS;
+		opt[1] = TCP_OPT_MSS_LEN;
+		opt[2] = TCP_MSS >> 8;
+		opt[3] = TCP_MSS & 0xff;
+		opt_len = TCP_OPT_MSS_LEN;
+		if (tsk->sack_ok)
+		{
+			opt[4] = TCP_OPT_NOP;
+			opt[5] = TCP_OPT_NOP;
+			opt[6] = TCP_OPT_SACK_PERM;
+			opt[7] = TCP_OPT_SACK_PERM_LEN;
+			opt_len += 4;
+		}
+		if (tsk->wscale_ok)
+		{
+			opt[opt_len] = TCP_OPT_NOP;
+			opt[opt_len + 1] = TCP_OPT_WSCALE;
+			opt[opt_len + 2] = TCP_OPT_WSCALE_LEN;
+			opt[opt_len + 3] = tsk->rcv_wscale;
+			opt_len += 4;
+		}
+	}
 
-	// Already set timer won't be set again
-	tcp_set_retrans_timer(tsk);
-	struct pended_packet *ppkt = (struct pended_packet *)malloc(sizeof(struct pended_packet));
-	if (ppkt == NULL)
+	if (tsk->ts_ok)
 	{
-		log(ERROR, "Malloc failed during %s", __FUNCTION__);
-		return;
+		opt[opt_len] = TCP_OPT_NOP;
+		opt[opt_len + 1] = TCP_OPT_NOP;
+		opt[opt_len + 2] = TCP_OPT_TS;
+		opt[opt_len + 3] = TCP_OPT_TS_LEN;
+		u32 ts[2] = { htonl(tcp_ts_now()), htonl(tsk->ts_recent) };
+		memcpy(opt + opt_len + 4, ts, sizeof(ts));
+		opt_len += TCP_OPT_TS_SPACE;
 	}
-	ppkt->len = len;
-	ppkt->seq = seq;
-	ppkt->seq_end = tsk->snd_nxt;
-	ppkt->packet = malloc(len);
-	if (ppkt->packet == NULL)
+
+	if (tsk->sack_ok && (tsk->rcv_dsack || !rb_empty_root(&tsk->rcv_ofo)) &&
+		(flags & TCP_ACK) && !(flags & TCP_SYN))
 	{
-		log(ERROR, "Malloc failed during %s", __FUNCTION__);
-		return;
+		// 3 blocks fit along with the timestamps
+		struct tcp_sack_block blocks[TCP_MAX_SACKS];
+		int room = TCP_MAX_OPT_LEN - opt_len;
+		if (len > 0)
+			room = min(room, tsk->mss - len);
+		int n = tcp_sack_blocks(tsk, blocks, min((room - 4) / 8, TCP_MAX_SACKS));
+		if (n > 0)
+		{
+			u8 *sack = opt + opt_len;
+			sack[0] = TCP_OPT_NOP;
+			sack[1] = TCP_OPT_NOP;
+			sack[2] = TCP_OPT_SACK;
+			sack[3] = 2 + n * 8;
+			for (int i = 0; i < n; i++)
+			{
+				u32 edges[2] = { htonl(blocks[i].start), htonl(blocks[i].end) };
+				memcpy(sack + 4 + i * 8, edges, sizeof(edges));
+			}
+			opt_len += 4 + n * 8;
+			// the duplicate is reported once
+			tsk->rcv_dsack = 0;
+		}
 	}
-	memcpy(ppkt->packet, packet, len);
-	pthread_mutex_lock(&tsk->send_buf_lock);
-	list_add_tail(&ppkt->list, &tsk->send_buf);
-	pthread_mutex_unlock(&tsk->send_buf_lock);
 
-	ip_send_packet(packet, len);
+	return opt_len;
 }
 
-// send a tcp control packet
+// the window in the header of a segment, which is not scaled in SYN, and the
+// right edge it advertises
 //
-// The control packet is like TCP_ACK, TCP_SYN, TCP_FIN (excluding TCP_RST).
-// All these packets do not have payload and the only difference among these is
-// the flags.
-void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
+// The window offered is cut while rcv_buf shrinks, but the edge advertised
+// before is kept, since the peer may have sent the data up to it.
+static inline u16 tcp_window_field(struct tcp_sock *tsk, u8 flags)
 {
-	int pkt_size = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-	char *packet = malloc(pkt_size);
+	u32 wnd = tcp_rcv_wnd_offer(tsk);
+	if (greater_than_32b(tsk->rcv_adv, tsk->rcv_nxt))
+		wnd = max(wnd, tsk->rcv_adv - tsk->rcv_nxt);
+
+	u32 scale = (flags & TCP_SYN) ? 0 : tsk->rcv_wscale;
+	u32 field = min(wnd >> scale, TCP_MAX_WINDOW);
+	u32 edge = tsk->rcv_nxt + (field << scale);
+	if (greater_than_32b(edge, tsk->rcv_adv))
+		tsk->rcv_adv = edge;
+
+	return field;
+}
+
+// build a tcp packet carrying len bytes of snd_buf from seq, and emit it by
+// calling ip_send_packet
+//
+// The acknowledgement and the window are taken from tcp sock, thus they are
+// up to date even if the segment is retransmitted.
+static void tcp_send_segment(struct tcp_sock *tsk, u32 seq, int len, u8 flags)
+{
+	u8 opt[TCP_MAX_OPT_LEN];
+	int opt_len = tcp_write_options(tsk, flags, len, opt);
+	int hdr_len = TCP_BASE_HDR_SIZE + opt_len;
+	u16 tot_len = IP_BASE_HDR_SIZE + hdr_len + len;
+	char *packet = pktbuf_alloc(ETHER_HDR_SIZE + tot_len);
 	if (!packet)
 	{
-		log(ERROR, "malloc tcp control packet failed.");
+		log(ERROR, "allocate tcp packet failed.");
 		return;
 	}
 
 	struct iphdr *ip = packet_to_ip_hdr(packet);
 	struct tcphdr *tcp = (struct tcphdr *)((char *)ip + IP_BASE_HDR_SIZE);
 
-	u16 tot_len = IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-
 	ip_init_hdr(ip, tsk->sk_sip, tsk->sk_dip, tot_len, IPPROTO_TCP);
-	tcp_init_hdr(tcp, tsk->sk_sport, tsk->sk_dport, tsk->snd_nxt,
-				 tsk->rcv_nxt, flags, tsk->rcv_wnd);
+	tcp_init_hdr(tcp, tsk->sk_sport, tsk->sk_dport, seq, tsk->rcv_nxt,
+				 flags, tcp_window_field(tsk, flags));
+	if (opt_len)
+	{
+		memcpy((char *)tcp + TCP_BASE_HDR_SIZE, opt, opt_len);
+		tcp->off = TCP_HDR_OFFSET + opt_len / 4;
+	}
+
+	if (len > 0)
+		peek_ring_buffer(tsk->snd_buf, seq - tcp_snd_buf_seq(tsk),
+						 (char *)tcp + hdr_len, len);
 
 	tcp->checksum = tcp_checksum(ip, tcp);
-	u32 seq = tsk->snd_nxt;
-	if (flags & (TCP_SYN | TCP_FIN))
-		tsk->snd_nxt += 1;
 
-	// Add packet to unacked packet buffer
+	// any segment carrying ack acknowledges the data received so far
+	if (flags & TCP_ACK)
+		tsk->rcv_acked = tsk->rcv_nxt;
 
-	// Already set timer won't be set again
-	
-	if (flags & (TCP_SYN | TCP_FIN))
+	ip_send_packet(packet, ETHER_HDR_SIZE + tot_len);
+}
+
+// append the segment just sent to txq, which is doubled when it is full, the
+// retransmission timer is started by the caller (see tcp_send_loss_probe)
+static void tcp_txq_add(struct tcp_sock *tsk, u32 seq, u32 seq_end, u8 flags)
+{
+	if (tsk->txq_len == tsk->txq_size)
 	{
-		tcp_set_retrans_timer(tsk);
-		struct pended_packet *ppkt = (struct pended_packet *)malloc(sizeof(struct pended_packet));
-		if (ppkt == NULL)
+		int size = tsk->txq_size ? tsk->txq_size * 2 : TCP_TXQ_INIT_SIZE;
+		struct tcp_tx_seg *txq = malloc(size * sizeof(struct tcp_tx_seg));
+		if (txq == NULL)
 		{
 			log(ERROR, "Malloc failed during %s", __FUNCTION__);
 			exit(-1);
 		}
-		ppkt->len = pkt_size;
-		ppkt->seq = seq;
-		ppkt->seq_end = tsk->snd_nxt;
-		ppkt->packet = malloc(pkt_size);
-		if (ppkt->packet == NULL)
+		for (int i = 0; i < tsk->txq_len; i++)
+			txq[i] = *tcp_txq_seg(tsk, i);
+		free(tsk->txq);
+		tsk->txq = txq;
+		tsk->txq_head = 0;
+		tsk->txq_size = size;
+	}
+
+	struct tcp_tx_seg *seg = tcp_txq_seg(tsk, tsk->txq_len);
+	seg->seq = seq;
+	seg->seq_end = seq_end;
+	seg->flags = flags;
+	seg->state = 0;
+	seg->time = tcp_time_us();
+	tcp_rate_seg_sent(tsk, seg);
+	tsk->txq_len += 1;
+	tsk->snd_time = seg->time;
+	if (tsk->cong_state == fast_recovery)
+		tsk->prr_out += seq_end - seq;
+}
+
+// take bytes of the segment out of the scoreboard
+static inline void tcp_txq_untag(struct tcp_sock *tsk, struct tcp_tx_seg *seg, u32 bytes)
+{
+	if (seg->state & TCP_SEG_SACKED)
+		tsk->sacked_out -= bytes;
+	if (seg->state & TCP_SEG_LOST)
+		tsk->lost_out -= bytes;
+	if (seg->state & TCP_SEG_RETRANS)
+		tsk->retrans_out -= bytes;
+}
+
+// release the segments acked by the peer from txq, the segment acked in part
+// is cut down to the data not acked yet, and sample the rtt
+//
+// Return the number of segments released.
+int tcp_txq_ack(struct tcp_sock *tsk, u32 ack)
+{
+	int acked = 0, karn = 1;
+	tsk->ack_rtt = 0;
+	tsk->ack_orig = 0;
+	tcp_rate_ack_start(tsk);
+	u64 first_time = 0;
+	struct tcp_tx_seg *seg;
+	while ((seg = tcp_txq_first(tsk)) != NULL)
+	{
+		if (less_or_equal_32b(seg->seq_end, ack))
 		{
-			log(ERROR, "Malloc failed during %s", __FUNCTION__);
-			exit(-1);
+			if (acked == 0)
+				first_time = seg->time;
+			if (seg->state & TCP_SEG_EVER_RETRANS)
+				karn = 0;
+			if (!(seg->state & TCP_SEG_SACKED))
+			{
+				if (!(seg->state & TCP_SEG_EVER_RETRANS))
+					tsk->ack_orig = 1;
+				tcp_rate_seg_delivered(tsk, seg, tcp_seg_len(seg));
+				tcp_rack_advance(tsk, seg);
+			}
+			tcp_txq_untag(tsk, seg, tcp_seg_len(seg));
+			tsk->txq_head = (tsk->txq_head + 1) % tsk->txq_size;
+			tsk->txq_len -= 1;
+			acked += 1;
+			continue;
 		}
-		memcpy(ppkt->packet, packet, pkt_size);
-		pthread_mutex_lock(&tsk->send_buf_lock);
-		list_add_tail(&ppkt->list, &tsk->send_buf);
-		pthread_mutex_unlock(&tsk->send_buf_lock);
+
+		if (greater_than_32b(ack, seg->seq) && !(seg->flags & (TCP_SYN | TCP_FIN)))
+		{
+			if (!(seg->state & TCP_SEG_EVER_RETRANS))
+				tsk->ack_orig = 1;
+			tcp_rate_seg_delivered(tsk, seg, ack - seg->seq);
+			tcp_rack_advance(tsk, seg);
+			tcp_txq_untag(tsk, seg, ack - seg->seq);
+			seg->seq = ack;
+		}
+		break;
 	}
 
-	ip_send_packet(packet, pkt_size);
+	// the rtt of the oldest segment acked, unless the ack may be of a
+	// retransmission, otherwise the echoed timestamp tells which one is acked,
+	// in ms ticks, which is taken as one tick at least, since a sample below
+	// the real rtt would stay in min_rtt
+	if (acked && karn)
+		tsk->ack_rtt = max(tcp_time_us() - first_time, 1);
+	else if (acked && tsk->rx_tsecr)
+		tsk->ack_rtt = max(tcp_ts_now() - tsk->rx_tsecr, 1) * 1000;
+	if (tsk->ack_rtt)
+		tcp_rtt_update(tsk, tsk->ack_rtt);
+
+	return acked;
+}
+
+// tag the segments within the sack block [start, end) as sacked, which are
+// not counted in flight any more
+void tcp_txq_sack(struct tcp_sock *tsk, u32 start, u32 end)
+{
+	if (!less_than_32b(start, end) || greater_than_32b(end, tsk->snd_nxt))
+		return;
+
+	// the first segment from start on, txq is in order of sequence number
+	int lo = 0, hi = tsk->txq_len;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (less_than_32b(tcp_txq_seg(tsk, mid)->seq, start))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (int i = lo; i < tsk->txq_len; i++)
+	{
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		if (greater_than_32b(seg->seq_end, end))
+			break;
+		if (seg->state & TCP_SEG_SACKED)
+			continue;
+
+		if (!(seg->state & TCP_SEG_EVER_RETRANS))
+			tsk->ack_orig = 1;
+		tcp_rate_seg_delivered(tsk, seg, tcp_seg_len(seg));
+		tcp_rack_advance(tsk, seg);
+		tcp_txq_untag(tsk, seg, tcp_seg_len(seg));
+		seg->state = TCP_SEG_SACKED | (seg->state & TCP_SEG_EVER_RETRANS);
+		tsk->sacked_out += tcp_seg_len(seg);
+	}
+}
+
+// tag the segment as lost
+void tcp_txq_tag_lost(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	if (!(seg->state & (TCP_SEG_SACKED | TCP_SEG_LOST)))
+	{
+		seg->state |= TCP_SEG_LOST;
+		tsk->lost_out += tcp_seg_len(seg);
+		tsk->lost += tcp_seg_len(seg);
+	}
+}
+
+// the segments deemed lost are in flight again, along with the
+// retransmissions of them, once the losses turn out to be spurious
+void tcp_txq_untag_lost(struct tcp_sock *tsk)
+{
+	for (int i = 0; i < tsk->txq_len; i++)
+	{
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		if (seg->state & TCP_SEG_LOST)
+		{
+			tcp_txq_untag(tsk, seg, tcp_seg_len(seg));
+			seg->state &= ~(TCP_SEG_LOST | TCP_SEG_RETRANS);
+		}
+	}
+}
+
+// tag the holes below more than (TCP_DUPTHRESH - 1) * mss bytes sacked as lost
+// (IsLost of RFC 6675), they are retransmitted by tcp_push
+void tcp_txq_mark_lost(struct tcp_sock *tsk)
+{
+	u32 sacked_above = tsk->sacked_out;
+	for (int i = 0; i < tsk->txq_len; i++)
+	{
+		if (sacked_above <= (TCP_DUPTHRESH - 1) * tsk->mss)
+			break;
+
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		if (seg->state & TCP_SEG_SACKED)
+			sacked_above -= tcp_seg_len(seg);
+		else
+			tcp_txq_tag_lost(tsk, seg);
+	}
+}
+
+// tag all the segments not sacked as lost and not retransmitted, after the
+// retransmission timer fires
+void tcp_txq_mark_all_lost(struct tcp_sock *tsk)
+{
+	// the segments counted by duplicate acks are not known, see
+	// tcp_reno_sack_update
+	if (!tsk->sack_ok)
+		tsk->sacked_out = 0;
+	for (int i = 0; i < tsk->txq_len; i++)
+	{
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		tcp_txq_tag_lost(tsk, seg);
+		if (seg->state & TCP_SEG_RETRANS)
+		{
+			seg->state &= ~TCP_SEG_RETRANS;
+			tsk->retrans_out -= tcp_seg_len(seg);
+		}
+	}
+}
+
+// send the segment again, rebuilt from snd_buf
+static void tcp_resend(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	seg->state |= TCP_SEG_EVER_RETRANS;
+	seg->time = tcp_time_us();
+	tcp_rate_seg_sent(tsk, seg);
+	tsk->total_retrans += 1;
+	if (tsk->cong_state == fast_recovery)
+		tsk->prr_out += tcp_seg_len(seg);
+	// the retransmissions since the window is reduced, which are undone
+	// once D-SACK reports them all, see tcp_undo_mark
+	if (tsk->prior_cwnd)
+	{
+		tsk->undo_retrans += tcp_seg_len(seg);
+		if (!tsk->retrans_stamp)
+			tsk->retrans_stamp = max(tcp_ts_now(), 1);
+	}
+
+	int len = tcp_seg_len(seg) - ((seg->flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+	tcp_send_segment(tsk, seg->seq, len, seg->flags);
+}
+
+// retransmit the segment deemed lost, which is in flight again
+void tcp_retransmit(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	tcp_txq_tag_lost(tsk, seg);
+	if (!(seg->state & TCP_SEG_RETRANS))
+	{
+		seg->state |= TCP_SEG_RETRANS;
+		tsk->retrans_out += tcp_seg_len(seg);
+	}
+
+	tcp_resend(tsk, seg);
+}
+
+// probe the tail once the acks stop coming back before the retransmission
+// timeout, by a segment beyond the window: new data if any, otherwise the last
+// segment sent again, whose ack tells the losses at the tail by sack
+// (TLP of RFC 8985)
+void tcp_send_loss_probe(struct tcp_sock *tsk)
+{
+	u32 len = min(tsk->write_seq - tsk->snd_nxt, tsk->mss);
+	if (less_than_32b(tsk->snd_nxt, tsk->write_seq) &&
+		!greater_than_32b(tsk->snd_nxt + len, tsk->snd_una + tsk->adv_wnd))
+	{
+		tcp_send_segment(tsk, tsk->snd_nxt, len, TCP_PSH | TCP_ACK);
+		tcp_txq_add(tsk, tsk->snd_nxt, tsk->snd_nxt + len, TCP_PSH | TCP_ACK);
+		tsk->snd_nxt += len;
+		tsk->tlp_retrans = 0;
+	}
+	else
+	{
+		struct tcp_tx_seg *seg = tsk->txq_len ? tcp_txq_seg(tsk, tsk->txq_len - 1) : NULL;
+		if (!seg || (seg->state & TCP_SEG_SACKED))
+			return;
+		tcp_resend(tsk, seg);
+		tsk->tlp_retrans = 1;
+	}
+
+	tsk->tlp_high_seq = tsk->snd_nxt;
+	tsk->tlp_probes += 1;
+}
+
+// whether the next segment is held by pacing, it is sent by the pacing timer
+// once due
+static inline int tcp_pacing_hold(struct tcp_sock *tsk)
+{
+	if (!tsk->pacing_rate || tsk->pacing_time <= tcp_time_us())
+		return 0;
+
+	tcp_set_pacing_timer(tsk, tsk->pacing_time);
+	return 1;
+}
+
+// the segment of len bytes sent takes its time at the pacing rate, the time
+// left unused lets up to TCP_PACING_BURST of data go at once, which makes up
+// for the pacing timer waking up late
+static inline void tcp_pacing_sent(struct tcp_sock *tsk, u32 len)
+{
+	if (!tsk->pacing_rate)
+		return;
+
+	u64 now = tcp_time_us();
+	u64 start = max(tsk->pacing_time, now - min(now, TCP_PACING_BURST));
+	tsk->pacing_time = start + (u64)len * 1000000 / tsk->pacing_rate;
+}
+
+// retransmit the segments deemed lost as the window and pacing allow, before
+// any new data (NextSeg of RFC 6675)
+static void tcp_retransmit_lost(struct tcp_sock *tsk)
+{
+	for (int i = 0; i < tsk->txq_len && tsk->retrans_out < tsk->lost_out; i++)
+	{
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		if ((seg->state & (TCP_SEG_LOST | TCP_SEG_RETRANS)) != TCP_SEG_LOST)
+			continue;
+		if (tcp_seg_len(seg) > tsk->snd_wnd || tcp_pacing_hold(tsk))
+			break;
+
+		tcp_retransmit(tsk, seg);
+		tsk->snd_wnd -= tcp_seg_len(seg);
+		tcp_pacing_sent(tsk, tcp_seg_len(seg));
+	}
+}
+
+// send FIN once the data is all sent, and switch the state for *close*
+static void tcp_send_fin(struct tcp_sock *tsk)
+{
+	tsk->snd_fin = 0;
+	tcp_send_control_packet(tsk, TCP_FIN | TCP_ACK);
+	switch (tsk->state)
+	{
+	case TCP_ESTABLISHED:
+		tsk->state = TCP_FIN_WAIT_1;
+		break;
+	case TCP_CLOSE_WAIT:
+		tsk->state = TCP_LAST_ACK;
+		break;
+	case TCP_CLOSED:
+		break;
+
+	default:
+		log(ERROR, "Not implemented state while %s", __FUNCTION__);
+		break;
+	}
+}
+
+// send the data in snd_buf from snd_nxt on, as many segments of mss bytes as
+// the window allows, followed by FIN if *close* is called; the segments deemed
+// lost are retransmitted first
+//
+// With a pacing rate set by the congestion control, the segments are spread
+// over time, the rest are held until the pacing timer pushes them again.
+//
+// A partial segment is sent only if Nagle's algorithm and cork allow it, i.e.
+// the socket is not corked, and either nodelay is set or all the data sent is
+// acked, unless flush is set or the socket is closed.
+//
+// Return the number of segments sent.
+int tcp_push(struct tcp_sock *tsk, int flush)
+{
+	int segs = 0;
+	flush |= tsk->snd_fin;
+	// F-RTO sends new data instead, whose acks tell whether the timeout is
+	// spurious
+	if (tsk->retrans_out < tsk->lost_out && tsk->frto != 2)
+		tcp_retransmit_lost(tsk);
+
+	while (less_than_32b(tsk->snd_nxt, tsk->write_seq))
+	{
+		int len = min(tsk->write_seq - tsk->snd_nxt, tsk->mss);
+		if (len > tsk->snd_wnd)
+			break;
+		if (greater_than_32b(tsk->snd_nxt + len, tsk->snd_una + tsk->adv_wnd))
+		{
+			// the window may open without any ack to tell, if the update
+			// from the peer is lost
+			if (tsk->txq_len == 0)
+				tcp_set_persist_timer(tsk);
+			break;
+		}
+
+		if (len < tsk->mss && !flush &&
+			(tsk->cork || (!tsk->nodelay && tsk->snd_una != tsk->snd_nxt)))
+			break;
+
+		if (tcp_pacing_hold(tsk))
+			break;
+
+		// the window may restart after idle, which is the whole of snd_wnd
+		// with nothing in flight
+		if (tsk->snd_una == tsk->snd_nxt)
+		{
+			tcp_cong_tx_start(tsk);
+			tsk->snd_wnd = min(tsk->snd_wnd, tsk->cwnd);
+		}
+
+		tcp_send_segment(tsk, tsk->snd_nxt, len, TCP_PSH | TCP_ACK);
+		tcp_txq_add(tsk, tsk->snd_nxt, tsk->snd_nxt + len, TCP_PSH | TCP_ACK);
+		tcp_set_retrans_timer(tsk);
+		tsk->snd_nxt += len;
+		tsk->snd_wnd -= len;
+		tcp_pacing_sent(tsk, len);
+		segs += 1;
+	}
+
+	if (tsk->snd_fin && tsk->snd_nxt == tsk->write_seq)
+		tcp_send_fin(tsk);
+
+	tcp_rate_check_app_limited(tsk);
+
+	return segs;
+}
+
+// copy the data into snd_buf as long as there is room, and send what is allowed
+//
+// Return the bytes taken from buf, which is 0 if snd_buf is full.
+int tcp_send_data(struct tcp_sock *tsk, char *buf, int len)
+{
+	int n = min(len, ring_buffer_free(tsk->snd_buf));
+	if (n > 0)
+	{
+		write_ring_buffer(tsk->snd_buf, buf, n);
+		tsk->write_seq += n;
+		tcp_push(tsk, 0);
+	}
+
+	return n;
+}
+
+// release the data acked by the peer from snd_buf, and notify the writers
+// waiting for room (wait_send)
+void tcp_clean_snd_buf(struct tcp_sock *tsk, u32 ack)
+{
+	int used = ring_buffer_used(tsk->snd_buf);
+	u32 seq = tsk->write_seq - used;
+	// the ack of FIN is one byte beyond the data
+	if (!greater_than_32b(ack, seq) || greater_than_32b(ack, tsk->write_seq + 1))
+		return;
+
+	drop_ring_buffer(tsk->snd_buf, min(ack - seq, used));
+	wake_up(tsk->wait_send);
+}
+
+// send a tcp control packet
+//
+// The control packet is like TCP_ACK, TCP_SYN, TCP_FIN (excluding TCP_RST).
+// All these packets do not have payload and the only difference among these is
+// the flags.
+void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
+{
+	u32 seq = tsk->snd_nxt;
+	tcp_send_segment(tsk, seq, 0, flags);
+
+	// SYN and FIN take a sequence number, and are retransmitted until acked
+	if (flags & (TCP_SYN | TCP_FIN))
+	{
+		tsk->snd_nxt += 1;
+		tcp_txq_add(tsk, seq, tsk->snd_nxt, flags);
+		tcp_set_retrans_timer(tsk);
+	}
+
+	// the data written follows SYN
+	if (flags & TCP_SYN)
+		tsk->write_seq = tsk->snd_nxt;
+}
+
+// acknowledge the data received, delayed as RFC 1122 allows
+//
+// The ack is sent at once if quick is set (e.g. out-of-order segments and
+// FIN), during the quick ack mode, or if two full segments are not acked yet.
+// Otherwise it is sent by the delayed ack timer, unless data is sent in the
+// meantime and carries it.
+void tcp_send_ack(struct tcp_sock *tsk, int quick)
+{
+	u32 unacked = tsk->rcv_nxt - tsk->rcv_acked;
+	if (!quick && !unacked)
+		return;
+
+	if (quick || tsk->quick_acks > 0 || !ustack_conf.tcp_delack ||
+		unacked >= 2 * tsk->mss)
+	{
+		if (tsk->quick_acks > 0)
+			tsk->quick_acks -= 1;
+		tcp_send_control_packet(tsk, TCP_ACK);
+		return;
+	}
+
+	tcp_set_delack_timer(tsk);
+}
+
+// probe the window of the peer by a segment it has received, which it answers
+// with an ack carrying the window
+void tcp_send_probe(struct tcp_sock *tsk)
+{
+	tcp_send_segment(tsk, tsk->snd_una - 1, 0, TCP_ACK);
 }
 
 // send tcp reset packet
@@ -150,10 +707,10 @@ void tcp_send_control_packet(struct tcp_sock *tsk, u8 flags)
 void tcp_send_reset(struct tcp_cb *cb)
 {
 	int pkt_size = ETHER_HDR_SIZE + IP_BASE_HDR_SIZE + TCP_BASE_HDR_SIZE;
-	char *packet = malloc(pkt_size);
+	char *packet = pktbuf_alloc(pkt_size);
 	if (!packet)
 	{
-		log(ERROR, "malloc tcp control packet failed.");
+		log(ERROR, "allocate tcp control packet failed.");
 		return;
 	}
 
@@ -0,0 +1,136 @@
+#include "tcp.h"
+#include "tcp_sock.h"
+#include "tcp_timer.h"
+
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+// RACK (RFC 8985), a segment is deemed lost once a segment sent after it is
+// delivered, and its rtt plus a reordering window have passed since it is
+// sent, instead of counting the duplicate acks or the sacks above it. Thus the
+// retransmissions lost are detected as well, and so are the losses at the
+// tail, once the tail loss probe (see tcp_send_loss_probe) is sacked.
+//
+// The segments are sent in order of sequence number, but the retransmissions,
+// thus the one sent last of two is told by the time, then by the end.
+
+static inline int tcp_rack_sent_after(u64 t1, u32 seq1, u64 t2, u32 seq2)
+{
+	return t1 > t2 || (t1 == t2 && greater_than_32b(seq1, seq2));
+}
+
+// the segment is acked or sacked for the first time
+void tcp_rack_advance(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	// a segment delivered below the highest one delivered, without being
+	// retransmitted, is reordered by the path
+	if (!tsk->rack_xmit_time || greater_than_32b(seg->seq_end, tsk->rack_fack))
+		tsk->rack_fack = seg->seq_end;
+	else if (less_than_32b(seg->seq_end, tsk->rack_fack) &&
+			 !(seg->state & TCP_SEG_EVER_RETRANS))
+		tsk->rack_reordering_seen = 1;
+
+	// the ack of a retransmission may be of the segment sent before, unless
+	// the timestamp echoed is not older than the retransmission, or the rtt
+	// is not shorter than any
+	u32 rtt = tcp_time_us() - seg->time;
+	if (seg->state & TCP_SEG_EVER_RETRANS)
+	{
+		if ((tsk->ts_ok && tsk->rx_tsecr) ?
+			less_than_32b(tsk->rx_tsecr, seg->time / 1000) : rtt < tsk->min_rtt)
+			return;
+	}
+
+	if (!tsk->rack_xmit_time || tcp_rack_sent_after(seg->time, seg->seq_end,
+													tsk->rack_xmit_time,
+													tsk->rack_end_seq))
+	{
+		tsk->rack_xmit_time = seg->time;
+		tsk->rack_end_seq = seg->seq_end;
+		tsk->rack_rtt = rtt;
+		tsk->rack_advanced = 1;
+	}
+}
+
+// the delivery later than the rtt tells a reordering, otherwise the losses are
+// detected at once in recovery, or once the sacks tell them like duplicate
+// acks do, and a quarter of min rtt (times the multiplier grown by D-SACK) is
+// waited for otherwise
+static inline u32 tcp_rack_reo_wnd(struct tcp_sock *tsk)
+{
+	if (!tsk->rack_reordering_seen &&
+		(tsk->cong_state != open || tsk->sacked_out >= TCP_DUPTHRESH * tsk->mss))
+		return 0;
+	return min((u64)tsk->min_rtt / 4 * tsk->rack_reo_wnd_mult, tsk->srtt);
+}
+
+#define TCP_RACK_REO_WND_PERSIST 16
+
+// a D-SACK tells a spurious retransmission, i.e. the reordering is longer than
+// the window, which grows by a quarter of min rtt at most once a round trip,
+// and lasts for the next 16 recoveries (RFC 8985)
+void tcp_rack_dsack(struct tcp_sock *tsk)
+{
+	tsk->rack_reordering_seen = 1;
+	if (tsk->rack_dsack_round && less_than_32b(tsk->snd_una, tsk->rack_dsack_round))
+		return;
+	tsk->rack_reo_wnd_mult += 1;
+	tsk->rack_dsack_round = tsk->snd_nxt;
+	tsk->rack_reo_wnd_persist = TCP_RACK_REO_WND_PERSIST;
+}
+
+// the recovery ends, the window grown by D-SACK lasts for fewer recoveries
+void tcp_rack_recovered(struct tcp_sock *tsk)
+{
+	if (tsk->rack_reo_wnd_persist && --tsk->rack_reo_wnd_persist == 0)
+		tsk->rack_reo_wnd_mult = 1;
+}
+
+// the segment, or the retransmission of it, is lost, which is retransmitted
+// by tcp_push
+static void tcp_rack_mark_lost(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	if (seg->state & TCP_SEG_RETRANS)
+	{
+		seg->state &= ~TCP_SEG_RETRANS;
+		tsk->retrans_out -= tcp_seg_len(seg);
+		tsk->lost += tcp_seg_len(seg);
+	}
+	else
+		tcp_txq_tag_lost(tsk, seg);
+	tsk->rack_lost += 1;
+}
+
+// tag the segments sent before the one delivered last as lost, once its rtt
+// and the reordering window have passed since they are sent
+//
+// Return the time (in micro second) until the next one may be deemed lost,
+// which is checked again by the reordering timer, 0 if none.
+u32 tcp_rack_detect_loss(struct tcp_sock *tsk)
+{
+	u64 now = tcp_time_us(), timeout = 0;
+	u32 reo_wnd = tcp_rack_reo_wnd(tsk);
+	tsk->rack_advanced = 0;
+	for (int i = 0; i < tsk->txq_len; i++)
+	{
+		struct tcp_tx_seg *seg = tcp_txq_seg(tsk, i);
+		int sent_after = tcp_rack_sent_after(seg->time, seg->seq_end,
+											 tsk->rack_xmit_time, tsk->rack_end_seq);
+		// the segments after it in txq are sent later, unless retransmitted
+		if (sent_after && !(seg->state & TCP_SEG_EVER_RETRANS))
+			break;
+		// sacked, or waiting for the retransmission
+		if (sent_after || (seg->state & TCP_SEG_SACKED) ||
+			(seg->state & (TCP_SEG_LOST | TCP_SEG_RETRANS)) == TCP_SEG_LOST)
+			continue;
+
+		u64 deadline = seg->time + tsk->rack_rtt + reo_wnd;
+		if (deadline <= now)
+			tcp_rack_mark_lost(tsk, seg);
+		else
+			timeout = max(timeout, deadline - now);
+	}
+
+	return timeout;
+}
@@ -0,0 +1,93 @@
+#include "tcp_cong.h"
+#include "tcp_sock.h"
+#include "tcp_timer.h"
+
+#include <string.h>
+
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+// Delivery rate estimation (draft-cheng-iccrg-delivery-rate-estimation), each
+// segment takes a snapshot of delivered when it is sent, and the ack of it
+// tells the bytes delivered since then. The rate is taken over the longer of
+// the send interval and the ack interval, thus neither the bursts of sending
+// nor the compressed acks make it higher than the path delivers.
+
+// the segment is sent (or retransmitted), before it is counted in txq if it is
+// new
+void tcp_rate_seg_sent(struct tcp_sock *tsk, struct tcp_tx_seg *seg)
+{
+	// nothing in flight, the intervals start from now
+	if (!tsk->txq_len)
+		tsk->first_tx_time = tsk->delivered_time = seg->time;
+
+	seg->delivered = tsk->delivered;
+	seg->delivered_time = tsk->delivered_time;
+	seg->first_tx_time = tsk->first_tx_time;
+	if (tsk->app_limited)
+		seg->state |= TCP_SEG_APP_LIMITED;
+	else
+		seg->state &= ~TCP_SEG_APP_LIMITED;
+}
+
+// a new ack is being processed
+void tcp_rate_ack_start(struct tcp_sock *tsk)
+{
+	struct tcp_rate_sample *rs = &tsk->rs;
+	memset(rs, 0, sizeof(*rs));
+	rs->prior_in_flight = tcp_in_flight(tsk);
+	rs->start_delivered = tsk->delivered;
+	rs->start_lost = tsk->lost;
+}
+
+// bytes of the segment are acked or sacked for the first time, the sample is
+// taken from the segment sent last of those delivered by the ack
+void tcp_rate_seg_delivered(struct tcp_sock *tsk, struct tcp_tx_seg *seg, u32 bytes)
+{
+	struct tcp_rate_sample *rs = &tsk->rs;
+	tsk->delivered += bytes;
+	if (!rs->prior_time || seg->delivered >= rs->prior_delivered)
+	{
+		rs->prior_delivered = seg->delivered;
+		rs->prior_time = seg->delivered_time;
+		rs->is_app_limited = !!(seg->state & TCP_SEG_APP_LIMITED);
+		rs->send_interval = seg->time - seg->first_tx_time;
+		// the segments sent after it take their send interval from it
+		tsk->first_tx_time = seg->time;
+	}
+}
+
+// the ack is processed, fill the sample
+void tcp_rate_gen(struct tcp_sock *tsk)
+{
+	struct tcp_rate_sample *rs = &tsk->rs;
+	u64 now = tcp_time_us();
+
+	rs->acked = tsk->delivered - rs->start_delivered;
+	rs->losses = tsk->lost - rs->start_lost;
+	rs->rtt = tsk->ack_rtt;
+	if (rs->acked)
+		tsk->delivered_time = now;
+	// the data sent while limited by the application is all delivered
+	if (tsk->app_limited && tsk->delivered > tsk->app_limited)
+		tsk->app_limited = 0;
+
+	if (!rs->prior_time)
+	{
+		rs->interval = 0;
+		return;
+	}
+	rs->delivered = tsk->delivered - rs->prior_delivered;
+	rs->interval = max(rs->send_interval, now - rs->prior_time);
+}
+
+// all the data written is sent with room left in the window, the samples of
+// the data in flight tell the rate of the application instead of the path
+void tcp_rate_check_app_limited(struct tcp_sock *tsk)
+{
+	u32 in_flight = tcp_in_flight(tsk);
+	if (tsk->snd_nxt == tsk->write_seq && in_flight < tsk->cwnd &&
+		tsk->lost_out <= tsk->retrans_out)
+		tsk->app_limited = max(tsk->delivered + in_flight, 1);
+}
@@ -4,6 +4,8 @@
 #include "tcp_timer.h"
 #include "ip.h"
 #include "rtable.h"
+#include "pktbuf.h"
+#include "evloop.h"
 #include "log.h"
 
 // TCP socks should be hashed into table for later lookup: Those which
@@ -17,6 +19,10 @@ struct tcp_hash_table tcp_sock_table;
 #define tcp_listen_sock_table tcp_sock_table.listen_table
 #define tcp_bind_sock_table tcp_sock_table.bind_table
 
+#ifndef max
+#define max(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
 inline void tcp_set_state(struct tcp_sock *tsk, int state)
 {
 	log(DEBUG, IP_FMT ":%hu switch state, from %s to %s.",
@@ -37,8 +43,26 @@ void init_tcp_stack()
 	for (int i = 0; i < TCP_HASH_SIZE; i++)
 		init_list_head(&tcp_bind_sock_table[i]);
 
-	pthread_t timer;
-	pthread_create(&timer, NULL, tcp_timer_thread, NULL);
+	init_tcp_timer();
+
+	// the timers are scanned by the event loop if it is enabled
+	if (!ustack_conf.evloop)
+	{
+		pthread_t timer, pacing;
+		pthread_create(&timer, NULL, tcp_timer_thread, NULL);
+		pthread_create(&pacing, NULL, tcp_pacing_thread, NULL);
+	}
+}
+
+// the smallest window scale letting the window field cover a receive buffer of
+// size bytes
+static u8 tcp_rcv_wscale(u32 size)
+{
+	u8 wscale = 0;
+	while (wscale < TCP_MAX_WSCALE && (size >> wscale) > TCP_MAX_WINDOW)
+		wscale += 1;
+
+	return wscale;
 }
 
 // allocate tcp sock, and initialize all the variables that can be determined
@@ -50,20 +74,30 @@ struct tcp_sock *alloc_tcp_sock()
 	memset(tsk, 0, sizeof(struct tcp_sock));
 
 	tsk->state = TCP_CLOSED;
-	tsk->rcv_wnd = TCP_DEFAULT_WINDOW;
-	tsk->ssthresh = 60;
-	tsk->cwnd = 1;
+	tsk->rcv_wnd = ustack_conf.tcp_rcvbuf;
+	tsk->rcv_buf_init = tsk->rcv_wnd;
+	tsk->rcv_buf_max = max(tsk->rcv_wnd, ustack_conf.tcp_rcvbuf_max);
+	tsk->wscale_ok = 1;
+	tsk->rcv_wscale = tcp_rcv_wscale(tsk->rcv_buf_max);
+	tsk->rto = min(max(TCP_RTO_INITIAL, ustack_conf.tcp_rto_min),
+				   ustack_conf.tcp_rto_max);
 	tsk->cong_state = open;
+	tsk->mss = TCP_DEFAULT_MSS;
+	tsk->cong_ops = ustack_conf.tcp_cong;
+	tcp_cong_init(tsk);
+	tsk->quick_acks = TCP_QUICK_ACKS;
+	tsk->rack_reo_wnd_mult = 1;
+	tsk->sack_ok = ustack_conf.tcp_sack;
+	tsk->ts_ok = ustack_conf.tcp_timestamps;
 
 	init_list_head(&tsk->list);
 	init_list_head(&tsk->listen_queue);
 	init_list_head(&tsk->accept_queue);
-	init_list_head(&tsk->send_buf);
-	init_list_head(&tsk->rcv_ofo_buf);
-
-	pthread_mutex_init(&tsk->send_buf_lock, NULL);
+	init_list_head(&tsk->pacing_list);
+	tsk->rcv_ofo = RB_ROOT;
 
 	tsk->rcv_buf = alloc_ring_buffer(tsk->rcv_wnd);
+	tsk->snd_buf = alloc_ring_buffer(ustack_conf.tcp_sndbuf);
 
 	tsk->wait_connect = alloc_wait_struct();
 	tsk->wait_accept = alloc_wait_struct();
@@ -89,10 +123,22 @@ void free_tcp_sock(struct tcp_sock *tsk)
 		list_delete_entry(&tsk->listen_queue);
 		list_delete_entry(&tsk->accept_queue);
 		list_delete_entry(&tsk->list);
+		tcp_unset_pacing_timer(tsk);
 		if (tsk->rcv_buf)
 		{
 			free_ring_buffer(tsk->rcv_buf);
 		}
+		if (tsk->snd_buf)
+		{
+			free_ring_buffer(tsk->snd_buf);
+		}
+		free(tsk->txq);
+		struct rb_node *node;
+		while ((node = rb_first(&tsk->rcv_ofo)) != NULL)
+		{
+			rb_erase(node, &tsk->rcv_ofo);
+			free(rb_entry(node, struct tcp_ofo_range, node));
+		}
 
 		free(tsk);
 	}
@@ -275,15 +321,48 @@ void tcp_unhash(struct tcp_sock *tsk)
 	}
 }
 
+// The operations below change the socket tables or send packets, they are run
+// through tcp_sock_run, so that they are run by the receiving loop if the event
+// loop is enabled, or along with the incoming segments otherwise. Only the
+// waiting is left to the application.
+struct tcp_sock_call
+{
+	struct tcp_sock *tsk;
+	void *arg;
+	int len;
+	int ret;
+};
+
+static void tcp_sock_run(void (*fn)(void *arg), struct tcp_sock_call *call)
+{
+	if (ustack_conf.evloop)
+	{
+		evloop_call(fn, call);
+		return;
+	}
+
+	pthread_mutex_lock(&tcp_lock);
+	fn(call);
+	pthread_mutex_unlock(&tcp_lock);
+}
+
 // XXX: skaddr here contains network-order variables
-int tcp_sock_bind(struct tcp_sock *tsk, struct sock_addr *skaddr)
+
+static void tcp_sock_bind_call(void *arg)
 {
-	int err = 0;
+	struct tcp_sock_call *call = arg;
+	struct sock_addr *skaddr = call->arg;
 
 	// omit the ip address, and only bind the port
-	err = tcp_sock_set_sport(tsk, ntohs(skaddr->port));
+	call->ret = tcp_sock_set_sport(call->tsk, ntohs(skaddr->port));
+}
 
-	return err;
+int tcp_sock_bind(struct tcp_sock *tsk, struct sock_addr *skaddr)
+{
+	struct tcp_sock_call call = { tsk, skaddr, 0, 0 };
+	tcp_sock_run(tcp_sock_bind_call, &call);
+
+	return call.ret;
 }
 
 // connect to the remote tcp sock specified by skaddr
@@ -295,59 +374,83 @@ int tcp_sock_bind(struct tcp_sock *tsk, struct sock_addr *skaddr)
 //    SYN packet by sleep on wait_connect;
 // 4. if the SYN packet of the peer arrives, this function is notified, which
 //    means the connection is established.
-int tcp_sock_connect(struct tcp_sock *tsk, struct sock_addr *skaddr)
+static void tcp_sock_connect_call(void *arg)
 {
-	// fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
+	struct tcp_sock_call *call = arg;
+	struct tcp_sock *tsk = call->tsk;
+	struct sock_addr *skaddr = call->arg;
+
+	call->ret = -1;
 	if (tsk->state != TCP_CLOSED)
 	{
 		log(ERROR, "Connect using an unclosed socket");
-		return -1;
+		return;
 	}
-	else
+
+	rt_entry_t *rt = longest_prefix_match(ntohl(skaddr->ip));
+	if (rt == NULL)
 	{
-		rt_entry_t *rt = longest_prefix_match(ntohl(skaddr->ip));
-		if (rt == NULL)
-		{
-			log(ERROR, "Route table look up failed in %s", __FUNCTION__);
-			return -1;
-		}
-		tsk->sk_sip = rt->iface->ip;
-		tsk->sk_dip = ntohl(skaddr->ip);
-		tsk->sk_dport = ntohs(skaddr->port);
-		// Bind to bind_table
-		tcp_sock_bind(tsk, skaddr);
-		// Send SYN packet
-		tcp_send_control_packet(tsk, TCP_SYN);
-		tsk->state = TCP_SYN_SENT;
-		// All initiative connection sockets should be appended into extablished_table,
-		// even they might not be really established.
-		tcp_hash(tsk);
-		sleep_on(tsk->wait_connect);
-		// tsk->state = TCP_ESTABLISHED;
-
-		return 0;
+		log(ERROR, "Route table look up failed in %s", __FUNCTION__);
+		return;
 	}
+	tsk->sk_sip = rt->iface->ip;
+	tsk->sk_dip = ntohl(skaddr->ip);
+	tsk->sk_dport = ntohs(skaddr->port);
+	// Bind to bind_table, with a free port
+	if (tcp_sock_set_sport(tsk, 0) < 0)
+	{
+		log(ERROR, "No free port in %s", __FUNCTION__);
+		return;
+	}
+	tsk->state = TCP_SYN_SENT;
+	// All initiative connection sockets should be appended into extablished_table,
+	// even they might not be really established. It is hashed before sending
+	// SYN, in case SYN|ACK comes back before that.
+	tcp_hash(tsk);
+	// Send SYN packet
+	tcp_send_control_packet(tsk, TCP_SYN);
+
+	call->ret = 0;
+}
 
-	return -1;
+int tcp_sock_connect(struct tcp_sock *tsk, struct sock_addr *skaddr)
+{
+	struct tcp_sock_call call = { tsk, skaddr, 0, 0 };
+	tcp_sock_run(tcp_sock_connect_call, &call);
+	if (call.ret < 0)
+		return -1;
+
+	sleep_on(tsk->wait_connect);
+	// tsk->state = TCP_ESTABLISHED;
+
+	return 0;
 }
 
 // set backlog (the maximum number of pending connection requst), switch the
 // TCP_STATE, and hash the tcp sock into listen_table
-int tcp_sock_listen(struct tcp_sock *tsk, int backlog)
+static void tcp_sock_listen_call(void *arg)
 {
-	// fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
+	struct tcp_sock_call *call = arg;
+	struct tcp_sock *tsk = call->tsk;
+
 	if (tsk->state != TCP_CLOSED)
 	{
 		log(ERROR, "Listen an unclosed socket");
-		return -1;
-	}
-	else
-	{
-		tsk->state = TCP_LISTEN;
-		tsk->backlog = backlog;
-		int err = tcp_hash(tsk);
-		return err;
+		call->ret = -1;
+		return;
 	}
+
+	tsk->state = TCP_LISTEN;
+	tsk->backlog = call->len;
+	call->ret = tcp_hash(tsk);
+}
+
+int tcp_sock_listen(struct tcp_sock *tsk, int backlog)
+{
+	struct tcp_sock_call call = { tsk, NULL, backlog, 0 };
+	tcp_sock_run(tcp_sock_listen_call, &call);
+
+	return call.ret;
 }
 
 // check whether the accept queue is full
@@ -384,43 +487,60 @@ inline struct tcp_sock *tcp_sock_accept_dequeue(struct tcp_sock *tsk)
 
 // if accept_queue is not emtpy, pop the first tcp sock and accept it,
 // otherwise, sleep on the wait_accept for the incoming connection requests
+static void tcp_sock_accept_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	struct tcp_sock *tsk = call->tsk;
+
+	call->arg = NULL;
+	if (!list_empty(&tsk->accept_queue))
+		call->arg = tcp_sock_accept_dequeue(tsk);
+}
+
 struct tcp_sock *tcp_sock_accept(struct tcp_sock *tsk)
 {
-	// fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
-	while (list_empty(&tsk->accept_queue))
+	struct tcp_sock_call call = { tsk, NULL, 0, 0 };
+	while (1)
 	{
+		tcp_sock_run(tcp_sock_accept_call, &call);
+		if (call.arg)
+			return call.arg;
+
 		sleep_on(tsk->wait_accept);
 	}
-	struct tcp_sock *csk = tcp_sock_accept_dequeue(tsk);
+}
+
+static void tcp_sock_close_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	struct tcp_sock *tsk = call->tsk;
 
-	return csk;
+	// FIN follows the data in snd_buf, which is sent as the window allows
+	tsk->snd_fin = 1;
+	tcp_push(tsk, 1);
 }
 
 // close the tcp sock, by releasing the resources, sending FIN/RST packet
 // to the peer, switching TCP_STATE to closed
+//
+// It returns at once, FIN is sent by the stack once the data written is all
+// sent.
 void tcp_sock_close(struct tcp_sock *tsk)
 {
-	// fprintf(stdout, "TODO: implement %s please.\n", __FUNCTION__);
-	tcp_send_control_packet(tsk, TCP_FIN | TCP_ACK);
-	switch (tsk->state)
-	{
-	case TCP_ESTABLISHED:
-		tsk->state = TCP_FIN_WAIT_1;
-		break;
-	case TCP_CLOSE_WAIT:
-		tsk->state = TCP_LAST_ACK;
-		break;
-	case TCP_CLOSED:
-		break;
-
-	default:
-		log(ERROR, "Not implemented state while %s", __FUNCTION__);
-		break;
-	}
+	struct tcp_sock_call call = { tsk, NULL, 0, 0 };
+	tcp_sock_run(tcp_sock_close_call, &call);
 
 	// free_tcp_sock(tsk);
 }
 
+static void tcp_sock_ack_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+
+	if (call->tsk->state == TCP_ESTABLISHED)
+		tcp_send_control_packet(call->tsk, TCP_ACK);
+}
+
 // Return:
 // 0 if stream is finished
 // -1 if error occurs
@@ -453,36 +573,238 @@ int tcp_sock_read(struct tcp_sock *tsk, char *buf, int len)
 			ret = 0;
 		}
 	}
+	u32 old_rcv_wnd = tcp_rcv_wnd_offer(tsk);
 	tsk->rcv_wnd += ret;
+	u32 rcv_wnd = tcp_rcv_wnd_offer(tsk);
 	pthread_mutex_unlock(&tsk->rcv_buf_lock);
+	// the peer stops sending once the window is closed, tell it when the
+	// window is open again, i.e. at least a segment, which is not hidden by
+	// the window scale
+	u32 open_wnd = max(tsk->mss, 1U << tsk->rcv_wscale);
+	if (old_rcv_wnd < open_wnd && rcv_wnd >= open_wnd &&
+		tsk->state == TCP_ESTABLISHED)
+	{
+		struct tcp_sock_call call = { tsk, NULL, 0, 0 };
+		tcp_sock_run(tcp_sock_ack_call, &call);
+	}
 	return ret;
 }
 
+static void tcp_sock_write_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	call->ret = call->tsk->snd_fin ? -1 :
+		tcp_send_data(call->tsk, call->arg, call->len);
+}
+
 // Return:
 // -1 if error occurs
 // positive value the same as actually written length
+//
+// The data is copied into the send buffer, and sent by the stack as the window
+// allows (see tcp_push), thus it only waits if the send buffer is full.
 int tcp_sock_write(struct tcp_sock *tsk, char *buf, int len)
 {
-	if (tsk->state == TCP_CLOSED)
+	struct tcp_sock_call call = { tsk, buf, len, 0 };
+	while (1)
 	{
+		if (tsk->state == TCP_CLOSED)
+		{
+			return -1;
+		}
+		tcp_sock_run(tcp_sock_write_call, &call);
+		if (call.ret != 0)
+		{
+			return call.ret;
+		}
+		// wait for the peer to ack some data
+		if (sleep_on(tsk->wait_send) < 0)
+		{
+			return -1;
+		}
+	}
+}
+
+// replace snd_buf with one of size bytes, if it holds no data
+int tcp_sock_resize_snd_buf(struct tcp_sock *tsk, int size)
+{
+	if (size <= 0 || !ring_buffer_empty(tsk->snd_buf))
 		return -1;
+
+	free_ring_buffer(tsk->snd_buf);
+	tsk->snd_buf = alloc_ring_buffer(size);
+
+	return 0;
+}
+
+// replace rcv_buf with one of size bytes, which grows up to max_size bytes by
+// auto-tuning, if SYN is not sent yet, since the window scale covering max_size
+// bytes is announced in SYN
+int tcp_sock_resize_rcv_buf(struct tcp_sock *tsk, int size, int max_size)
+{
+	if (size <= 0 || max(size, max_size) > (TCP_MAX_WINDOW << TCP_MAX_WSCALE) ||
+		(tsk->state != TCP_CLOSED && tsk->state != TCP_LISTEN))
+		return -1;
+
+	free_ring_buffer(tsk->rcv_buf);
+	tsk->rcv_buf = alloc_ring_buffer(size);
+	tsk->rcv_wnd = size;
+	tsk->rcv_buf_init = size;
+	tsk->rcv_buf_max = max(size, max_size);
+	tsk->rcv_wscale = tcp_rcv_wscale(tsk->rcv_buf_max);
+
+	return 0;
+}
+
+// replace rcv_buf with one of size bytes holding the data received so far, in
+// order or not, as tuned by tcp_rcv_space_adjust, the window changes by the
+// difference
+//
+// rcv_buf shrinks no further than the data in order and the window advertised
+// so far, which the peer may fill, and not at all with data out of order.
+// Return -1 if it does not shrink to size bytes.
+int tcp_sock_tune_rcv_buf(struct tcp_sock *tsk, int size)
+{
+	pthread_mutex_lock(&tsk->rcv_buf_lock);
+	int old_size = tsk->rcv_buf->size - 1;
+	if (size < old_size)
+	{
+		int need = ring_buffer_used(tsk->rcv_buf);
+		if (greater_than_32b(tsk->rcv_adv, tsk->rcv_nxt))
+			need += tsk->rcv_adv - tsk->rcv_nxt;
+		if (!rb_empty_root(&tsk->rcv_ofo))
+			need = old_size;
+		if (need >= old_size)
+		{
+			pthread_mutex_unlock(&tsk->rcv_buf_lock);
+			return -1;
+		}
+		if (need > size)
+		{
+			tsk->rcv_buf = resize_ring_buffer(tsk->rcv_buf, need);
+			tsk->rcv_wnd = tsk->rcv_wnd + need - old_size;
+			pthread_mutex_unlock(&tsk->rcv_buf_lock);
+			return -1;
+		}
 	}
-	u32 snd_len = min((u32)len, tsk->snd_wnd);
-	while (snd_len == 0)
+
+	tsk->rcv_buf = resize_ring_buffer(tsk->rcv_buf, size);
+	tsk->rcv_wnd = tsk->rcv_wnd + size - old_size;
+	pthread_mutex_unlock(&tsk->rcv_buf_lock);
+
+	return 0;
+}
+
+static void tcp_sock_setopt_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	struct tcp_sock *tsk = call->tsk;
+	int val = *(int *)call->arg;
+
+	call->ret = 0;
+	switch (call->len)
 	{
-		sleep_on(tsk->wait_send);
-		snd_len = min((u32)len, tsk->snd_wnd);
+	case TCP_NODELAY:
+		tsk->nodelay = !!val;
+		break;
+	case TCP_CORK:
+		tsk->cork = !!val;
+		break;
+	case TCP_SNDBUF:
+		call->ret = tcp_sock_resize_snd_buf(tsk, val);
+		return;
+	case TCP_RCVBUF:
+		call->ret = tcp_sock_resize_rcv_buf(tsk, val, val);
+		return;
+	default:
+		log(ERROR, "Unknown tcp sock option %d", call->len);
+		call->ret = -1;
+		return;
 	}
-	int plen = snd_len + TCP_BASE_HDR_SIZE + IP_BASE_HDR_SIZE + ETHER_HDR_SIZE;
-	char *packet = malloc(plen);
-	if (packet == NULL)
+
+	// the partial segment may be allowed now
+	if (tsk->state == TCP_ESTABLISHED || tsk->state == TCP_CLOSE_WAIT)
+		tcp_push(tsk, 0);
+}
+
+// dump the state of the tcp socks, e.g. the size of their buffers
+void tcp_sock_dump_stats(FILE *fp)
+{
+	if (!ustack_conf.evloop)
+		pthread_mutex_lock(&tcp_lock);
+
+	for (int i = 0; i < TCP_HASH_SIZE; i++)
 	{
-		log(ERROR, "Malloc failed during %s", __FUNCTION__);
+		struct tcp_sock *tsk;
+		list_for_each_entry(tsk, &tcp_established_sock_table[i], hash_list)
+		{
+			fprintf(fp, "tcp " IP_FMT ":%hu -> " IP_FMT ":%hu %s: rcv_buf %d bytes "
+					"(%u to %u), rcv_wnd %u, rcv_rtt %u us, snd_buf %d bytes, "
+					"srtt %u us, rttvar %u us, rto %u us, mss %hu, sack %d, "
+					"wscale %d/%d, timestamps %d, %s cwnd %u ssthresh %u "
+					"pacing %lu B/s, delivered %lu, retrans %u, tlp %u probes "
+					"%u recoveries, rack %u lost, dsack %u, undo %u/%u/%u "
+					"(dsack/eifel/frto)\n",
+					HOST_IP_FMT_STR(tsk->sk_sip), tsk->sk_sport,
+					HOST_IP_FMT_STR(tsk->sk_dip), tsk->sk_dport,
+					tcp_state_str[tsk->state], tsk->rcv_buf->size - 1,
+					tsk->rcv_buf_init, tsk->rcv_buf_max, tsk->rcv_wnd,
+					tsk->rcv_rtt, tsk->snd_buf->size - 1, tsk->srtt, tsk->rttvar,
+					tsk->rto, tsk->mss, tsk->sack_ok, tsk->snd_wscale,
+					tsk->rcv_wscale, tsk->ts_ok, tsk->cong_ops->name, tsk->cwnd,
+					tsk->ssthresh, tsk->pacing_rate, tsk->delivered,
+					tsk->total_retrans, tsk->tlp_probes, tsk->tlp_recoveries,
+					tsk->rack_lost, tsk->dsacks, tsk->undo_dsack, tsk->undo_eifel,
+					tsk->undo_frto);
+		}
+	}
+
+	if (!ustack_conf.evloop)
+		pthread_mutex_unlock(&tcp_lock);
+}
+
+// set an option of the tcp sock, see TCP_NODELAY, TCP_CORK, TCP_SNDBUF and
+// TCP_RCVBUF
+int tcp_sock_setopt(struct tcp_sock *tsk, int opt, int val)
+{
+	struct tcp_sock_call call = { tsk, &val, opt, 0 };
+	tcp_sock_run(tcp_sock_setopt_call, &call);
+
+	return call.ret;
+}
+
+static void tcp_sock_set_congestion_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	call->tsk->cong_ops = call->arg;
+	tcp_cong_init(call->tsk);
+}
+
+int tcp_sock_set_congestion(struct tcp_sock *tsk, const char *name)
+{
+	const struct tcp_cong_ops *ops = tcp_cong_find(name);
+	if (!ops)
+	{
+		log(ERROR, "Unknown congestion control %s", name);
 		return -1;
 	}
-	char *data = packet + TCP_BASE_HDR_SIZE + IP_BASE_HDR_SIZE + ETHER_HDR_SIZE;
-	memcpy(data, buf, snd_len);
-	tcp_send_packet(tsk, packet, plen);
 
-	return snd_len;
+	struct tcp_sock_call call = { tsk, (void *)ops, 0, 0 };
+	tcp_sock_run(tcp_sock_set_congestion_call, &call);
+
+	return call.ret;
+}
+
+static void tcp_sock_retrans_call(void *arg)
+{
+	struct tcp_sock_call *call = arg;
+	call->ret = call->tsk->total_retrans;
+}
+
+u32 tcp_sock_retrans(struct tcp_sock *tsk)
+{
+	struct tcp_sock_call call = { tsk, NULL, 0, 0 };
+	tcp_sock_run(tcp_sock_retrans_call, &call);
+
+	return call.ret;
 }
@@ -1,6 +1,7 @@
 #include "tcp.h"
 #include "tcp_timer.h"
 #include "tcp_sock.h"
+#include "pktbuf.h"
 #include "log.h"
 
 #include <stdio.h>
@@ -11,10 +12,53 @@ static struct list_head timer_list;
 
 pthread_mutex_t timer_lock;
 
+// the tcp socks held by pacing, in order of pacing_due, and the condition the
+// pacing thread waits on for the first one
+static struct list_head pacing_list;
+static pthread_mutex_t pacing_lock;
+static pthread_cond_t pacing_cond;
+
 #ifndef max
 #define max(x, y) ((x) > (y) ? (x) : (y))
 #endif
 
+// the retransmission timeout doubled backoff times, within the upper bound
+static inline int tcp_rto_backoff(struct tcp_sock *tsk, int backoff)
+{
+	return min((u64)tsk->rto << backoff, ustack_conf.tcp_rto_max);
+}
+
+// the probe timeout (PTO of RFC 8985), 2 srtt, plus the delayed ack of the
+// peer if a segment is in flight, since no other one makes it ack at once,
+// which is taken as long as ours (see -d)
+//
+// The timer fires at the first scan once the timeout is less than the scan
+// interval, thus it lasts at least a whole scan interval.
+static inline int tcp_tlp_timeout(struct tcp_sock *tsk)
+{
+	int pto = max(2 * tsk->srtt, 2 * TCP_TIMER_SCAN_INTERVAL);
+	if (tcp_in_flight(tsk) <= tsk->mss)
+		pto += ustack_conf.tcp_delack;
+	return pto;
+}
+
+// start the retransmission timer over (with timer_lock held), which fires as
+// the tail loss probe first if it is sooner, unless in recovery, or the probe
+// sent is not acked yet
+static void tcp_retrans_timer_restart(struct tcp_sock *tsk)
+{
+	struct tcp_timer *tmr = &tsk->retrans_timer;
+	tmr->type = 1;
+	tmr->timeout = tcp_rto_backoff(tsk, tmr->enable - 1);
+	if (ustack_conf.tcp_rack && tsk->sack_ok && tsk->srtt &&
+		tsk->cong_state == open && !tsk->tlp_high_seq &&
+		tcp_tlp_timeout(tsk) < tmr->timeout)
+	{
+		tmr->type = 5;
+		tmr->timeout = tcp_tlp_timeout(tsk);
+	}
+}
+
 // scan the timer_list, find the tcp sock which stays for at 2*MSL, release it
 void tcp_scan_timer_list()
 {
@@ -23,7 +67,6 @@ void tcp_scan_timer_list()
 	struct tcp_timer *tmr = NULL, *tmr_tmp = NULL;
 	list_for_each_entry_safe(tmr, tmr_tmp, &timer_list, list)
 	{
-		struct tcp_sock *tsk = retranstimer_to_tcp_sock(tmr);
 		tmr->timeout -= TCP_TIMER_SCAN_INTERVAL;
 		if (tmr->timeout <= 0)
 		{
@@ -38,28 +81,35 @@ void tcp_scan_timer_list()
 			else if (tmr->type == 1)
 			{
 				// Retransmission timer
-				// Every time a retransmission occurs, sshthresh should be updated.
-				tsk->ssthresh = max(1, tsk->cwnd / 2);
-				tsk->cwnd = 1;
-				log_cwnd_update(tsk->cwnd, tsk->ssthresh);
-				tsk->cong_state = loss;
-
-				tmr->timeout = TCP_RETRANS_INTERVAL_INITIAL << tmr->enable;
-				tmr->enable += 1;
-				pthread_mutex_lock(&tsk->send_buf_lock);
-				if (list_empty(&tsk->send_buf))
+				struct tcp_sock *tsk = retranstimer_to_tcp_sock(tmr);
+				struct tcp_tx_seg *seg = tcp_txq_first(tsk);
+				if (seg == NULL)
 				{
-					log(ERROR, "No unacked packet pended. Ignore.");
+					log(ERROR, "No unacked segment pended. Ignore.");
 					list_delete_entry(&tmr->list);
+					tmr->enable = 0;
 					continue;
 				}
-				struct pended_packet *ppkt =
-					list_entry(tsk->send_buf.next, struct pended_packet, list);
-				pthread_mutex_unlock(&tsk->send_buf_lock);
-				if (tmr->enable > 3)
+				tcp_undo_mark(tsk);
+				tcp_cong_on_rto(tsk);
+				// the acks after it tell whether it is spurious (F-RTO),
+				// unless it fires in recovery, whose retransmissions leave
+				// the acks ambiguous
+				tsk->frto = ustack_conf.tcp_undo && tsk->cong_state != fast_recovery;
+				// the state lasts until the data sent so far is acked
+				tsk->cong_state = loss;
+				tsk->recovery_point = tsk->snd_nxt;
+				tsk->dup_ack = 0;
+				tsk->tlp_high_seq = 0;
+
+				// the timeout doubles each time in a row (enable is 1 plus
+				// the timeouts so far)
+				tmr->timeout = tcp_rto_backoff(tsk, tmr->enable);
+				tmr->enable += 1;
+				if (tmr->enable > TCP_RETRIES + 1)
 				{
 					log(ERROR, "Retransmission max retries.");
-					u32 rel_seq = ppkt->seq - tsk->iss;
+					u32 rel_seq = seg->seq - tsk->iss;
 					log(DEBUG, "Relative seq=%u", rel_seq);
 					tcp_send_control_packet(tsk, TCP_RST);
 					tmr->enable = 0;
@@ -69,19 +119,100 @@ void tcp_scan_timer_list()
 				else
 				{
 					// log(DEBUG, "Retransmitting packet.");
-					// u32 rel_seq = ppkt->seq - tsk->iss;
+					// u32 rel_seq = seg->seq - tsk->iss;
 					// log(DEBUG, "Relative seq=%u", rel_seq);
-					char *packet = malloc(ppkt->len);
-					if (packet == NULL)
+					// the segments not sacked are all retransmitted as the
+					// window grows again, starting from the first one
+					tcp_txq_mark_all_lost(tsk);
+					tcp_retransmit(tsk, seg);
+				}
+			}
+			else if (tmr->type == 5)
+			{
+				// Loss probe timer, the retransmission timeout follows it
+				struct tcp_sock *tsk = retranstimer_to_tcp_sock(tmr);
+				tmr->type = 1;
+				tmr->timeout = tcp_rto_backoff(tsk, tmr->enable - 1);
+				if (tsk->state != TCP_CLOSED)
+					tcp_send_loss_probe(tsk);
+			}
+			else if (tmr->type == 6)
+			{
+				// Reordering timer, the segments not deemed lost by RACK
+				// are checked again, which may start fast recovery
+				struct tcp_sock *tsk = retranstimer_to_tcp_sock(tmr);
+				tmr->type = 1;
+				tmr->timeout = tcp_rto_backoff(tsk, tmr->enable - 1);
+				if (tsk->state == TCP_CLOSED)
+					continue;
+				u32 timeout = tcp_rack_detect_loss(tsk);
+				if (timeout && timeout < tmr->timeout)
+				{
+					tmr->type = 6;
+					tmr->timeout = timeout;
+				}
+				struct tcp_tx_seg *seg = tcp_txq_first(tsk);
+				if (tsk->cong_state == open && seg && (seg->state & TCP_SEG_LOST))
+					tcp_enter_recovery(tsk);
+				// the segments deemed lost leave the flight, and are
+				// retransmitted by tcp_push as the window allows, which is
+				// run by the pacing timer, since it sets the timers again
+				u32 in_flight = tcp_in_flight(tsk);
+				tsk->snd_wnd = tsk->cwnd > in_flight ? tsk->cwnd - in_flight : 0;
+				tcp_set_pacing_timer(tsk, tcp_time_us());
+			}
+			else if (tmr->type == 2)
+			{
+				// Delayed ack timer, nothing to do if the ack has been sent
+				// along with data in the meantime
+				struct tcp_sock *tsk = delacktimer_to_tcp_sock(tmr);
+				tmr->enable = 0;
+				list_delete_entry(&tmr->list);
+				if (tsk->rcv_acked != tsk->rcv_nxt && tsk->state != TCP_CLOSED)
+					tcp_send_control_packet(tsk, TCP_ACK);
+			}
+			else if (tmr->type == 3)
+			{
+				// Persist timer, nothing to do if the window has opened, i.e.
+				// data is in flight again
+				struct tcp_sock *tsk = persisttimer_to_tcp_sock(tmr);
+				if (tsk->txq_len || tsk->snd_nxt == tsk->write_seq ||
+					tsk->state == TCP_CLOSED)
+				{
+					tmr->enable = 0;
+					list_delete_entry(&tmr->list);
+					continue;
+				}
+				tcp_send_probe(tsk);
+				tmr->timeout = tcp_rto_backoff(tsk, tmr->enable);
+				if (tmr->enable < TCP_PERSIST_MAX_BACKOFF)
+					tmr->enable += 1;
+			}
+			else if (tmr->type == 4)
+			{
+				// Receive buffer timer, rcv_buf grown by auto-tuning shrinks
+				// back once no data arrives for a while: the space beyond
+				// rcv_buf_init is no longer offered, and is freed once the
+				// window advertised before is filled or consumed
+				struct tcp_sock *tsk = rcvbuftimer_to_tcp_sock(tmr);
+				tmr->timeout = TCP_RCVBUF_IDLE_TIMEOUT;
+				if (tsk->state != TCP_CLOSED &&
+					tsk->rcv_buf->size - 1 > tsk->rcv_buf_init)
+				{
+					if (!tsk->rcv_shrink)
 					{
-						log(ERROR, "Malloc failed during %s", __FUNCTION__);
-						exit(-1);
+						if (tcp_time_us() - tsk->rcv_time < TCP_RCVBUF_IDLE_TIMEOUT)
+							continue;
+						tsk->rcv_shrink = 1;
+						// measured afresh once data arrives again
+						tsk->rcvq_time = 0;
 					}
-					memcpy(packet, ppkt->packet, ppkt->len);
-					ip_send_packet(packet, ppkt->len);
+					if (tcp_sock_tune_rcv_buf(tsk, tsk->rcv_buf_init) < 0)
+						continue;
 				}
-				// Reset congestion state to open after retransmissions
-				tsk->cong_state = open;
+				tsk->rcv_shrink = 0;
+				tmr->enable = 0;
+				list_delete_entry(&tmr->list);
 			}
 		}
 	}
@@ -104,15 +235,44 @@ void tcp_set_timewait_timer(struct tcp_sock *tsk)
 	pthread_mutex_unlock(&timer_lock);
 }
 
-// scan the timer_list periodically by calling tcp_scan_timer_list
-void *tcp_timer_thread(void *arg)
+// init the timer_list, before any timer is set
+void init_tcp_timer()
 {
 	init_list_head(&timer_list);
 	pthread_mutex_init(&timer_lock, NULL);
+
+	// the pacing thread waits for the due time of tcp_time_us
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	init_list_head(&pacing_list);
+	pthread_mutex_init(&pacing_lock, NULL);
+	pthread_cond_init(&pacing_cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+// whether there is any timer in timer_list, i.e. timer_list should be scanned
+int tcp_timer_pending()
+{
+	pthread_mutex_lock(&timer_lock);
+	int pending = !list_empty(&timer_list);
+	pthread_mutex_unlock(&timer_lock);
+
+	return pending;
+}
+
+// scan the timer_list periodically by calling tcp_scan_timer_list
+//
+// The timers retransmit segments built from the state of the tcp socks, thus
+// the scan takes turns with the incoming segments and the applications.
+void *tcp_timer_thread(void *arg)
+{
 	while (1)
 	{
 		usleep(TCP_TIMER_SCAN_INTERVAL);
+		pthread_mutex_lock(&tcp_lock);
 		tcp_scan_timer_list();
+		pthread_mutex_unlock(&tcp_lock);
 	}
 
 	return NULL;
@@ -122,14 +282,18 @@ void *tcp_timer_thread(void *arg)
 void tcp_set_retrans_timer(struct tcp_sock *tsk)
 {
 	pthread_mutex_lock(&timer_lock);
-	if (tsk->retrans_timer.enable == 0)
+	struct tcp_timer *tmr = &tsk->retrans_timer;
+	if (tmr->enable == 0)
 	{
-		struct tcp_timer *tmr = &tsk->retrans_timer;
-		tmr->type = 1;
 		tmr->enable = 1;
-		tmr->timeout = TCP_RETRANS_INTERVAL_INITIAL;
+		tcp_retrans_timer_restart(tsk);
 		list_add_head(&tmr->list, &timer_list);
 	}
+	else if (tmr->type == 5)
+	{
+		// the tail is probed from the last segment sent
+		tcp_retrans_timer_restart(tsk);
+	}
 	pthread_mutex_unlock(&timer_lock);
 }
 
@@ -148,34 +312,230 @@ void tcp_unset_retrans_timer(struct tcp_sock *tsk)
 	pthread_mutex_unlock(&timer_lock);
 }
 
-// Clear acked packets out of send_buf and update the retransmission timer
+// Clear acked segments out of txq and update the retransmission timer
 void tcp_update_retrans_timer(struct tcp_sock *tsk, u32 ack)
 {
 	pthread_mutex_lock(&timer_lock);
-	pthread_mutex_lock(&tsk->send_buf_lock);
 
-	struct pended_packet *ppkt = NULL, *tmp_ppkt = NULL;
-	list_for_each_entry_safe(ppkt, tmp_ppkt, &tsk->send_buf, list)
+	if (tcp_txq_ack(tsk, ack) > 0 && tsk->retrans_timer.enable)
 	{
-		if (ppkt->seq_end <= ack)
-		{
-			// log(DEBUG, "Removed acked packet.");
-			// u32 rel_seq = ppkt->seq - tsk->iss;
-			// log(DEBUG, "Relative seq=%u", rel_seq);
-			list_delete_entry(&ppkt->list);
-			free(ppkt->packet);
-			free(ppkt);
-			tsk->retrans_timer.enable = 1;
-		}
+		// log(DEBUG, "Removed acked segment(s), reset the backoff.");
+		// the timer restarts for the remaining segments (RFC 6298)
+		tsk->retrans_timer.enable = 1;
+		tcp_retrans_timer_restart(tsk);
 	}
 
-	if (tsk->retrans_timer.enable && list_empty(&tsk->send_buf))
+	if (tsk->retrans_timer.enable && tcp_txq_first(tsk) == NULL)
 	{
-		// log(DEBUG, "All pended packet(s) acked, unset retransmission timer.");
+		// log(DEBUG, "All pended segment(s) acked, unset retransmission timer.");
 		list_delete_entry(&tsk->retrans_timer.list);
 		tsk->retrans_timer.enable = 0;
 	}
 
-	pthread_mutex_unlock(&tsk->send_buf_lock);
 	pthread_mutex_unlock(&timer_lock);
 }
+
+void tcp_set_reo_timer(struct tcp_sock *tsk, u32 timeout)
+{
+	pthread_mutex_lock(&timer_lock);
+	struct tcp_timer *tmr = &tsk->retrans_timer;
+	if (tmr->enable && timeout < tmr->timeout)
+	{
+		tmr->type = 6;
+		tmr->timeout = timeout;
+	}
+	pthread_mutex_unlock(&timer_lock);
+}
+
+// update the rtt estimate by a sample (RFC 6298), the variation is updated
+// with the smoothed rtt before the sample
+void tcp_rtt_update(struct tcp_sock *tsk, u32 rtt)
+{
+	rtt = max(rtt, 1);
+	if (!tsk->min_rtt || rtt < tsk->min_rtt)
+		tsk->min_rtt = rtt;
+	if (tsk->srtt == 0)
+	{
+		tsk->srtt = rtt;
+		tsk->rttvar = rtt / 2;
+	}
+	else
+	{
+		u32 delta = tsk->srtt > rtt ? tsk->srtt - rtt : rtt - tsk->srtt;
+		tsk->rttvar = tsk->rttvar - tsk->rttvar / 4 + delta / 4;
+		tsk->srtt = tsk->srtt - tsk->srtt / 8 + rtt / 8;
+	}
+
+	// the variation is at least the clock granularity, i.e. the scan interval
+	u32 rto = tsk->srtt + max(TCP_TIMER_SCAN_INTERVAL, 4 * tsk->rttvar);
+	tsk->rto = min(max(rto, ustack_conf.tcp_rto_min), ustack_conf.tcp_rto_max);
+}
+
+// Set delayed ack timer of a tcp sock, by adding the timer into timer_list
+//
+// The timer is not removed when the ack is sent in the meantime, it just finds
+// nothing to do when it fires.
+void tcp_set_delack_timer(struct tcp_sock *tsk)
+{
+	pthread_mutex_lock(&timer_lock);
+	if (tsk->delack_timer.enable == 0)
+	{
+		struct tcp_timer *tmr = &tsk->delack_timer;
+		tmr->type = 2;
+		tmr->enable = 1;
+		tmr->timeout = ustack_conf.tcp_delack;
+		list_add_head(&tmr->list, &timer_list);
+	}
+	pthread_mutex_unlock(&timer_lock);
+}
+
+// Set receive buffer timer of a tcp sock, by adding the timer into timer_list
+void tcp_set_rcvbuf_timer(struct tcp_sock *tsk)
+{
+	pthread_mutex_lock(&timer_lock);
+	if (tsk->rcvbuf_timer.enable == 0)
+	{
+		struct tcp_timer *tmr = &tsk->rcvbuf_timer;
+		tmr->type = 4;
+		tmr->enable = 1;
+		tmr->timeout = TCP_RCVBUF_IDLE_TIMEOUT;
+		list_add_head(&tmr->list, &timer_list);
+	}
+	pthread_mutex_unlock(&timer_lock);
+}
+
+// Set persist timer of a tcp sock, by adding the timer into timer_list
+void tcp_set_persist_timer(struct tcp_sock *tsk)
+{
+	pthread_mutex_lock(&timer_lock);
+	if (tsk->persist_timer.enable == 0)
+	{
+		struct tcp_timer *tmr = &tsk->persist_timer;
+		tmr->type = 3;
+		tmr->enable = 1;
+		tmr->timeout = tsk->rto;
+		list_add_head(&tmr->list, &timer_list);
+	}
+	pthread_mutex_unlock(&timer_lock);
+}
+
+void tcp_set_pacing_timer(struct tcp_sock *tsk, u64 due)
+{
+	pthread_mutex_lock(&pacing_lock);
+	if (tsk->pacing_due && tsk->pacing_due <= due)
+	{
+		pthread_mutex_unlock(&pacing_lock);
+		return;
+	}
+	if (tsk->pacing_due)
+		list_delete_entry(&tsk->pacing_list);
+
+	// before the first one due later
+	struct tcp_sock *pos;
+	list_for_each_entry(pos, &pacing_list, pacing_list)
+	{
+		if (pos->pacing_due > due)
+			break;
+	}
+	list_insert(&tsk->pacing_list, pos->pacing_list.prev, &pos->pacing_list);
+	tsk->pacing_due = due;
+
+	// the pacing thread sleeps until the first one
+	if (pacing_list.next == &tsk->pacing_list)
+		pthread_cond_signal(&pacing_cond);
+	pthread_mutex_unlock(&pacing_lock);
+}
+
+void tcp_unset_pacing_timer(struct tcp_sock *tsk)
+{
+	pthread_mutex_lock(&pacing_lock);
+	if (tsk->pacing_due)
+	{
+		list_delete_entry(&tsk->pacing_list);
+		tsk->pacing_due = 0;
+	}
+	pthread_mutex_unlock(&pacing_lock);
+}
+
+u64 tcp_pacing_timer_next()
+{
+	u64 due = 0;
+	pthread_mutex_lock(&pacing_lock);
+	if (!list_empty(&pacing_list))
+	{
+		struct tcp_sock *tsk = list_entry(pacing_list.next, struct tcp_sock, pacing_list);
+		due = tsk->pacing_due;
+	}
+	pthread_mutex_unlock(&pacing_lock);
+
+	return due;
+}
+
+// take the first tcp sock out of pacing_list if it is due, NULL otherwise
+static struct tcp_sock *tcp_pacing_timer_pop(u64 now)
+{
+	struct tcp_sock *tsk = NULL;
+	pthread_mutex_lock(&pacing_lock);
+	if (!list_empty(&pacing_list))
+	{
+		tsk = list_entry(pacing_list.next, struct tcp_sock, pacing_list);
+		if (tsk->pacing_due <= now)
+		{
+			list_delete_entry(&tsk->pacing_list);
+			tsk->pacing_due = 0;
+		}
+		else
+			tsk = NULL;
+	}
+	pthread_mutex_unlock(&pacing_lock);
+
+	return tsk;
+}
+
+// the tcp socks are pushed one by one, since tcp_push may hold one again
+void tcp_run_pacing_timers()
+{
+	u64 now = tcp_time_us();
+	struct tcp_sock *tsk;
+	while ((tsk = tcp_pacing_timer_pop(now)) != NULL)
+	{
+		if (tcp_sock_sending(tsk))
+			tcp_push(tsk, 0);
+	}
+}
+
+// wait until the first tcp sock held by pacing is due, and push the due ones
+// along with the incoming segments, like tcp_timer_thread
+void *tcp_pacing_thread(void *arg)
+{
+	while (1)
+	{
+		pthread_mutex_lock(&pacing_lock);
+		while (1)
+		{
+			if (list_empty(&pacing_list))
+			{
+				pthread_cond_wait(&pacing_cond, &pacing_lock);
+				continue;
+			}
+
+			struct tcp_sock *tsk = list_entry(pacing_list.next, struct tcp_sock,
+											  pacing_list);
+			u64 due = tsk->pacing_due;
+			if (due <= tcp_time_us())
+				break;
+
+			struct timespec ts;
+			ts.tv_sec = due / 1000000;
+			ts.tv_nsec = due % 1000000 * 1000;
+			pthread_cond_timedwait(&pacing_cond, &pacing_lock, &ts);
+		}
+		pthread_mutex_unlock(&pacing_lock);
+
+		pthread_mutex_lock(&tcp_lock);
+		tcp_run_pacing_timers();
+		pthread_mutex_unlock(&tcp_lock);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,485 @@
+#include "xsk.h"
+#include "base.h"
+#include "ether.h"
+#include "netdev.h"
+
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// one of the four rings shared with the kernel, the entries are either frame
+// addresses (fill and completion ring) or struct xdp_desc (rx and tx ring)
+struct xsk_ring {
+	u32 *producer;
+	u32 *consumer;
+	u32 *flags;
+	void *ring;
+	u32 size;
+	u32 mask;
+	u32 cached_prod;
+	u32 cached_cons;
+	void *map;
+	size_t map_len;
+};
+
+// the AF_XDP socket of an interface, together with its UMEM and rings
+struct xsk {
+	int fd;						// AF_XDP socket
+	int map_fd;					// XSKMAP redirecting frames to the socket
+	int prog_fd;				// XDP program looking up map_fd
+	int link_fd;				// attachment of prog_fd to the interface
+	char *umem;					// frames shared with the kernel
+	size_t umem_len;
+
+	struct xsk_ring fill;		// frames given to the kernel for receiving
+	struct xsk_ring comp;		// frames the kernel has finished sending
+	struct xsk_ring rx;			// frames received
+	struct xsk_ring tx;			// frames to be sent
+
+	u64 tx_free[XSK_FRAME_NR / 2];	// frames available for sending
+	int tx_nfree;
+	int tx_queued;				// frames queued since the last kick
+	pthread_mutex_t tx_lock;	// senders come from different threads
+
+	u64 rx_frames;				// number of frames received
+	u64 rx_batches;				// number of receive batches
+	u64 tx_frames;				// number of frames sent
+	u64 tx_kicks;				// number of send syscalls
+	u64 tx_full;				// frames dropped for lack of tx slots
+};
+
+static inline int sys_bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// load an XDP program redirecting every frame to the socket bound to its queue:
+//
+//   return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+//
+// frames of queues without socket go on to the kernel stack
+static int xsk_load_prog(int map_fd)
+{
+	struct bpf_insn insns[] = {
+		// r2 = ctx->rx_queue_index
+		{ .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2,
+			.src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+		// r1 = map_fd (64-bit immediate, two instructions)
+		{ .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1,
+			.src_reg = BPF_PSEUDO_MAP_FD, .imm = map_fd },
+		{ 0 },
+		// r3 = XDP_PASS
+		{ .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+		// r0 = bpf_redirect_map(r1, r2, r3)
+		{ .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+		{ .code = BPF_JMP | BPF_EXIT },
+	};
+
+	static char license[] = "GPL";
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (u64)(unsigned long)insns;
+	attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+	attr.license = (u64)(unsigned long)license;
+
+	return sys_bpf(BPF_PROG_LOAD, &attr);
+}
+
+static int xsk_setup_prog(iface_info_t *iface, struct xsk *xsk)
+{
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(u32);
+	attr.value_size = sizeof(u32);
+	attr.max_entries = XSK_MAP_SIZE;
+	xsk->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+	if (xsk->map_fd < 0) {
+		perror("creating XSKMAP failed");
+		return -1;
+	}
+
+	xsk->prog_fd = xsk_load_prog(xsk->map_fd);
+	if (xsk->prog_fd < 0) {
+		perror("loading XDP program failed");
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = xsk->prog_fd;
+	attr.link_create.target_ifindex = iface->index;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = ustack_conf.xdp_drv_mode ? XDP_FLAGS_DRV_MODE : \
+							 XDP_FLAGS_SKB_MODE;
+	xsk->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+	if (xsk->link_fd < 0) {
+		perror("attaching XDP program failed");
+		return -1;
+	}
+
+	u32 key = ustack_conf.xdp_queue;
+	u32 value = xsk->fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = xsk->map_fd;
+	attr.key = (u64)(unsigned long)&key;
+	attr.value = (u64)(unsigned long)&value;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0) {
+		perror("inserting socket into XSKMAP failed");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int xsk_map_ring(struct xsk *xsk, struct xsk_ring *r,
+		struct xdp_ring_offset *off, size_t entry_size, off_t pgoff)
+{
+	r->map_len = off->desc + XSK_RING_SIZE * entry_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, xsk->fd, pgoff);
+	if (r->map == MAP_FAILED) {
+		perror("mmap() xsk ring failed");
+		return -1;
+	}
+
+	r->producer = (u32 *)((char *)r->map + off->producer);
+	r->consumer = (u32 *)((char *)r->map + off->consumer);
+	r->flags = (u32 *)((char *)r->map + off->flags);
+	r->ring = (char *)r->map + off->desc;
+	r->size = XSK_RING_SIZE;
+	r->mask = XSK_RING_SIZE - 1;
+
+	return 0;
+}
+
+// number of entries that could be produced into r
+static inline u32 xsk_prod_free(struct xsk_ring *r)
+{
+	r->cached_cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE);
+	return r->size - (r->cached_prod - r->cached_cons);
+}
+
+static inline void xsk_prod_submit(struct xsk_ring *r, u32 n)
+{
+	r->cached_prod += n;
+	__atomic_store_n(r->producer, r->cached_prod, __ATOMIC_RELEASE);
+}
+
+// number of entries that could be consumed from r
+static inline u32 xsk_cons_avail(struct xsk_ring *r)
+{
+	r->cached_prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+	return r->cached_prod - r->cached_cons;
+}
+
+static inline void xsk_cons_release(struct xsk_ring *r, u32 n)
+{
+	r->cached_cons += n;
+	__atomic_store_n(r->consumer, r->cached_cons, __ATOMIC_RELEASE);
+}
+
+static inline u64 *xsk_addr(struct xsk_ring *r, u32 idx)
+{
+	return &((u64 *)r->ring)[idx & r->mask];
+}
+
+static inline struct xdp_desc *xsk_desc(struct xsk_ring *r, u32 idx)
+{
+	return &((struct xdp_desc *)r->ring)[idx & r->mask];
+}
+
+static void xsk_free(struct xsk *xsk)
+{
+	struct xsk_ring *rings[] = { &xsk->fill, &xsk->comp, &xsk->rx, &xsk->tx };
+	for (int i = 0; i < 4; i++) {
+		if (rings[i]->map && rings[i]->map != MAP_FAILED)
+			munmap(rings[i]->map, rings[i]->map_len);
+	}
+
+	int fds[] = { xsk->link_fd, xsk->prog_fd, xsk->map_fd, xsk->fd };
+	for (int i = 0; i < 4; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+
+	if (xsk->umem && xsk->umem != MAP_FAILED)
+		munmap(xsk->umem, xsk->umem_len);
+
+	free(xsk);
+}
+
+// create an AF_XDP socket on the configured queue of iface, which is used for
+// both receiving and sending
+int xsk_setup(iface_info_t *iface)
+{
+	struct xsk *xsk = malloc(sizeof(struct xsk));
+	memset(xsk, 0, sizeof(struct xsk));
+	xsk->link_fd = xsk->prog_fd = xsk->map_fd = -1;
+
+	xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+	if (xsk->fd < 0) {
+		perror("creating AF_XDP socket failed");
+		goto fail;
+	}
+
+	xsk->umem_len = (size_t)XSK_FRAME_NR * XSK_FRAME_SIZE;
+	xsk->umem = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		perror("mmap() UMEM failed");
+		goto fail;
+	}
+
+	struct xdp_umem_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (u64)(unsigned long)xsk->umem;
+	reg.len = xsk->umem_len;
+	reg.chunk_size = XSK_FRAME_SIZE;
+	reg.headroom = 0;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+		perror("setsockopt() XDP_UMEM_REG failed");
+		goto fail;
+	}
+
+	int ring_size = XSK_RING_SIZE;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(int)) < 0 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(int)) < 0 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(int)) < 0 ||
+			setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(int)) < 0) {
+		perror("setsockopt() xsk ring size failed");
+		goto fail;
+	}
+
+	struct xdp_mmap_offsets off;
+	socklen_t optlen = sizeof(off);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+		perror("getsockopt() XDP_MMAP_OFFSETS failed");
+		goto fail;
+	}
+
+	if (xsk_map_ring(xsk, &xsk->fill, &off.fr, sizeof(u64), XDP_UMEM_PGOFF_FILL_RING) < 0 ||
+			xsk_map_ring(xsk, &xsk->comp, &off.cr, sizeof(u64), XDP_UMEM_PGOFF_COMPLETION_RING) < 0 ||
+			xsk_map_ring(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) < 0 ||
+			xsk_map_ring(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0)
+		goto fail;
+
+	// give the first half of UMEM to the kernel for receiving, and keep the
+	// other half for sending
+	for (u32 i = 0; i < XSK_RING_SIZE; i++)
+		*xsk_addr(&xsk->fill, i) = (u64)i * XSK_FRAME_SIZE;
+	xsk_prod_submit(&xsk->fill, XSK_RING_SIZE);
+
+	for (int i = 0; i < XSK_FRAME_NR / 2; i++)
+		xsk->tx_free[i] = (u64)(XSK_FRAME_NR / 2 + i) * XSK_FRAME_SIZE;
+	xsk->tx_nfree = XSK_FRAME_NR / 2;
+	pthread_mutex_init(&xsk->tx_lock, NULL);
+
+	struct sockaddr_xdp sxdp;
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = iface->index;
+	sxdp.sxdp_queue_id = ustack_conf.xdp_queue;
+	sxdp.sxdp_flags = (ustack_conf.xdp_zerocopy ? XDP_ZEROCOPY : XDP_COPY) | \
+					  XDP_USE_NEED_WAKEUP;
+	if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+		perror("binding AF_XDP socket failed");
+		goto fail;
+	}
+
+	if (xsk_setup_prog(iface, xsk) < 0)
+		goto fail;
+
+	// the AF_XDP socket takes over receiving and sending
+	iface->fd = xsk->fd;
+	iface->xsk = xsk;
+
+	log(DEBUG, "AF_XDP socket of %s: queue %d, %s mode, %s.", iface->name,
+			ustack_conf.xdp_queue, ustack_conf.xdp_drv_mode ? "driver" : "generic",
+			ustack_conf.xdp_zerocopy ? "zero-copy" : "copy");
+
+	return 0;
+
+fail:
+	xsk_free(xsk);
+	return -1;
+}
+
+void xsk_destroy(iface_info_t *iface)
+{
+	if (!iface->xsk)
+		return ;
+
+	pthread_mutex_destroy(&iface->xsk->tx_lock);
+	xsk_free(iface->xsk);
+	iface->xsk = NULL;
+	iface->fd = -1;
+}
+
+// hand at most budget frames in the rx ring to handle_packet straight out of
+// UMEM, and give the frames back to the fill ring once they are handled
+//
+// Like the frames of the mmap'ed receive ring, the frames are borrowed, those
+// who want to keep it should call packet_own (see packet.h).
+int xsk_receive(iface_info_t *iface, int budget)
+{
+	struct xsk *xsk = iface->xsk;
+	int n = 0;
+
+	while (n < budget) {
+		u32 avail = xsk_cons_avail(&xsk->rx);
+		if (avail == 0)
+			break;
+		if (avail > XSK_RX_BATCH)
+			avail = XSK_RX_BATCH;
+		if (avail > budget - n)
+			avail = budget - n;
+
+		// every frame received comes from the fill ring, thus there is always
+		// room to give it back
+		for (u32 i = 0; i < avail; i++) {
+			struct xdp_desc *desc = xsk_desc(&xsk->rx, xsk->rx.cached_cons + i);
+			handle_packet(iface, xsk->umem + desc->addr, desc->len);
+			*xsk_addr(&xsk->fill, xsk->fill.cached_prod + i) = \
+				desc->addr & ~((u64)XSK_FRAME_SIZE - 1);
+		}
+
+		xsk_cons_release(&xsk->rx, avail);
+		xsk_prod_submit(&xsk->fill, avail);
+
+		xsk->rx_frames += avail;
+		xsk->rx_batches += 1;
+		n += avail;
+	}
+
+	if (*xsk->fill.flags & XDP_RING_NEED_WAKEUP)
+		recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+
+	return n;
+}
+
+// must be called with tx_lock held
+static void xsk_reap_completion(struct xsk *xsk)
+{
+	u32 done = xsk_cons_avail(&xsk->comp);
+	for (u32 i = 0; i < done; i++)
+		xsk->tx_free[xsk->tx_nfree++] = *xsk_addr(&xsk->comp, xsk->comp.cached_cons + i);
+	xsk_cons_release(&xsk->comp, done);
+}
+
+// must be called with tx_lock held
+static void xsk_kick(struct xsk *xsk)
+{
+	if (*xsk->tx.flags & XDP_RING_NEED_WAKEUP) {
+		if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && \
+				errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+			perror("Send AF_XDP frames failed");
+		xsk->tx_kicks += 1;
+	}
+
+	xsk->tx_queued = 0;
+}
+
+// copy packet into a free frame of UMEM and put it on the tx ring
+//
+// If defer is set, the kernel is kicked when xsk_flush is called, so that all
+// the frames queued during one pass of the event loop are sent by one syscall.
+void xsk_send(iface_info_t *iface, const char *packet, int len, int defer)
+{
+	struct xsk *xsk = iface->xsk;
+	if (len > XSK_FRAME_SIZE) {
+		log(ERROR, "packet of %d bytes does not fit in UMEM frame, drop it.", len);
+		return ;
+	}
+
+	pthread_mutex_lock(&xsk->tx_lock);
+
+	xsk_reap_completion(xsk);
+	if (xsk->tx_nfree == 0 || xsk_prod_free(&xsk->tx) == 0) {
+		// push out what has been queued, and try again
+		xsk_kick(xsk);
+		xsk_reap_completion(xsk);
+		if (xsk->tx_nfree == 0 || xsk_prod_free(&xsk->tx) == 0) {
+			xsk->tx_full += 1;
+			pthread_mutex_unlock(&xsk->tx_lock);
+			return ;
+		}
+	}
+
+	u64 addr = xsk->tx_free[--xsk->tx_nfree];
+	memcpy(xsk->umem + addr, packet, len);
+
+	struct xdp_desc *desc = xsk_desc(&xsk->tx, xsk->tx.cached_prod);
+	desc->addr = addr;
+	desc->len = len;
+	desc->options = 0;
+	xsk_prod_submit(&xsk->tx, 1);
+
+	xsk->tx_frames += 1;
+	xsk->tx_queued += 1;
+
+	if (!defer)
+		xsk_kick(xsk);
+
+	pthread_mutex_unlock(&xsk->tx_lock);
+}
+
+// kick the kernel to send all the frames queued on iface
+void xsk_flush(iface_info_t *iface)
+{
+	struct xsk *xsk = iface->xsk;
+	if (!xsk)
+		return ;
+
+	pthread_mutex_lock(&xsk->tx_lock);
+	if (xsk->tx_queued)
+		xsk_kick(xsk);
+	xsk_reap_completion(xsk);
+	pthread_mutex_unlock(&xsk->tx_lock);
+}
+
+// check whether packet points into the UMEM of iface
+int xsk_contains(iface_info_t *iface, const char *packet)
+{
+	struct xsk *xsk = iface->xsk;
+	return xsk && packet >= xsk->umem && packet < xsk->umem + xsk->umem_len;
+}
+
+void xsk_dump_stats(iface_info_t *iface, FILE *fp)
+{
+	struct xsk *xsk = iface->xsk;
+	if (!xsk)
+		return ;
+
+	fprintf(fp, "%s: xsk received %lu frames in %lu batches, sent %lu frames "
+			"by %lu kicks, dropped %lu for lack of tx slots\n", iface->name,
+			xsk->rx_frames, xsk->rx_batches, xsk->tx_frames, xsk->tx_kicks,
+			xsk->tx_full);
+
+	struct xdp_statistics stats;
+	socklen_t optlen = sizeof(stats);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &stats, &optlen) == 0) {
+		fprintf(fp, "%s: xsk kernel drops: rx %llu, rx ring full %llu, "
+				"fill ring empty %llu, invalid rx %llu, invalid tx %llu\n",
+				iface->name, stats.rx_dropped, stats.rx_ring_full,
+				stats.rx_fill_ring_empty_descs, stats.rx_invalid_descs,
+				stats.tx_invalid_descs);
+	}
+}